@@ -0,0 +1,47 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_arena.h
+ * Reference counted arenas: many small allocations which are all freed together
+ */
+
+#ifndef EDSAC_ARENA_H
+#define EDSAC_ARENA_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stddef.h>
+#include <stdatomic.h>
+
+// declarations
+
+// one block of memory handed out from the front. Only one thread allocates from it but references can be dropped from any thread
+typedef struct Arena {
+    atomic_uint refs;
+    size_t used;
+    size_t capacity;
+    char data[];
+} Arena;
+
+// allocates an arena with room for capacity bytes, holding one reference
+// returns NULL if we run out of memory
+Arena *arena_new(size_t capacity);
+
+// size bytes from the arena (not aligned: this is for strings)
+// returns NULL if there isn't room
+char *arena_alloc(Arena *arena, size_t size);
+
+// takes another reference
+void arena_ref(Arena *arena);
+
+// drops a reference. The arena is freed when the last one goes
+void arena_unref(Arena *arena);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_ARENA_H
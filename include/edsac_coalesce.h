@@ -0,0 +1,78 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_coalesce.h
+ * Folds repeats of the same message within a time window into one
+ */
+
+#ifndef EDSAC_COALESCE_H
+#define EDSAC_COALESCE_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <glib.h>
+
+// declarations
+
+/* The first time a message is seen it is passed on straight away and a window starts for it.
+Copies of it which turn up before the window ends are folded into one value, which is held until the window ends and then handed out by coalesce_expire.
+If any copies turned up the window starts again (so a storm which goes on and on comes out as one value per window), otherwise the message is forgotten.
+Only ever used by one thread */
+
+// the most messages remembered at once. Beyond this new messages are passed on without being remembered
+#define COALESCE_MAX_ENTRIES 65536
+
+// what makes two messages the same
+typedef struct {
+    uint32_t address;
+    int type;
+    int valve_no;
+    const char *text;
+    size_t text_len;
+} CoalesceKey;
+
+// one message being remembered (internal)
+typedef struct CoalesceEntry CoalesceEntry;
+
+// the messages seen in the last window
+typedef struct {
+    GHashTable *entries;  // CoalesceEntry -> itself
+    CoalesceEntry *head;  // oldest first, which is also the order their windows end in
+    CoalesceEntry *tail;
+    uint64_t window_ms;
+} Coalescer;
+
+// sets up an empty coalescer whose windows last window_ms milliseconds
+// returns success
+bool coalesce_init(Coalescer *coalescer, uint64_t window_ms);
+
+// forgets everything. Values still being held are given to release
+void coalesce_free(Coalescer *coalescer, void (*release)(void *value));
+
+// notes that a message was seen at now_ms (on a monotonic clock). value stands for it
+// returns NULL if it is the first like it in the window: pass value on
+// otherwise returns the value being held for the window, which now stands for one more copy. This is value itself the first time
+// (the coalescer keeps it until the window ends). Any other time value isn't needed any more
+void *coalesce_add(Coalescer *coalescer, const CoalesceKey *key, void *value, uint64_t now_ms);
+
+// hands out up to max values held for windows which ended by now_ms, oldest first
+// returns how many were put in values
+size_t coalesce_expire(Coalescer *coalescer, uint64_t now_ms, void **values, size_t max);
+
+// when the next window ends (in now_ms terms), or 0 if no windows are open
+uint64_t coalesce_next_deadline(const Coalescer *coalescer);
+
+// how many messages are being remembered
+size_t coalesce_size(const Coalescer *coalescer);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_COALESCE_H
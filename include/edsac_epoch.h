@@ -0,0 +1,89 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_epoch.h
+ * Epoch based reclamation: lets readers look at shared objects without locks while the owner retires them
+ */
+
+#ifndef EDSAC_EPOCH_H
+#define EDSAC_EPOCH_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// declarations
+
+/* How it works: there is a global epoch. A reader announces the epoch it saw when it started (epoch_enter) and withdraws when it is finished (epoch_exit).
+The global epoch can only move on once every reader has seen the current one, so something retired in epoch e can't be held by any reader once the global epoch reaches e + 2.
+Readers never wait for anything and never write to a cache line anyone else writes to, apart from the rare epoch_enter which finds its usual record taken */
+
+// the size of a cache line. Things written by different threads are kept this far apart
+#define EPOCH_CACHE_LINE 64
+
+// the most readers which can be in a read-side section at the same time. epoch_enter spins when there are more
+#define EPOCH_MAX_READERS 64
+
+// one reader's announcement: 0 when not in use, otherwise (epoch << 1) | 1
+typedef struct {
+    _Alignas(EPOCH_CACHE_LINE) atomic_uint_least64_t state;
+} EpochRecord;
+
+// a set of readers and the epoch they agree on
+typedef struct {
+    _Alignas(EPOCH_CACHE_LINE) atomic_uint_least64_t epoch;
+    EpochRecord records[EPOCH_MAX_READERS];
+} EpochDomain;
+
+// something waiting to be reclaimed. Embed this in the object being retired
+typedef struct EpochNode {
+    struct EpochNode *next;
+    uint64_t epoch; // when it was retired
+} EpochNode;
+
+// called once nobody can be looking at node any more
+typedef void (*epoch_reclaim_t)(EpochNode *node, void *arg);
+
+// what one writer has retired but not yet reclaimed, oldest first. Only ever used by one thread
+typedef struct {
+    EpochNode *head;
+    EpochNode *tail;
+    size_t count;
+    epoch_reclaim_t reclaim;
+    void *arg; // passed to reclaim
+} EpochLimbo;
+
+// sets up a domain with no readers
+void epoch_domain_init(EpochDomain *domain);
+
+// starts a read-side section: until the matching epoch_exit nothing retired from now on is reclaimed
+// returns the record to give to epoch_exit
+EpochRecord *epoch_enter(EpochDomain *domain);
+
+// ends a read-side section
+void epoch_exit(EpochRecord *record);
+
+// sets up an empty limbo list which hands nodes to reclaim(node, arg)
+void epoch_limbo_init(EpochLimbo *limbo, epoch_reclaim_t reclaim, void *arg);
+
+// retires node. It must already be unreachable for readers who start from now on
+void epoch_retire(EpochDomain *domain, EpochLimbo *limbo, EpochNode *node);
+
+// moves the epoch on if every reader has caught up and reclaims everything which is now safe
+// returns how many nodes were reclaimed
+size_t epoch_reclaim(EpochDomain *domain, EpochLimbo *limbo);
+
+// reclaims everything in limbo without waiting. Only for when there can't be any readers left
+void epoch_limbo_drain(EpochLimbo *limbo);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_EPOCH_H
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_fair.h
+ * Queues which take turns between flows (deficit round robin)
+ */
+
+#ifndef EDSAC_FAIR_H
+#define EDSAC_FAIR_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <glib.h>
+
+// declarations
+
+/* Values are queued per flow (e.g. per node) and each flow keeps its own order. Flows with something queued take turns:
+each turn a flow gets quantum more credit and hands out values for as long as their costs fit in its credit (Shreedhar and Varghese's deficit round robin).
+So over time every busy flow gets the same share whatever the cost of its values, and a flow with a lot queued can't push the others to the back.
+Everything is behind one lock: producers and consumers each take it once per push or pop */
+
+// one flow's queue (internal)
+typedef struct FairFlow FairFlow;
+
+// a set of flows
+typedef struct {
+    pthread_mutex_t lock;
+    GHashTable *flows; // key -> FairFlow, for flows with something queued
+    FairFlow *head;    // flows with something queued in the order they get their turns. head is having its turn
+    FairFlow *tail;
+    FairFlow *spare;   // empty flows kept for reuse
+    size_t num_spare;
+    size_t quantum;
+    size_t capacity;
+    size_t watch_below;
+    atomic_size_t size;
+} FairQueue;
+
+// sets up an empty queue with room for capacity values, in which each flow gets quantum more credit per turn
+// fair_watch reports flows once they get down to watch_below values
+// returns success
+bool fair_init(FairQueue *queue, size_t capacity, size_t quantum, size_t watch_below);
+
+// frees the queue. Whatever is still in it is not freed
+void fair_free(FairQueue *queue);
+
+// adds value (which must not be NULL) to the back of flow key. cost is how much of the flow's credit it uses
+// returns false if the queue is full (or we run out of memory)
+bool fair_push(FairQueue *queue, uint32_t key, void *value, size_t cost);
+
+// takes up to max values from the flows in turn
+// *drained (if not NULL) is set if a flow which was being watched got down to watch_below values
+// returns how many were put in values (0 if the queue is empty)
+size_t fair_pop_batch(FairQueue *queue, void **values, size_t max, bool *drained);
+
+// takes the next value
+// returns NULL if the queue is empty
+void *fair_pop(FairQueue *queue);
+
+// if flow key has at least limit values queued, watches it so that fair_pop_batch says when it has got down to watch_below
+// returns whether it had that many
+bool fair_watch(FairQueue *queue, uint32_t key, size_t limit);
+
+// how many values are queued in flow key
+size_t fair_flow_size(FairQueue *queue, uint32_t key);
+
+// how many values are queued altogether. Only a snapshot while others are pushing and popping
+size_t fair_size(FairQueue *queue);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_FAIR_H
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_framing.h
+ * Receive buffers and finding where messages start and end in a stream of bytes
+ */
+
+#ifndef EDSAC_FRAMING_H
+#define EDSAC_FRAMING_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stdbool.h>
+#include <stddef.h>
+
+// declarations
+
+// bytes received on a connection which have not been turned into messages yet
+// data[start] to data[end - 1] are waiting. There is always room for a '\0' at data[end]
+typedef struct {
+    char *data;
+    size_t start;
+    size_t end;
+    size_t capacity;     // not including the byte kept for '\0'
+    bool shared;         // see recv_buffer_init_shared
+    struct Arena *block; // if shared, the arena data is in
+} RecvBuffer;
+
+// the initial size of a receive buffer
+#define RECV_BUFFER_INITIAL 4096
+
+// a receive buffer never grows beyond this. If a frame doesn't fit then something is wrong with the sender
+#define RECV_BUFFER_MAX (1 << 20)
+
+// initialises an empty receive buffer. Nothing is allocated until the first recv_buffer_reserve
+void recv_buffer_init(RecvBuffer *buf);
+
+// initialises an empty receive buffer whose data is kept in a reference counted arena, so that others can hold on to bytes from it
+// (see recv_buffer_share). Bytes which have been consumed are never moved or written over while anyone else has a reference:
+// the buffer moves to a new arena instead, taking only what is still waiting with it
+void recv_buffer_init_shared(RecvBuffer *buf);
+
+// frees the memory held by a receive buffer. A shared buffer's arena lasts until the last reference to it goes
+void recv_buffer_free(RecvBuffer *buf);
+
+// takes a reference to the arena holding a shared buffer's data. Everything in data[0] to data[end - 1] stays where it is until it is dropped
+// returns NULL if the buffer isn't shared or has nothing in it
+struct Arena *recv_buffer_share(RecvBuffer *buf);
+
+// makes room for at least len more bytes (moving what is waiting to the front or growing the buffer)
+// returns where to put them or NULL if the buffer can't grow any more. *space is set to how much room there is
+char *recv_buffer_reserve(RecvBuffer *buf, size_t len, size_t *space);
+
+// records that len bytes were written where recv_buffer_reserve said
+void recv_buffer_commit(RecvBuffer *buf, size_t len);
+
+// copies len bytes onto the end of the buffer
+// returns success
+bool recv_buffer_append(RecvBuffer *buf, const char *data, size_t len);
+
+// drops len bytes from the start of the buffer
+void recv_buffer_consume(RecvBuffer *buf, size_t len);
+
+// result of looking for a frame
+typedef enum {
+    FRAME_FOUND,   // a whole frame is available
+    FRAME_PARTIAL, // the start of a frame is available but the rest hasn't arrived yet
+    FRAME_INVALID, // this isn't a frame
+} FrameStatus;
+
+// how far through a frame we have got. This lets find_frame carry on where it left off when more of the frame arrives
+// braces inside strings don't count. Like simdjson, a backslash escapes the next character (so \" doesn't end a string)
+typedef struct {
+    size_t scanned; // bytes after the start of the frame which have already been looked at
+    int depth;      // how deeply nested we are in braces
+    bool in_string;
+    bool escaped;   // the last byte looked at was an escaping backslash
+} FrameScanner;
+
+// starts looking for a new frame
+void frame_scanner_reset(FrameScanner *scanner);
+
+// looks for a json object ("{...}", handling nesting and strings) at the start of data[0] to data[len - 1]
+// newlines and carriage returns before the object are skipped so that one can telnet in for testing
+// on FRAME_FOUND the object is data[*frame_start] to data[*frame_end - 1] and the scanner is reset for the next frame
+// on FRAME_PARTIAL *frame_start is where the frame starts. Call again with data starting at the same frame (or at *frame_start) once there is more
+FrameStatus find_frame(FrameScanner *scanner, const char *data, size_t len, size_t *frame_start, size_t *frame_end);
+
+// how a connection separates one message from the next
+typedef enum {
+    FRAMING_BRACES,          // each message is a json object. The end is found by matching braces (what old senders do)
+    FRAMING_NDJSON,          // each message is followed by '\n'
+    FRAMING_LENGTH_PREFIXED, // each message follows its length as a 4 byte big endian integer
+} FramingMode;
+
+/* A sender which doesn't use FRAMING_BRACES starts the connection with a preamble: '\0', 'E', 'D' and then 'N' (NDJSON) or 'L' (length prefixed).
+A brace framed connection can't start with '\0' so old senders keep working */
+#define FRAMING_PREAMBLE_LEN 4
+
+// the longest message which can be sent with FRAMING_LENGTH_PREFIXED
+#define FRAME_MAX_LEN ((RECV_BUFFER_MAX) - 4)
+
+// writes the preamble for mode to preamble (which has room for FRAMING_PREAMBLE_LEN bytes)
+// returns how many bytes were written (none for FRAMING_BRACES)
+size_t framing_preamble(FramingMode mode, char *preamble);
+
+// works out how a connection is framed from the first bytes received on it
+// on FRAME_FOUND *mode is set and the first *preamble_len bytes should be skipped. FRAME_PARTIAL means we need more bytes
+FrameStatus detect_framing(const char *data, size_t len, FramingMode *mode, size_t *preamble_len);
+
+// looks for a newline terminated message at the start of data[0] to data[len - 1]. Blank lines before it are skipped
+// the message does not include the newline (or a carriage return before it). Otherwise this works like find_frame
+FrameStatus find_ndjson_frame(FrameScanner *scanner, const char *data, size_t len, size_t *frame_start, size_t *frame_end);
+
+// looks for a length prefixed message at the start of data[0] to data[len - 1]
+// the message does not include the prefix. Otherwise this works like find_frame
+FrameStatus find_length_prefixed_frame(const char *data, size_t len, size_t *frame_start, size_t *frame_end);
+
+// finds the next message using whichever of the above goes with mode
+FrameStatus next_frame(FramingMode mode, FrameScanner *scanner, const char *data, size_t len, size_t *frame_start, size_t *frame_end);
+
+// ways find_frame can look for the end of a frame
+typedef enum {
+    FRAME_SCAN_SCALAR, // one byte at a time
+    FRAME_SCAN_SSE2,   // 64 bytes at a time (x86_64 only)
+    FRAME_SCAN_AVX2,   // 64 bytes at a time (x86_64 with AVX2 only)
+} FrameScanImpl;
+
+// the fastest way this CPU supports. This is what find_frame uses unless told otherwise
+FrameScanImpl frame_scan_best(void);
+
+// makes find_frame use impl. For tests and benchmarks: don't call this while find_frame is running
+// returns false if this CPU can't do it
+bool frame_scan_use(FrameScanImpl impl);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_FRAMING_H
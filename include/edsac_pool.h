@@ -0,0 +1,97 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_pool.h
+ * Per-thread slab pools of fixed size objects which any thread can free back to
+ */
+
+#ifndef EDSAC_POOL_H
+#define EDSAC_POOL_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// declarations
+
+/* Each pool belongs to one thread at a time, which allocates from it without any atomics: objects come off its own free list,
+then off the list of objects other threads have given back (taken all at once with one exchange) and only then from a new slab.
+Any thread can free an object. Frees from the owner go straight onto its free list; frees from anyone else are pushed onto the
+owner's remote list with a compare and swap. Slabs are kept until pool_set_free so that objects can outlive their thread */
+
+// the size of a cache line. What the owner writes is kept apart from what other threads write
+#define POOL_CACHE_LINE 64
+
+// in front of every object: where it goes back to. Sized so that the object after it is suitably aligned for anything
+typedef struct PoolObject {
+    _Alignas(max_align_t) struct PoolObject *next; // on a free list
+    struct Pool *pool; // NULL if it was allocated with pool_alloc_unpooled
+} PoolObject;
+
+// one thread's objects
+typedef struct Pool {
+    _Alignas(POOL_CACHE_LINE) PoolObject *free_list; // only used by the owner
+    void *slabs; // linked through their first word
+    size_t object_size; // including the PoolObject
+    size_t slab_objects;
+    // written only by the owner, read by pool_set_stats
+    atomic_size_t allocations;
+    atomic_size_t hits; // allocations which didn't need a new slab
+    atomic_size_t num_slabs;
+    _Alignas(POOL_CACHE_LINE) _Atomic(PoolObject *) remote_free; // freed by other threads
+    atomic_bool owned; // some thread has claimed the pool
+    struct Pool *next; // in the set. Never changes once the pool is in the set
+} Pool;
+
+// all of the pools for one kind of object. Pools are added when more threads want one at once than there are free, and never removed
+typedef struct {
+    _Atomic(Pool *) pools;
+    size_t object_size;
+    size_t slab_objects;
+} PoolSet;
+
+typedef struct {
+    size_t allocations;
+    size_t hits;           // allocations which didn't need a new slab
+    size_t slabs;
+    size_t resident_bytes; // held by the slabs, whether in use or not
+} PoolStats;
+
+// sets up an empty set of pools for objects of object_size bytes, allocated slab_objects at a time
+void pool_set_init(PoolSet *set, size_t object_size, size_t slab_objects);
+
+// frees every pool and slab. Only when no objects are in use and no pool is claimed
+void pool_set_free(PoolSet *set);
+
+// adds up the stats for every pool in the set
+void pool_set_stats(PoolSet *set, PoolStats *stats);
+
+// claims an unowned pool for the calling thread, adding a new one if they are all owned
+// returns NULL if we run out of memory
+Pool *pool_claim(PoolSet *set);
+
+// gives up a pool. What it holds stays in it for the next thread to claim it
+void pool_release(Pool *pool);
+
+// allocates an object from a pool the calling thread has claimed
+// returns NULL if we run out of memory
+void *pool_alloc(Pool *pool);
+
+// allocates an object with malloc which pool_free can still free, for threads without a pool
+// returns NULL if we run out of memory
+void *pool_alloc_unpooled(size_t size);
+
+// frees an object from pool_alloc or pool_alloc_unpooled. Safe from any thread
+// local is the calling thread's pool (NULL if it hasn't got one): objects from there are freed without any atomics
+void pool_free(void *object, Pool *local);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_POOL_H
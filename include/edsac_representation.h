@@ -16,6 +16,7 @@ extern "C" {
 // includes
 #include <stdbool.h>
 #include <sys/types.h> // ssize_t size_t 
+#include <stddef.h>
 #include <stdint.h>
 #include <glib.h>
 
@@ -84,6 +85,68 @@ bool decode_message(const char* encoded_message, Message *message);
 // frees dynamically allocated memory *within* a message (aka this will not free the message structure itself)
 void free_message(Message *msg);
 
+// a message which keeps its text inside itself rather than in a GString, so that making one doesn't allocate and it has nothing to free
+// texts longer than MAX_MSG_LEN are cut short
+typedef struct {
+    MessageType type;
+    int valve_no;               // HARD_ERROR_VALVE only
+    uint8_t len;                // of text
+    char text[MAX_MSG_LEN + 1]; // nul terminated. Empty for KEEP_ALIVE
+} CompactMessage;
+
+// the longest encode_compact_message can make (every character of the text escaped as \u00XX)
+#define MAX_COMPACT_ENCODED_LEN (6 * (MAX_MSG_LEN) + 100)
+
+// the CompactMessage versions of hardware_error_valve, hardware_error_other, software_error and keep_alive
+void compact_hardware_error_valve(CompactMessage *message, int valve_no, const char *string);
+void compact_hardware_error_other(CompactMessage *message, const char *string);
+void compact_software_error(CompactMessage *message, const char *string);
+void compact_keep_alive(CompactMessage *message);
+
+// encodes a compact message into buf (which should have room for MAX_COMPACT_ENCODED_LEN + 1 bytes) without allocating
+// the encoding is the same as encode_message's
+// returns the length of the encoded message or -1 on error
+ssize_t encode_compact_message(const CompactMessage *message, char *buf, size_t size);
+
+// decodes a message into a compact message, cutting the text short if it has to
+// returns success
+bool decode_compact_message(const char *encoded_message, CompactMessage *message);
+
+// there is nothing to free in a compact message. This is only here so that code can treat both kinds of message the same way
+void free_compact_message(CompactMessage *msg);
+
+// how long a message decode_message_fields can copy into a DecodeScratch (less one for the '\0'). Anything longer gets a copy of its own
+#define DECODE_SCRATCH_SIZE 4096
+
+// somewhere for decode_message_fields to decode a copy of the message without allocating. Only use it on one thread at a time
+typedef struct {
+    char buf[DECODE_SCRATCH_SIZE];
+    char *spill; // the copy of the last message if it was too long for buf. Kept until the next decode so that DecodedFields can point into it
+} DecodeScratch;
+
+// a decoded message whose text hasn't been copied anywhere yet
+typedef struct {
+    MessageType type;
+    int valve_no;     // HARD_ERROR_VALVE only
+    const char *text; // NULL for KEEP_ALIVE. Only valid until the next decode with the same scratch
+    size_t text_len;
+} DecodedFields;
+
+// sets up an empty scratch
+void decode_scratch_init(DecodeScratch *scratch);
+
+// frees what the last decode with scratch left behind
+void decode_scratch_free(DecodeScratch *scratch);
+
+// like decode_message but leaves the text where the decoder put it, so that the caller can decide where it goes
+// returns success
+bool decode_message_fields(const char *encoded_message, DecodeScratch *scratch, DecodedFields *fields);
+
+// like decode_message_fields but without building a tree or copying anything: encoded_message is len bytes followed by a '\0'
+// the text is unescaped where it is and fields->text points to it there, nul terminated. encoded_message is only changed if this succeeds
+// returns success
+bool decode_message_in_place(char *encoded_message, size_t len, DecodedFields *fields);
+
 // internals
 #define DATA_FORMAT_VERSION 2.0
 #define MAX_ENCODED_LEN ((MAX_MSG_LEN) + 100) // approximate
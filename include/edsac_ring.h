@@ -0,0 +1,74 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_ring.h
+ * Bounded lock-free queues of pointers
+ */
+
+#ifndef EDSAC_RING_H
+#define EDSAC_RING_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// declarations
+
+/* A ring of cells, each with a sequence number saying whose turn it is to use it (Dmitry Vyukov's bounded queue).
+Producers claim a cell with one compare and swap on the tail and never wait for each other or for the consumer: if the ring is full ring_push says so straight away.
+With one consumer taking a cell is a plain load and store. When several threads may pop at once the head is claimed with a compare and swap too */
+
+// the size of a cache line. The head, tail and cells are kept apart so that producers and the consumer don't share lines
+#define RING_CACHE_LINE 64
+
+// one place in the ring
+typedef struct {
+    atomic_size_t sequence;
+    void *value;
+} RingCell;
+
+// a bounded queue
+typedef struct {
+    _Alignas(RING_CACHE_LINE) atomic_size_t tail; // where the next push goes. Written by producers
+    _Alignas(RING_CACHE_LINE) atomic_size_t head; // where the next pop comes from. Written by consumers
+    _Alignas(RING_CACHE_LINE) RingCell *cells;    // read only after ring_init
+    size_t mask; // capacity - 1
+    bool multi_consumer;
+} Ring;
+
+// sets up an empty ring with room for at least capacity pointers (rounded up to a power of two)
+// multi_consumer should be set if ring_pop might be called from more than one thread at once
+// returns success
+bool ring_init(Ring *ring, size_t capacity, bool multi_consumer);
+
+// frees the cells. Whatever is still in the ring is not freed
+void ring_free(Ring *ring);
+
+// adds value (which must not be NULL) to the back of the ring. Safe from any number of threads at once
+// returns false if the ring is full
+bool ring_push(Ring *ring, void *value);
+
+// takes the value from the front of the ring
+// returns NULL if the ring is empty
+void *ring_pop(Ring *ring);
+
+// takes up to max values from the front of the ring with one claim on the head, in order
+// returns how many were put in values (0 if the ring is empty)
+size_t ring_pop_batch(Ring *ring, void **values, size_t max);
+
+// how many pointers the ring can hold
+size_t ring_capacity(const Ring *ring);
+
+// how many pointers are in the ring. Only a snapshot while others are pushing and popping
+size_t ring_size(Ring *ring);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_RING_H
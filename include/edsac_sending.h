@@ -19,17 +19,35 @@ extern "C" {
 #include <sys/types.h>
 #include <sys/socket.h>
 #include "edsac_representation.h"
+#include "edsac_framing.h"
 
 // declarations
 
 // the time between KEEP_ALIVE messages in seconds
 #define KEEP_ALIVE_INTERVAL 10 
 
+// options for start_sending_with_options
+typedef struct {
+    FramingMode framing; // how messages are separated. Servers older than 2.0.0 only understand FRAMING_BRACES
+    // don't send a KEEP_ALIVE when a message has been sent since the last one. Only for servers from 2.0.0 on
+    // older ones only count KEEP_ALIVEs and would report a busy sender as timed out. Default false
+    bool skip_keep_alives;
+} SendingOptions;
+
+// fills in the options start_sending uses
+void sending_default_options(SendingOptions *options);
+
 // addr is the address of the server to which we will report errors
 bool start_sending(const struct sockaddr *addr, socklen_t addrlen);
 
+// like start_sending. options may be NULL for the defaults
+bool start_sending_with_options(const struct sockaddr *addr, socklen_t addrlen, const SendingOptions *options);
+
 bool send_message(const Message *msg);
 
+// like send_message but doesn't allocate anything
+bool send_compact_message(const CompactMessage *msg);
+
 void stop_sending(void);
 
 #ifdef _cplusplus
@@ -40,19 +40,201 @@ typedef struct {
     Message msg; // Error Message
     struct in_addr address; // IPv4 address which sent (or generated) the error
     time_t recv_time; // the time at which the message was received
+    // how many identical messages from this address the item stands for. Only more than 1 with ServerOptions.coalesce_window_ms
+    // first_time is when the first of them was received and recv_time when the last one was
+    uint32_t repeats;
+    time_t first_time;
+    // internal: in any decode mode but SERVER_DECODE_COPY msg's text is this GString, whose str is in arena (or just after the item)
+    // don't change it
+    GString text;
+    struct Arena *arena;
 } BufferItem;
 
-// frees a BufferItem
+// frees a BufferItem from the server, from any thread. Only for BufferItems which the server gave you: they come from its pools
+// (before 2.0.0 this just called free(item). Free a BufferItem you allocated yourself with free_message(&item->msg) and free(item))
 void free_bufferitem(BufferItem *item);
 
+// frees count BufferItems, e.g. from read_messages. Doesn't free the array itself
+void free_bufferitems(BufferItem **items, size_t count);
+
+// how the server waits for IO
+typedef enum {
+    SERVER_BACKEND_EPOLL,    // edge-triggered epoll reactor
+    SERVER_BACKEND_IO_URING, // io_uring with multishot accept, multishot recv into kernel-provided buffers and batched completions
+                             // falls back to epoll if the kernel (or the headers we were built with) can't do this
+} ServerBackend;
+
+// receives messages straight from the reactors instead of them being queued for read_message (see ServerOptions.handler)
+// items[0] to items[count - 1] belong to the handler from now on: free them with free_bufferitem(s) or keep them
+// the items array itself belongs to the server and can't be used after the handler returns
+typedef void (*ServerHandler)(BufferItem **items, size_t count, void *user_data);
+
+// the most messages a handler is given at once
+#define SERVER_HANDLER_BATCH 64
+
+// where the server puts the text of the messages it decodes
+typedef enum {
+    SERVER_DECODE_COPY,  // each message has its own GString, which free_message frees
+    SERVER_DECODE_ARENA, // the text of everything decoded from one read goes into one reference counted arena, which is freed once
+                         // every BufferItem using it has been freed. The text is read only, and only free_bufferitem may free it
+    SERVER_DECODE_INLINE, // the text goes in the same block of memory as the BufferItem, cut short to MAX_MSG_LEN like a CompactMessage
+                          // the same rules apply as for SERVER_DECODE_ARENA
+    SERVER_DECODE_ZERO_COPY, // the text isn't copied at all: it is unescaped where it arrived in the connection's receive buffer
+                             // which is reference counted like an arena. The same rules apply as for SERVER_DECODE_ARENA
+} ServerDecode;
+
+// how read_message chooses what to take next
+typedef enum {
+    SERVER_PRIORITY_FIFO,     // one queue per shard: messages come out in the order each shard received them
+    SERVER_PRIORITY_STRICT,   // a lane per message type. Nothing leaves a lane while a higher one has something in it:
+                              // HARD_ERROR_VALVE first, then HARD_ERROR_OTHER, then SOFT_ERROR (which includes the server's own reports)
+    SERVER_PRIORITY_WEIGHTED, // a lane per message type, taken in turn: up to lane_weights[type] messages from each lane per round
+                              // so that a flood in a high lane can't hold the others up forever. Only roughly fair when several threads read at once
+} ServerPriority;
+
+// what happens to messages from a connection which is over ServerOptions.rate_limit_msgs or rate_limit_bytes
+typedef enum {
+    SERVER_RATE_DELAY, // stop reading from the connection until it is back under the limits, so that TCP pushes back on the client
+    SERVER_RATE_DROP,  // read them and throw them away. While this goes on, once a second (and when it stops or the connection closes)
+                       // a SOFT_ERROR from the connection's address says how many were dropped
+} ServerRateAction;
+
+// how many lanes there are with SERVER_PRIORITY_STRICT or SERVER_PRIORITY_WEIGHTED: one for each type of message which can be queued
+#define SERVER_NUM_LANES 3
+
+// options for start_server_with_options. Use server_default_options to fill in the defaults before changing anything
+typedef struct {
+    // number of shards. Each shard has its own listening socket (SO_REUSEPORT), reactor thread, connections and queue
+    // 0 means one shard per online CPU. Default 1
+    unsigned int shards;
+    // always put connections from the same IPv4 address on the same shard using a reuseport BPF program. Default false
+    bool steer_by_address;
+    // how each shard waits for IO. Default SERVER_BACKEND_EPOLL
+    ServerBackend backend;
+    // if not 0, new connections aren't handed to us until they send something (or this many seconds pass) using TCP_DEFER_ACCEPT
+    // this saves waking up for every connection in a reconnect storm. Default 0
+    unsigned int defer_accept;
+    // bounded ingress. Once ingress_high_items messages or ingress_high_bytes bytes are waiting to be read (over all shards)
+    // the server stops reading from clients, so that TCP pushes back on them, until read_message takes it below both low watermarks
+    // 0 means no limit. Default 0
+    size_t ingress_high_items;
+    size_t ingress_low_items;
+    size_t ingress_high_bytes;
+    size_t ingress_low_bytes;
+    // the most connections there can be at once, split evenly between the shards. Their slots are allocated up front
+    // connections beyond this (or on an fd above RLIMIT_NOFILE) are reset straight away
+    // 0 means RLIMIT_NOFILE (up to 65536). Default 0
+    size_t max_connections;
+    // how many messages each shard's queue holds. When it is full the shard stops reading until read_message makes room
+    // nothing is dropped. 0 means the default. Default 65536
+    size_t queue_capacity;
+    // read_message may be called from more than one thread at once. Turn this off if only one thread ever reads at a time
+    // and the queues use a cheaper single consumer pop. Default true
+    bool multiple_readers;
+    // for low latency: read_message_wait spins for up to this many microseconds before going to sleep
+    // it spins for less while that doesn't find anything. 0 means always sleep straight away. Default 0
+    unsigned int wait_spin_us;
+    // if not NULL, every message (including connection close and timeout reports) goes to handler(items, count, handler_data)
+    // instead of the queues, and read_message always returns NULL. It is called on the reactor threads, once per batch of IO
+    // so with more than one shard it is called from several threads at once. It holds up its shard while it runs, so it shouldn't block
+    // and mustn't call stop_server. Default NULL
+    ServerHandler handler;
+    void *handler_data;
+    // how messages are decoded. Default SERVER_DECODE_COPY
+    ServerDecode decode;
+    // the order read_message takes messages in, over all shards. Default SERVER_PRIORITY_FIFO
+    // with lanes, each lane has room for the whole queue_capacity, so the queues take up SERVER_NUM_LANES times the memory
+    ServerPriority priority;
+    // SERVER_PRIORITY_WEIGHTED: how many messages each lane gets per round, indexed by MessageType. 0 counts as 1. Default {16, 4, 1}
+    unsigned int lane_weights[SERVER_NUM_LANES];
+    // queue each node's messages (by BufferItem.address) separately and have read_message take turns between the nodes on each shard
+    // (deficit round robin, by the bytes counted for ingress_high_bytes) so that one node sending a flood can't push everyone else's
+    // messages to the back. Each node's messages stay in order. With priority the nodes take turns within each lane. Default false
+    bool fair_by_address;
+    // fair_by_address: how many bytes of messages a node gets per turn. Default 1024
+    size_t fair_quantum;
+    // fair_by_address: once a node has this many messages waiting in one lane of a shard the server stops reading from that node's
+    // connections (and only those) until read_message has taken it down to half as many. 0 means no limit. Default 1024
+    size_t node_queue_limit;
+    // if not 0, copies of a message (the same type, valve_no and text from the same address) which arrive within this many
+    // milliseconds of it are folded into one BufferItem. The first is queued straight away. Whatever follows in the window is queued
+    // as one item, with repeats saying how many it stands for, once the window ends. While the copies keep coming there is one such
+    // item per window. Default 0
+    unsigned int coalesce_window_ms;
+    // if not 0, how many messages, and how many bytes of them, each connection may send per second (token buckets checked as each
+    // message is read). A connection which has been quiet can send up to a second's worth at once. Up to 1000000000. Default 0
+    unsigned int rate_limit_msgs;
+    size_t rate_limit_bytes;
+    // what happens to messages over the rate limits. Default SERVER_RATE_DELAY
+    ServerRateAction rate_limit_action;
+} ServerOptions;
+
+// fills in the default options
+void server_default_options(ServerOptions *options);
+
 // set up the server
 // returns success
 bool start_server(const struct sockaddr *addr, socklen_t addrlen);
 
+// set up the server with non-default options (NULL options means use the defaults)
+// returns success
+bool start_server_with_options(const struct sockaddr *addr, socklen_t addrlen, const ServerOptions *options);
+
 // read in an error message from the queue
 // returns NULL immediately if there is no message to read in
+// can be called from any number of threads at once, unless ServerOptions.multiple_readers was turned off
 BufferItem *read_message(void);
 
+// like read_message but takes up to max messages at once, putting them in out
+// each shard's queue is claimed once per call rather than once per message
+// returns how many were read (0 if there is nothing to read)
+size_t read_messages(BufferItem **out, size_t max);
+
+// a file descriptor which polls readable (POLLIN) while there may be messages for read_message, for a main loop to wait on
+// it stays readable until read_message returns NULL (or read_messages returns fewer than it was asked for). Don't read from or close it. -1 if the server isn't running
+int server_ready_fd(void);
+
+// like read_message but waits for up to timeout_ms milliseconds (forever if negative) for a message to arrive
+// the thread sleeps until the server has something for it. Returns NULL on timeout or if stop_server is called
+// like read_message, several threads can wait at once unless ServerOptions.multiple_readers was turned off
+BufferItem *read_message_wait(int timeout_ms);
+
+// how much is waiting to be read (see ServerOptions.ingress_*)
+typedef struct {
+    size_t queued_items;       // messages waiting for read_message
+    size_t queued_bytes;       // memory they are holding on to
+    size_t paused_connections; // connections which we have stopped reading from
+    bool paused;               // reading is paused
+    size_t reader_wakeups;     // times read_message_wait had to be woken up
+    size_t coalesced;          // messages folded into another instead of being queued (see ServerOptions.coalesce_window_ms)
+    size_t rate_dropped;       // messages dropped for being over the rate limits (SERVER_RATE_DROP)
+} IngressStats;
+
+// fills in stats for the running server
+void server_ingress_stats(IngressStats *stats);
+
+// the connections tables (see ServerOptions.max_connections)
+typedef struct {
+    size_t connections;     // connections open now
+    size_t max_connections; // slots over all shards
+    size_t rejected;        // connections turned away because their shard was full
+} ConnectionStats;
+
+// fills in stats for the running server
+void server_connection_stats(ConnectionStats *stats);
+
+// memory. BufferItems come from per-thread slab pools which are kept (and reused) after stop_server
+// connections live in slots which are allocated up front (see ServerOptions.max_connections)
+typedef struct {
+    size_t item_allocations; // BufferItems taken from the pools by the reactors
+    size_t item_pool_hits;   // of those, how many didn't need a new slab
+    size_t item_pool_bytes;  // held by the pools, whether in use or not
+    size_t connection_bytes; // held by the connection slots and the table finding them by fd
+} MemoryStats;
+
+// fills in stats for the server
+void server_memory_stats(MemoryStats *stats);
+
 // returns a list of IP addresses (sockaddr_in) we are currently connected to
 GSList *get_connected_list(void);
 
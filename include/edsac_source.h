@@ -0,0 +1,41 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_source.h
+ * A GSource which hands received messages to a GLib main loop
+ */
+
+#ifndef EDSAC_SOURCE_H
+#define EDSAC_SOURCE_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stddef.h>
+#include <glib.h>
+#include "edsac_server.h"
+
+// declarations
+
+// the callback for a server source. items[0] to items[count - 1] belong to the callback (free them with free_bufferitem)
+// return G_SOURCE_CONTINUE to keep receiving messages or G_SOURCE_REMOVE to remove the source
+typedef gboolean (*ServerSourceFunc)(BufferItem **items, size_t count, gpointer user_data);
+
+// the most messages passed to one callback when server_source_new is given 0
+#define SERVER_SOURCE_DEFAULT_BATCH 64
+
+/* creates a source which dispatches whenever there are messages, up to batch (0 means SERVER_SOURCE_DEFAULT_BATCH) at a time
+the main loop sleeps on server_ready_fd in between so there is no polling. Attach it to a GMainContext with g_source_attach and set the callback with
+g_source_set_callback(source, G_SOURCE_FUNC(func), user_data, NULL) where func is a ServerSourceFunc. Without a callback the messages are freed
+the source keeps working if the server is stopped and started again
+this reads with read_message, so other threads may read at the same time unless ServerOptions.multiple_readers was turned off
+returns NULL if the server isn't running */
+GSource *server_source_new(size_t batch);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_SOURCE_H
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_uring.h
+ * Thin wrapper around the io_uring system calls used by the server's io_uring backend
+ */
+
+#ifndef EDSAC_URING_H
+#define EDSAC_URING_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// declarations
+
+// an io_uring instance with one ring of kernel-provided receive buffers
+// the fields are internal to uring.c
+typedef struct {
+    int fd;
+
+    // submission queue (shared with the kernel)
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    void *sqes;
+    size_t sqes_size;
+    unsigned sqe_tail; // entries up to here have been filled in but not submitted
+
+    // completion queue (shared with the kernel)
+    void *cq_ring; // shares the submission queue mapping
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    void *cqes;
+
+    // provided buffers: buf_count buffers of buf_size bytes handed to the kernel through buf_ring
+    void *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned buf_count;
+    unsigned buf_size;
+    unsigned buf_tail; // buffers up to here have been given back but not yet published to the kernel
+} Uring;
+
+// a completion copied out of the completion queue
+typedef struct {
+    uint64_t user_data;
+    int32_t res;      // result of the operation or -errno
+    bool more;        // a multishot request will produce more completions
+    bool has_buffer;  // a provided buffer was used. It must be given back with uring_recycle_buffer
+    uint16_t buffer;  // id of the provided buffer
+} UringCompletion;
+
+// sets up a ring with entries submission queue entries and buf_count provided buffers of buf_size bytes each
+// returns false if io_uring or any of the features we need (multishot accept and recv, provided buffer rings) are missing
+bool uring_init(Uring *ring, unsigned entries, unsigned buf_count, unsigned buf_size);
+
+// tears down a ring. Outstanding requests are cancelled by the kernel
+void uring_free(Uring *ring);
+
+// queue a multishot accept on fd. Accepted sockets are close on exec
+bool uring_accept_multishot(Uring *ring, int fd, uint64_t user_data);
+
+// queue a multishot recv on fd which receives into the provided buffers
+bool uring_recv_multishot(Uring *ring, int fd, uint64_t user_data);
+
+// queue a single read into buf
+bool uring_read(Uring *ring, int fd, void *buf, size_t len, uint64_t user_data);
+
+// queue cancelling the request with user_data target (a multishot request then completes without IORING_CQE_F_MORE)
+bool uring_cancel(Uring *ring, uint64_t target, uint64_t user_data);
+
+// submits everything queued and waits for at least one completion
+// returns 0 on success or -errno
+int uring_wait(Uring *ring);
+
+// takes the next completion off the completion queue
+// returns false if there are none left
+bool uring_next_completion(Uring *ring, UringCompletion *completion);
+
+// the data in a provided buffer
+char *uring_buffer(Uring *ring, uint16_t buffer);
+
+// gives a provided buffer back to the kernel (it is published on the next uring_wait)
+void uring_recycle_buffer(Uring *ring, uint16_t buffer);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_URING_H
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * edsac_wheel.h
+ * A hierarchical timing wheel: lots of timers which are mostly moved later before they go off
+ */
+
+#ifndef EDSAC_WHEEL_H
+#define EDSAC_WHEEL_H
+
+// link properly with C++
+#ifdef _cplusplus
+extern "C" {
+#endif // _cplusplus
+
+// includes
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// declarations
+
+/* Time is counted in ticks, in whatever unit the user likes. Level 0 has a slot for each of the next WHEEL_SLOTS ticks,
+level 1 a slot for each of the next WHEEL_SLOTS blocks of WHEEL_SLOTS ticks and so on. A timer goes in the slot for when it expires
+on the lowest level which reaches that far. Whenever time reaches the start of a higher level slot, the timers in it are moved down
+to where they now belong, so each timer is moved at most WHEEL_LEVELS - 1 times however many other timers there are.
+Scheduling and cancelling are O(1) and advancing only touches the slots which are due.
+Only ever used by one thread */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // timers further ahead than WHEEL_SLOTS^WHEEL_LEVELS ticks are put in the top level until they are closer
+
+// one timer. Embed this in whatever it is for. It belongs to the wheel while it is scheduled
+typedef struct WheelTimer {
+    struct WheelTimer *next;   // in its slot, or in the list from wheel_advance
+    struct WheelTimer **pprev; // what points at it in its slot. NULL while it isn't scheduled
+    uint64_t expires;          // the tick it goes off on
+} WheelTimer;
+
+typedef struct {
+    uint64_t now; // the last tick which has been handed out
+    WheelTimer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    size_t count; // timers scheduled
+} TimerWheel;
+
+// sets up an empty wheel starting at tick now
+void wheel_init(TimerWheel *wheel, uint64_t now);
+
+// sets up a timer which isn't scheduled
+void wheel_timer_init(WheelTimer *timer);
+
+// schedules a timer to go off on tick expires (on the next tick if that has passed), moving it if it was already scheduled
+void wheel_schedule(TimerWheel *wheel, WheelTimer *timer, uint64_t expires);
+
+// unschedules a timer if it is scheduled
+void wheel_cancel(TimerWheel *wheel, WheelTimer *timer);
+
+// whether a timer is scheduled
+bool wheel_pending(const WheelTimer *timer);
+
+// moves time on to tick now
+// returns the timers which went off, linked through next (NULL if none did). They aren't scheduled any more so they can be
+// scheduled again straight away, but take next first
+WheelTimer *wheel_advance(TimerWheel *wheel, uint64_t now);
+
+// a tick at or before which the next timer goes off: there is no need to call wheel_advance before then. 0 if nothing is scheduled
+// this looks at most WHEEL_SLOTS ticks ahead so it can be sooner than the first timer
+uint64_t wheel_next_expiry(const TimerWheel *wheel);
+
+#ifdef _cplusplus
+}
+#endif // _cplusplus
+#endif // EDSAC_WHEEL_H
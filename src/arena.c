@@ -0,0 +1,45 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * arena.c
+ * Reference counted arenas (see edsac_arena.h)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_arena.h"
+#include <stdlib.h>
+
+Arena *arena_new(size_t capacity) {
+    Arena *arena = malloc(sizeof(Arena) + capacity);
+    if (NULL == arena) {
+        return NULL;
+    }
+
+    atomic_init(&(arena->refs), 1);
+    arena->used = 0;
+    arena->capacity = capacity;
+    return arena;
+}
+
+char *arena_alloc(Arena *arena, size_t size) {
+    if (size > arena->capacity - arena->used) {
+        return NULL;
+    }
+
+    char *ret = arena->data + arena->used;
+    arena->used += size;
+    return ret;
+}
+
+void arena_ref(Arena *arena) {
+    atomic_fetch_add_explicit(&(arena->refs), 1, memory_order_relaxed);
+}
+
+void arena_unref(Arena *arena) {
+    // whoever drops the last reference must see everything the others did with it
+    if (1 == atomic_fetch_sub_explicit(&(arena->refs), 1, memory_order_release)) {
+        atomic_thread_fence(memory_order_acquire);
+        free(arena);
+    }
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/batch.c
+ * Benchmark for draining the queues with read_messages at different batch sizes
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+
+#define NUM_MESSAGES 100000
+#define MAX_BATCH 1024
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// queued is what the server has read in but nobody has taken yet
+static size_t queued(void) {
+    IngressStats stats;
+    server_ingress_stats(&stats);
+    return stats.queued_items;
+}
+
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2202);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.queue_capacity = 2 * NUM_MESSAGES; // so that the whole alarm storm fits
+    assert(start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    Message msg;
+    software_error(&msg, "valve 3 has failed");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+    char *burst = malloc((size_t) len * NUM_MESSAGES);
+    assert(NULL != burst);
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        memcpy(burst + (size_t) len * i, encoded, (size_t) len);
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+
+    BufferItem **items = malloc(NUM_MESSAGES * sizeof(BufferItem *));
+    assert(NULL != items);
+
+    for (size_t batch = 1; batch <= MAX_BATCH; batch *= 2) {
+        // queue everything up first so that only taking it off the queue is timed
+        for (size_t written = 0; written < (size_t) len * NUM_MESSAGES; ) {
+            ssize_t ret = write(fd, burst + written, (size_t) len * NUM_MESSAGES - written);
+            assert(ret > 0);
+            written += (size_t) ret;
+        }
+        while (queued() < NUM_MESSAGES) {
+            usleep(1000);
+        }
+
+        double start = now();
+        size_t received = 0;
+        while (received < NUM_MESSAGES) {
+            size_t max = (NUM_MESSAGES - received < batch) ? NUM_MESSAGES - received : batch;
+            received += read_messages(items + received, max);
+        }
+        double elapsed = now() - start;
+        free_bufferitems(items, received);
+
+        printf("batch %4zu: %6.2f M items/s\n", batch, (double) NUM_MESSAGES / elapsed / 1E6);
+    }
+
+    close(fd);
+    free(items);
+    free(burst);
+    free(encoded);
+    free_message(&msg);
+    stop_server();
+    free(addr);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/decode.c
+ * Microbenchmark for each way of decoding a message
+ */
+
+// includes
+#include "config.h"
+#include "edsac_representation.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define NUM_MESSAGES 100000
+#define ROUNDS 10
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// prints the throughput of one way of decoding
+static void report(const char *name, double seconds) {
+    printf("%-10s %8.2f Mmsgs/s\n", name, (double) NUM_MESSAGES * ROUNDS / seconds / 1E6);
+}
+
+int main(void) {
+    const char *texts[] = {
+        "valve stuck",
+        "pressure sensor reading out of range on the main line, check the \"primary\" pump {3}",
+        "a much longer software error which could have come from a stack trace or log message. "
+        "it is close to the longest message allowed (MAX_MSG_LEN) so it needs a second line",
+    };
+
+    // each message is kept separately, as it would be in the receive buffer, with room for the '\0' after it
+    char **encoded = malloc(NUM_MESSAGES * sizeof(char *));
+    size_t *lens = malloc(NUM_MESSAGES * sizeof(size_t));
+    char **copies = malloc(NUM_MESSAGES * sizeof(char *));
+    assert((NULL != encoded) && (NULL != lens) && (NULL != copies));
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        Message msg;
+        hardware_error_valve(&msg, (int) i, texts[i % (sizeof(texts) / sizeof(texts[0]))]);
+        assert(encode_message(&msg, &encoded[i]) > 0);
+        free_message(&msg);
+        lens[i] = strlen(encoded[i]);
+        copies[i] = malloc(lens[i] + 1);
+        assert(NULL != copies[i]);
+    }
+
+    // a GString for every message
+    double start = now();
+    for (unsigned int round = 0; round < ROUNDS; round++) {
+        for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+            Message msg;
+            assert(decode_message(encoded[i], &msg));
+            free_message(&msg);
+        }
+    }
+    report("copy", now() - start);
+
+    // a copy in scratch memory, decoded there (SERVER_DECODE_ARENA and SERVER_DECODE_INLINE)
+    DecodeScratch scratch;
+    decode_scratch_init(&scratch);
+    start = now();
+    for (unsigned int round = 0; round < ROUNDS; round++) {
+        for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+            DecodedFields fields;
+            assert(decode_message_fields(encoded[i], &scratch, &fields));
+        }
+    }
+    report("scratch", now() - start);
+    decode_scratch_free(&scratch);
+
+    // where it is (SERVER_DECODE_ZERO_COPY). Unescaping changes the message so each round works on a fresh copy, which isn't timed
+    double elapsed = 0;
+    for (unsigned int round = 0; round < ROUNDS; round++) {
+        for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+            memcpy(copies[i], encoded[i], lens[i] + 1);
+        }
+        start = now();
+        for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+            DecodedFields fields;
+            assert(decode_message_in_place(copies[i], lens[i], &fields));
+        }
+        elapsed += now() - start;
+    }
+    report("in place", elapsed);
+
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        free(encoded[i]);
+        free(copies[i]);
+    }
+    free(encoded);
+    free(lens);
+    free(copies);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/fair.c
+ * Benchmark for how long quiet nodes' messages wait behind one node sending a flood, with and without ServerOptions.fair_by_address
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#define QUIET 500         // nodes which each send a valve alarm now and then
+#define SAMPLES 2000      // valve alarms sent, QUIET_GAP_US apart, going round the quiet nodes
+#define QUIET_GAP_US 500
+#define FLOOD 1000        // software errors the hot node sends per write. It keeps writing for as long as the server will take them
+#define COST_US 1.0       // how long the reader takes over each message, so that it can't keep up with the flood
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// pretends to do something with a message
+// it yields as well so that the reactors still get to run on a machine with few CPUs, as they would with a real consumer doing IO
+static void process(void) {
+    double until = now() + COST_US / 1E6;
+    while (now() < until) {
+    }
+    sched_yield();
+}
+
+// encodes a message
+static char *encode(Message *msg, size_t *len) {
+    char *encoded = NULL;
+    ssize_t ret = encode_message(msg, &encoded);
+    assert(ret > 0);
+    free_message(msg);
+    *len = (size_t) ret;
+    return encoded;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    for (size_t written = 0; written < len; ) {
+        ssize_t ret = write(fd, buf + written, len - written);
+        assert(ret > 0);
+        written += (size_t) ret;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// connects from a loopback address of its own so that the server sees a different node
+static int connect_from(uint32_t ip, const struct sockaddr *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(ip);
+    assert(0 == bind(fd, (struct sockaddr *) &local, sizeof(local)));
+
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    return fd;
+}
+
+static const char *flood;
+static size_t flood_len;
+static int hot_fd;
+static int quiet_fds[QUIET];
+static double sent[SAMPLES];
+static atomic_bool stop;
+
+// keeps the queues full until stop
+static void *hot_thread(__attribute__((unused)) void *arg) {
+    while (!atomic_load(&stop)) {
+        for (size_t written = 0; written < flood_len; ) {
+            ssize_t ret = send(hot_fd, flood + written, flood_len - written, MSG_NOSIGNAL);
+            if (ret <= 0) {
+                return NULL; // shut down
+            }
+            written += (size_t) ret;
+        }
+    }
+    return NULL;
+}
+
+static void *quiet_thread(__attribute__((unused)) void *arg) {
+    for (int i = 0; i < SAMPLES; i++) {
+        Message msg;
+        hardware_error_valve(&msg, i, "valve 3 has failed");
+        size_t len;
+        char *alarm = encode(&msg, &len);
+        sent[i] = now();
+        write_all(quiet_fds[i % QUIET], alarm, len);
+        free(alarm);
+        usleep(QUIET_GAP_US);
+    }
+    return NULL;
+}
+
+static void run(const char *name, bool fair, const struct sockaddr *addr) {
+    ServerOptions options;
+    server_default_options(&options);
+    options.fair_by_address = fair;
+    assert(start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    // 127.0.0.2 floods. The quiet nodes are 127.0.1.1, 127.0.1.2, ...
+    hot_fd = connect_from(0x7F000002, addr);
+    for (uint32_t i = 0; i < QUIET; i++) {
+        quiet_fds[i] = connect_from(0x7F000101 + (i / 250) * 256 + i % 250, addr);
+    }
+
+    atomic_store(&stop, false);
+    pthread_t hot, quiet;
+    assert(0 == pthread_create(&hot, NULL, hot_thread, NULL));
+    assert(0 == pthread_create(&quiet, NULL, quiet_thread, NULL));
+
+    // read until every alarm has come through, timing them
+    static double latencies[SAMPLES];
+    int alarms = 0;
+    size_t received = 0;
+    double start = now();
+    while (alarms < SAMPLES) {
+        BufferItem *item = read_message_wait(100);
+        if (NULL == item) {
+            continue;
+        }
+        if (HARD_ERROR_VALVE == item->msg.type) {
+            int sample = item->msg.data.hardware_valve.valve_no;
+            latencies[sample] = now() - sent[sample];
+            alarms += 1;
+        }
+        free_bufferitem(item);
+        process();
+        received += 1;
+    }
+    double elapsed = now() - start;
+
+    atomic_store(&stop, true);
+    shutdown(hot_fd, SHUT_RDWR);
+    assert(0 == pthread_join(hot, NULL));
+    assert(0 == pthread_join(quiet, NULL));
+
+    qsort(latencies, SAMPLES, sizeof(double), compare_doubles);
+    printf("%-5s quiet latency p50 %8.1f us p99 %8.1f us, throughput %.3f Mmsgs/s\n", name,
+           latencies[SAMPLES / 2] * 1E6, latencies[SAMPLES * 99 / 100] * 1E6, (double) received / elapsed / 1E6);
+
+    close(hot_fd);
+    for (int i = 0; i < QUIET; i++) {
+        close(quiet_fds[i]);
+    }
+    stop_server();
+}
+
+int main(void) {
+    // a socket each for us and the server for every node
+    struct rlimit limit;
+    assert(0 == getrlimit(RLIMIT_NOFILE, &limit));
+    if (limit.rlim_cur < 4 * QUIET) {
+        limit.rlim_cur = (limit.rlim_max < 4 * QUIET) ? limit.rlim_max : 4 * QUIET;
+        assert(0 == setrlimit(RLIMIT_NOFILE, &limit));
+    }
+
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2204);
+    assert(NULL != addr);
+
+    Message msg;
+    software_error(&msg, "Could not decode message");
+    size_t len;
+    char *encoded = encode(&msg, &len);
+    char *buf = malloc(len * FLOOD);
+    assert(NULL != buf);
+    for (unsigned int i = 0; i < FLOOD; i++) {
+        memcpy(buf + len * i, encoded, len);
+    }
+    free(encoded);
+    flood = buf;
+    flood_len = len * FLOOD;
+
+    run("fifo", false, addr);
+    run("fair", true, addr);
+
+    free(buf);
+    free(addr);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/framing.c
+ * Microbenchmark for finding frames in a receive buffer with each of the scanners
+ */
+
+// includes
+#include "config.h"
+#include "edsac_framing.h"
+#include "edsac_representation.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define BUFFER_SIZE (64 << 20) // bytes of frames to scan through
+#define ROUNDS 10
+
+// the brace counter the server used before the string-aware scanners (it gets braces in strings wrong)
+static size_t legacy_frame_end(const char *data, size_t len) {
+    int nest_count = 0;
+    for (size_t i = 0; i < len; i++) {
+        if ('{' == data[i])
+            nest_count += 1;
+        else if ('}' == data[i])
+            nest_count -= 1;
+
+        if (0 == nest_count)
+            return i + 1;
+    }
+    return 0;
+}
+
+// fills buf with encoded messages of different lengths
+// returns the number of bytes used
+static size_t fill_buffer(char *buf, size_t size, unsigned int *num_frames) {
+    // mix of lengths with some quotes and braces in the text (they don't change the legacy result because they balance)
+    const char *texts[] = {
+        "valve stuck",
+        "pressure sensor reading out of range on the main line, check the \"primary\" pump {3}",
+        "a much longer software error which could have come from a stack trace or log message. "
+        "it is close to the longest message allowed (MAX_MSG_LEN) so it needs a second line",
+    };
+
+    size_t used = 0;
+    *num_frames = 0;
+    while (true) {
+        Message msg;
+        software_error(&msg, texts[*num_frames % (sizeof(texts) / sizeof(texts[0]))]);
+        char *encoded;
+        ssize_t len = encode_message(&msg, &encoded);
+        free_message(&msg);
+        assert(len > 0);
+
+        if (used + (size_t) len > size) {
+            free(encoded);
+            return used;
+        }
+        memcpy(buf + used, encoded, (size_t) len);
+        free(encoded);
+        used += (size_t) len;
+        *num_frames += 1;
+    }
+}
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// finds every frame in buf with find_frame
+static unsigned int count_frames(const char *buf, size_t len) {
+    FrameScanner scanner;
+    frame_scanner_reset(&scanner);
+
+    unsigned int count = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t start, end;
+        FrameStatus status = find_frame(&scanner, buf + pos, len - pos, &start, &end);
+        if (FRAME_FOUND != status) {
+            break;
+        }
+        pos += end;
+        count += 1;
+    }
+    return count;
+}
+
+// finds every frame in buf with the legacy brace counter
+static unsigned int count_frames_legacy(const char *buf, size_t len) {
+    unsigned int count = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t end = legacy_frame_end(buf + pos, len - pos);
+        if (0 == end) {
+            break;
+        }
+        pos += end;
+        count += 1;
+    }
+    return count;
+}
+
+// prints the throughput of one way of finding frames
+static void report(const char *name, double seconds, size_t len, unsigned int frames) {
+    printf("%-8s %8.3f GB/s %10.1f Mframes/s\n", name, (double) len * ROUNDS / seconds / 1E9, (double) frames * ROUNDS / seconds / 1E6);
+}
+
+int main(void) {
+    char *buf = malloc(BUFFER_SIZE);
+    assert(NULL != buf);
+    unsigned int num_frames;
+    size_t len = fill_buffer(buf, BUFFER_SIZE, &num_frames);
+    printf("%u frames in %zu bytes\n", num_frames, len);
+
+    double start = now();
+    for (unsigned int i = 0; i < ROUNDS; i++) {
+        assert(num_frames == count_frames_legacy(buf, len));
+    }
+    report("legacy", now() - start, len, num_frames);
+
+    const FrameScanImpl impls[] = {FRAME_SCAN_SCALAR, FRAME_SCAN_SSE2, FRAME_SCAN_AVX2};
+    const char *names[] = {"scalar", "sse2", "avx2"};
+    for (size_t impl = 0; impl < sizeof(impls) / sizeof(impls[0]); impl++) {
+        if (!frame_scan_use(impls[impl])) {
+            printf("%-8s not supported\n", names[impl]);
+            continue;
+        }
+
+        start = now();
+        for (unsigned int i = 0; i < ROUNDS; i++) {
+            assert(num_frames == count_frames(buf, len));
+        }
+        report(names[impl], now() - start, len, num_frames);
+    }
+
+    free(buf);
+    return EXIT_SUCCESS;
+}
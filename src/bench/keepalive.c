@@ -0,0 +1,132 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/keepalive.c
+ * Benchmark for keeping track of keep alive deadlines for lots of connections: the timing wheel against checking
+ * every connection each KEEP_ALIVE_INTERVAL (what the server used to do)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_wheel.h"
+#include "edsac_server.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <time.h>
+
+#define CONNECTIONS 100000
+#define QUIET 1000         // connections which stop sending KEEP_ALIVEs (every 100th)
+#define SIMULATED 3600     // seconds
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+typedef struct {
+    WheelTimer timer;
+    _Atomic(time_t) last_keep_alive;
+    uint64_t heard;
+} Connection;
+
+static Connection connections[CONNECTIONS];
+
+// each connection sends a KEEP_ALIVE every KEEP_ALIVE_INTERVAL seconds, on second (i % KEEP_ALIVE_INTERVAL) of each interval
+static bool sends_at(unsigned int i, uint64_t second) {
+    return (0 != i % (CONNECTIONS / QUIET)) && (second % (KEEP_ALIVE_INTERVAL) == i % (KEEP_ALIVE_INTERVAL));
+}
+
+// the old way: every KEEP_ALIVE_INTERVAL seconds every connection is looked at
+static void bench_scan(void) {
+    for (unsigned int i = 0; i < CONNECTIONS; i++) {
+        atomic_init(&(connections[i].last_keep_alive), 0);
+    }
+
+    double update_time = 0;
+    double check_time = 0;
+    size_t updates = 0;
+    size_t checks = 0;
+    size_t timeouts = 0;
+    for (uint64_t second = 1; second <= SIMULATED; second++) {
+        double start = now();
+        for (unsigned int i = (unsigned int) (second % (KEEP_ALIVE_INTERVAL)); i < CONNECTIONS; i += KEEP_ALIVE_INTERVAL) {
+            if (sends_at(i, second)) {
+                atomic_store_explicit(&(connections[i].last_keep_alive), (time_t) second, memory_order_relaxed);
+                updates += 1;
+            }
+        }
+        update_time += now() - start;
+
+        if (0 == second % (KEEP_ALIVE_INTERVAL)) {
+            start = now();
+            for (unsigned int i = 0; i < CONNECTIONS; i++) {
+                time_t diff = (time_t) second - atomic_load_explicit(&(connections[i].last_keep_alive), memory_order_relaxed);
+                if (diff > (KEEP_ALIVE_PROD)) {
+                    timeouts += 1;
+                }
+            }
+            check_time += now() - start;
+            checks += 1;
+        }
+    }
+
+    printf("scan : %6.1f ns per KEEP_ALIVE, %9.1f us per check, %7.1f ms checking per hour (%zu timeouts)\n",
+           update_time * 1E9 / (double) updates, check_time * 1E6 / (double) checks, check_time * 1E3 * 3600 / SIMULATED, timeouts);
+}
+
+// the wheel (what the server does now): a KEEP_ALIVE notes the time and each second only the timers which have gone off are looked at
+// a timer which went off for a connection which has been heard from since is moved on
+static void bench_wheel(void) {
+    TimerWheel wheel;
+    wheel_init(&wheel, 0);
+    for (unsigned int i = 0; i < CONNECTIONS; i++) {
+        connections[i].heard = 0;
+        wheel_timer_init(&(connections[i].timer));
+        wheel_schedule(&wheel, &(connections[i].timer), KEEP_ALIVE_PROD);
+    }
+
+    double update_time = 0;
+    double check_time = 0;
+    size_t updates = 0;
+    size_t timeouts = 0;
+    for (uint64_t second = 1; second <= SIMULATED; second++) {
+        double start = now();
+        for (unsigned int i = (unsigned int) (second % (KEEP_ALIVE_INTERVAL)); i < CONNECTIONS; i += KEEP_ALIVE_INTERVAL) {
+            if (sends_at(i, second)) {
+                connections[i].heard = second;
+                updates += 1;
+            }
+        }
+        update_time += now() - start;
+
+        start = now();
+        WheelTimer *timer = wheel_advance(&wheel, second);
+        while (NULL != timer) {
+            WheelTimer *next = timer->next;
+            Connection *connection = (Connection *) (void *) timer;
+            if (connection->heard + (KEEP_ALIVE_PROD) > second) {
+                wheel_schedule(&wheel, timer, connection->heard + (KEEP_ALIVE_PROD));
+            } else {
+                wheel_schedule(&wheel, timer, second + (KEEP_ALIVE_INTERVAL) * (KEEP_ALIVE_CHECK_PERIOD));
+                timeouts += 1;
+            }
+            timer = next;
+        }
+        check_time += now() - start;
+    }
+
+    printf("wheel: %6.1f ns per KEEP_ALIVE, %9.1f us per check, %7.1f ms checking per hour (%zu timeouts)\n",
+           update_time * 1E9 / (double) updates, check_time * 1E6 / SIMULATED, check_time * 1E3 * 3600 / SIMULATED, timeouts);
+}
+
+int main(void) {
+    printf("%d connections (%d of them quiet) for %d simulated seconds\n", CONNECTIONS, QUIET, SIMULATED);
+    bench_scan();
+    bench_wheel();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/priority.c
+ * Benchmark for how long a valve alarm waits behind a flood of software errors with each ServerPriority
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+
+#define ROUNDS 200
+#define FLOOD 2000        // software errors per round, sent just before the alarm
+#define COST_US 1.0       // how long the reader takes over each message, so that it falls behind the flood
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// pretends to do something with a message
+// it yields as well so that the reactors still get to run on a machine with few CPUs, as they would with a real consumer doing IO
+static void process(void) {
+    double until = now() + COST_US / 1E6;
+    while (now() < until) {
+    }
+    sched_yield();
+}
+
+// encodes a message
+static char *encode(Message *msg, size_t *len) {
+    char *encoded = NULL;
+    ssize_t ret = encode_message(msg, &encoded);
+    assert(ret > 0);
+    free_message(msg);
+    *len = (size_t) ret;
+    return encoded;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    for (size_t written = 0; written < len; ) {
+        ssize_t ret = write(fd, buf + written, len - written);
+        assert(ret > 0);
+        written += (size_t) ret;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char *name, ServerPriority priority, const struct sockaddr *addr, const char *flood, size_t flood_len) {
+    ServerOptions options;
+    server_default_options(&options);
+    options.priority = priority;
+    assert(start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    // the flood and the alarms come from different nodes, as they would
+    int flood_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int alarm_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert((-1 != flood_fd) && (-1 != alarm_fd));
+    assert(0 == connect(flood_fd, addr, sizeof(struct sockaddr_in)));
+    assert(0 == connect(alarm_fd, addr, sizeof(struct sockaddr_in)));
+
+    double latencies[ROUNDS];
+    for (int round = 0; round < ROUNDS; round++) {
+        Message msg;
+        hardware_error_valve(&msg, round, "valve 3 has failed");
+        size_t alarm_len;
+        char *alarm = encode(&msg, &alarm_len);
+
+        write_all(flood_fd, flood, flood_len);
+        double sent = now();
+        write_all(alarm_fd, alarm, alarm_len);
+        free(alarm);
+
+        // read everything from this round, timing the alarm
+        unsigned int received = 0;
+        while (received < FLOOD + 1) {
+            BufferItem *item = read_message_wait(100);
+            if (NULL == item) {
+                continue;
+            }
+            if (HARD_ERROR_VALVE == item->msg.type) {
+                assert(round == item->msg.data.hardware_valve.valve_no);
+                latencies[round] = now() - sent;
+            }
+            free_bufferitem(item);
+            process();
+            received += 1;
+        }
+    }
+
+    qsort(latencies, ROUNDS, sizeof(double), compare_doubles);
+    printf("%-9s alarm latency p50 %8.1f us p99 %8.1f us\n", name, latencies[ROUNDS / 2] * 1E6, latencies[ROUNDS * 99 / 100] * 1E6);
+
+    close(flood_fd);
+    close(alarm_fd);
+    stop_server();
+}
+
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2203);
+    assert(NULL != addr);
+
+    Message msg;
+    software_error(&msg, "Could not decode message");
+    size_t len;
+    char *encoded = encode(&msg, &len);
+    char *flood = malloc(len * FLOOD);
+    assert(NULL != flood);
+    for (unsigned int i = 0; i < FLOOD; i++) {
+        memcpy(flood + len * i, encoded, len);
+    }
+    free(encoded);
+
+    run("fifo", SERVER_PRIORITY_FIFO, addr, flood, len * FLOOD);
+    run("strict", SERVER_PRIORITY_STRICT, addr, flood, len * FLOOD);
+    run("weighted", SERVER_PRIORITY_WEIGHTED, addr, flood, len * FLOOD);
+
+    free(flood);
+    free(addr);
+    return EXIT_SUCCESS;
+}
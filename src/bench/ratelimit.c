@@ -0,0 +1,112 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/ratelimit.c
+ * Benchmark for what ServerOptions.rate_limit_* costs the reactor per message
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#define NUM_MESSAGES 1000000
+#define RUNS 5
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// the messages have only to be read in, so they go straight to a handler which throws them away
+static atomic_size_t handled = 0;
+
+static void handler(BufferItem **items, size_t count, __attribute__((unused)) void *user_data) {
+    free_bufferitems(items, count);
+    atomic_fetch_add(&handled, count);
+}
+
+// everything read in: handled or dropped
+static size_t done(void) {
+    IngressStats stats;
+    server_ingress_stats(&stats);
+    return atomic_load(&handled) + stats.rate_dropped;
+}
+
+static void run(const char *name, unsigned int msgs, size_t bytes, ServerRateAction action, const char *burst, size_t len,
+                const struct sockaddr *addr) {
+    ServerOptions options;
+    server_default_options(&options);
+    options.handler = handler;
+    options.decode = SERVER_DECODE_INLINE;
+    options.rate_limit_msgs = msgs;
+    options.rate_limit_bytes = bytes;
+    options.rate_limit_action = action;
+
+    // best of a few runs, each on a new connection so that it starts with full buckets
+    double best = 1E9;
+    for (unsigned int run = 0; run < RUNS; run++) {
+        assert(start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+        atomic_store(&handled, 0);
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(-1 != fd);
+        assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+
+        double start = now();
+        for (size_t written = 0; written < len * NUM_MESSAGES; ) {
+            ssize_t ret = write(fd, burst + written, len * NUM_MESSAGES - written);
+            assert(ret > 0);
+            written += (size_t) ret;
+        }
+        while (done() < NUM_MESSAGES) {
+            usleep(100);
+        }
+        double elapsed = now() - start;
+        best = (elapsed < best) ? elapsed : best;
+
+        close(fd);
+        stop_server();
+    }
+
+    printf("%-10s %6.1f ns per message\n", name, best * 1E9 / NUM_MESSAGES);
+}
+
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2206);
+    assert(NULL != addr);
+
+    Message msg;
+    software_error(&msg, "valve 3 has failed");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+    char *burst = malloc((size_t) len * NUM_MESSAGES);
+    assert(NULL != burst);
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        memcpy(burst + (size_t) len * i, encoded, (size_t) len);
+    }
+
+    run("off", 0, 0, SERVER_RATE_DELAY, burst, (size_t) len, addr);
+    // limits which are never reached: only the checks are paid for
+    run("unreached", 1000000000, 1000000000, SERVER_RATE_DELAY, burst, (size_t) len, addr);
+    // everything after the first second's worth is dropped without being decoded
+    run("drop", 1000, 0, SERVER_RATE_DROP, burst, (size_t) len, addr);
+
+    free(burst);
+    free(encoded);
+    free_message(&msg);
+    free(addr);
+
+    return EXIT_SUCCESS;
+}
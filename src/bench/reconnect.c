@@ -0,0 +1,110 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/reconnect.c
+ * Benchmark for the time it takes every node to reconnect at once (e.g. after the server restarts)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define NUM_NODES 5000
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// reads from the server until count messages with the given text have arrived
+static void wait_for(unsigned int count, const char *text) {
+    unsigned int received = 0;
+    while (received < count) {
+        BufferItem *item = read_message();
+        if (NULL == item) {
+            usleep(10);
+            continue;
+        }
+
+        assert(SOFT_ERROR == item->msg.type);
+        if (0 == strcmp(text, item->msg.data.software.message->str)) {
+            received += 1;
+        }
+        free_bufferitem(item);
+    }
+}
+
+// every node connects and sends a message as soon as it can
+static void storm(unsigned int nodes, unsigned int defer_accept, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.defer_accept = defer_accept;
+    assert(start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    Message msg;
+    software_error(&msg, "hello");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+
+    int *fds = malloc(nodes * sizeof(int));
+    assert(NULL != fds);
+
+    double start = now();
+    for (unsigned int i = 0; i < nodes; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        assert(-1 != fds[i]);
+        assert(0 == connect(fds[i], addr, sizeof(struct sockaddr_in)));
+        assert(len == write(fds[i], encoded, (size_t) len));
+    }
+    double connected = now();
+    wait_for(nodes, "hello");
+    double done = now();
+
+    printf("defer_accept=%u: %u nodes connected in %.1f ms, all messages received after %.1f ms\n",
+        defer_accept, nodes, (connected - start) * 1E3, (done - start) * 1E3);
+
+    for (unsigned int i = 0; i < nodes; i++) {
+        close(fds[i]);
+    }
+    wait_for(nodes, "Connection closed");
+
+    stop_server();
+    free(fds);
+    free(encoded);
+    free_message(&msg);
+    free(addr);
+}
+
+int main(void) {
+    // each node needs a file descriptor for each end of its connection
+    unsigned int nodes = NUM_NODES;
+    struct rlimit limit;
+    assert(0 == getrlimit(RLIMIT_NOFILE, &limit));
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    assert(0 == getrlimit(RLIMIT_NOFILE, &limit));
+    if (limit.rlim_cur < 2 * NUM_NODES + 64) {
+        nodes = (unsigned int) (limit.rlim_cur - 64) / 2;
+        printf("only %u nodes: not allowed enough file descriptors\n", nodes);
+    }
+
+    storm(nodes, 0, 2200);
+    storm(nodes, 1, 2201);
+
+    return EXIT_SUCCESS;
+}
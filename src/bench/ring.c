@@ -0,0 +1,124 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/ring.c
+ * Benchmark for the shard queues: the lock-free rings against a GQueue behind a mutex (what the shards used to have)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_ring.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define PER_PRODUCER 1000000
+#define MAX_PRODUCERS 8
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+typedef enum {
+    QUEUE_MUTEX,
+    QUEUE_MPSC,
+    QUEUE_MPMC,
+} QueueKind;
+
+static const char *kind_names[] = {"mutex+GQueue", "ring (MPSC)", "ring (MPMC)"};
+
+static QueueKind kind;
+static Ring ring;
+static GQueue *gqueue;
+static pthread_mutex_t mux = PTHREAD_MUTEX_INITIALIZER;
+
+// how often a producer had to wait: for the mutex or (with a ring) because it was full
+static atomic_ulong waits = 0;
+
+static void push(void *value) {
+    if (QUEUE_MUTEX == kind) {
+        if (0 != pthread_mutex_trylock(&mux)) {
+            atomic_fetch_add_explicit(&waits, 1, memory_order_relaxed);
+            pthread_mutex_lock(&mux);
+        }
+        g_queue_push_tail(gqueue, value);
+        pthread_mutex_unlock(&mux);
+        return;
+    }
+
+    while (!ring_push(&ring, value)) {
+        atomic_fetch_add_explicit(&waits, 1, memory_order_relaxed);
+        sched_yield();
+    }
+}
+
+static void *pop(void) {
+    if (QUEUE_MUTEX == kind) {
+        pthread_mutex_lock(&mux);
+        void *value = g_queue_pop_head(gqueue);
+        pthread_mutex_unlock(&mux);
+        return value;
+    }
+
+    return ring_pop(&ring);
+}
+
+static void *producer(__attribute__((unused)) void *arg) {
+    for (uintptr_t n = 1; n <= PER_PRODUCER; n++) {
+        push((void *) n);
+    }
+    return NULL;
+}
+
+// one consumer, like read_message, takes everything the producers push
+static void run(QueueKind which, unsigned int producers) {
+    kind = which;
+    atomic_store(&waits, 0);
+    gqueue = g_queue_new();
+    assert(NULL != gqueue);
+    assert(ring_init(&ring, 65536, QUEUE_MPMC == which));
+
+    double start = now();
+    pthread_t threads[MAX_PRODUCERS];
+    for (unsigned int i = 0; i < producers; i++) {
+        assert(0 == pthread_create(&threads[i], NULL, producer, NULL));
+    }
+
+    unsigned long expected = (unsigned long) producers * PER_PRODUCER;
+    for (unsigned long received = 0; received < expected; ) {
+        if (NULL == pop()) {
+            sched_yield();
+        } else {
+            received += 1;
+        }
+    }
+
+    for (unsigned int i = 0; i < producers; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+    double elapsed = now() - start;
+
+    printf("%-14s %u producers: %6.1f M items/s, producers waited %5.2f%% of the time\n", kind_names[which], producers,
+            (double) expected / elapsed / 1E6, 100.0 * (double) atomic_load(&waits) / (double) expected);
+
+    ring_free(&ring);
+    g_queue_free(gqueue);
+}
+
+int main(void) {
+    for (unsigned int producers = 1; producers <= MAX_PRODUCERS; producers *= 2) {
+        run(QUEUE_MUTEX, producers);
+        run(QUEUE_MPSC, producers);
+        run(QUEUE_MPMC, producers);
+    }
+
+    return EXIT_SUCCESS;
+}
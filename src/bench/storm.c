@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * bench/storm.c
+ * Benchmark for how much a storm of identical valve alarms costs the reader with and without ServerOptions.coalesce_window_ms
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <arpa/inet.h>
+
+#define NODES 100         // each with a failed valve
+#define REPEATS 2000      // how many times each of them reports it
+#define BURST 100         // reports sent per write
+#define WINDOW_MS 50
+#define COST_US 1.0       // how long the reader takes over each message
+
+// seconds since some point
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// pretends to do something with a message
+// it yields as well so that the reactors still get to run on a machine with few CPUs, as they would with a real consumer doing IO
+static void process(void) {
+    double until = now() + COST_US / 1E6;
+    while (now() < until) {
+    }
+    sched_yield();
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    for (size_t written = 0; written < len; ) {
+        ssize_t ret = write(fd, buf + written, len - written);
+        assert(ret > 0);
+        written += (size_t) ret;
+    }
+}
+
+// connects from a loopback address of its own so that the server sees a different node
+static int connect_from(uint32_t ip, const struct sockaddr *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(ip);
+    assert(0 == bind(fd, (struct sockaddr *) &local, sizeof(local)));
+
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    return fd;
+}
+
+// a burst of one node's alarm
+static char *encode_burst(int valve_no, size_t *len) {
+    Message msg;
+    hardware_error_valve(&msg, valve_no, "valve has failed: no heater current");
+    char *encoded = NULL;
+    ssize_t ret = encode_message(&msg, &encoded);
+    assert(ret > 0);
+    free_message(&msg);
+
+    char *burst = malloc((size_t) ret * BURST);
+    assert(NULL != burst);
+    for (unsigned int i = 0; i < BURST; i++) {
+        memcpy(burst + (size_t) ret * i, encoded, (size_t) ret);
+    }
+    free(encoded);
+    *len = (size_t) ret * BURST;
+    return burst;
+}
+
+static void run(const char *name, unsigned int window_ms, const struct sockaddr *addr) {
+    ServerOptions options;
+    server_default_options(&options);
+    options.coalesce_window_ms = window_ms;
+    assert(start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    int fds[NODES];
+    char *bursts[NODES];
+    size_t burst_len[NODES];
+    for (uint32_t i = 0; i < NODES; i++) {
+        fds[i] = connect_from(0x7F000101 + i, addr);
+        bursts[i] = encode_burst((int) i % 8, &(burst_len[i]));
+    }
+
+    // the nodes take turns sending bursts while the reader keeps up as best it can
+    size_t items = 0;
+    size_t messages = 0;
+    size_t max_queued = 0;
+    double start = now();
+    for (unsigned int sent = 0; sent < REPEATS; sent += BURST) {
+        for (unsigned int i = 0; i < NODES; i++) {
+            write_all(fds[i], bursts[i], burst_len[i]);
+        }
+
+        BufferItem *item;
+        while (NULL != (item = read_message())) {
+            items += 1;
+            messages += item->repeats;
+            free_bufferitem(item);
+            process();
+        }
+        IngressStats stats;
+        server_ingress_stats(&stats);
+        max_queued = (stats.queued_items > max_queued) ? stats.queued_items : max_queued;
+    }
+
+    // then everything left, including what is held until the last windows end
+    while (messages < NODES * REPEATS) {
+        IngressStats stats;
+        server_ingress_stats(&stats);
+        max_queued = (stats.queued_items > max_queued) ? stats.queued_items : max_queued;
+
+        BufferItem *item = read_message_wait(100);
+        if (NULL != item) {
+            items += 1;
+            messages += item->repeats;
+            free_bufferitem(item);
+            process();
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("%-9s %7zu items for %zu messages, at most %6zu queued, %.3f s\n", name, items, messages, max_queued, elapsed);
+
+    for (unsigned int i = 0; i < NODES; i++) {
+        close(fds[i]);
+        free(bursts[i]);
+    }
+    stop_server();
+}
+
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2205);
+    assert(NULL != addr);
+
+    run("off", 0, addr);
+    run("coalesce", WINDOW_MS, addr);
+
+    free(addr);
+    return EXIT_SUCCESS;
+}
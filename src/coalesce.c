@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * coalesce.c
+ * Folds repeats of the same message within a time window into one (see edsac_coalesce.h)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_coalesce.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct CoalesceEntry {
+    CoalesceKey key;      // key.text points at text
+    guint hash;
+    uint64_t deadline;    // when this window ends
+    void *held;           // what the copies seen in this window were folded into. NULL if there haven't been any
+    struct CoalesceEntry *next;
+    char text[];
+};
+
+// FNV-1a over everything which makes two messages the same
+static guint hash_key(const CoalesceKey *key) {
+    uint32_t hash = 2166136261u;
+    const uint32_t fields[] = {key->address, (uint32_t) key->type, (uint32_t) key->valve_no};
+    const unsigned char *bytes = (const unsigned char *) fields;
+    for (size_t i = 0; i < sizeof(fields); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    for (size_t i = 0; i < key->text_len; i++) {
+        hash = (hash ^ (unsigned char) key->text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static guint entry_hash(gconstpointer entry) {
+    return ((const CoalesceEntry *) entry)->hash;
+}
+
+static gboolean entry_equal(gconstpointer a, gconstpointer b) {
+    const CoalesceKey *x = &(((const CoalesceEntry *) a)->key);
+    const CoalesceKey *y = &(((const CoalesceEntry *) b)->key);
+    return (x->address == y->address) && (x->type == y->type) && (x->valve_no == y->valve_no) && (x->text_len == y->text_len)
+           && (0 == memcmp(x->text, y->text, x->text_len));
+}
+
+bool coalesce_init(Coalescer *coalescer, uint64_t window_ms) {
+    coalescer->entries = g_hash_table_new(entry_hash, entry_equal);
+    if (NULL == coalescer->entries) {
+        return false;
+    }
+
+    coalescer->head = NULL;
+    coalescer->tail = NULL;
+    coalescer->window_ms = window_ms;
+    return true;
+}
+
+void coalesce_free(Coalescer *coalescer, void (*release)(void *value)) {
+    CoalesceEntry *entry = coalescer->head;
+    while (NULL != entry) {
+        CoalesceEntry *next = entry->next;
+        if ((NULL != entry->held) && (NULL != release)) {
+            release(entry->held);
+        }
+        free(entry);
+        entry = next;
+    }
+
+    if (NULL != coalescer->entries) {
+        g_hash_table_destroy(coalescer->entries);
+        coalescer->entries = NULL;
+    }
+    coalescer->head = NULL;
+    coalescer->tail = NULL;
+}
+
+// puts an entry on the end of the list
+static void append_entry(Coalescer *coalescer, CoalesceEntry *entry) {
+    entry->next = NULL;
+    if (NULL == coalescer->tail) {
+        coalescer->head = entry;
+    } else {
+        coalescer->tail->next = entry;
+    }
+    coalescer->tail = entry;
+}
+
+void *coalesce_add(Coalescer *coalescer, const CoalesceKey *key, void *value, uint64_t now_ms) {
+    // look it up without copying the text
+    CoalesceEntry probe;
+    probe.key = *key;
+    probe.hash = hash_key(key);
+    CoalesceEntry *entry = g_hash_table_lookup(coalescer->entries, &probe);
+
+    if (NULL != entry) {
+        if (NULL == entry->held) {
+            entry->held = value;
+        }
+        return entry->held;
+    }
+
+    // new: remember it (if there is room) and pass it on
+    if (g_hash_table_size(coalescer->entries) >= COALESCE_MAX_ENTRIES) {
+        return NULL;
+    }
+    entry = malloc(sizeof(CoalesceEntry) + key->text_len + 1);
+    if (NULL == entry) {
+        return NULL;
+    }
+    entry->key = *key;
+    memcpy(entry->text, key->text, key->text_len);
+    entry->text[key->text_len] = '\0';
+    entry->key.text = entry->text;
+    entry->hash = probe.hash;
+    entry->deadline = now_ms + coalescer->window_ms;
+    entry->held = NULL;
+    g_hash_table_insert(coalescer->entries, entry, entry);
+    append_entry(coalescer, entry);
+    return NULL;
+}
+
+size_t coalesce_expire(Coalescer *coalescer, uint64_t now_ms, void **values, size_t max) {
+    size_t count = 0;
+    while ((count < max) && (NULL != coalescer->head) && (coalescer->head->deadline <= now_ms)) {
+        CoalesceEntry *entry = coalescer->head;
+        coalescer->head = entry->next;
+        if (NULL == coalescer->head) {
+            coalescer->tail = NULL;
+        }
+
+        if (NULL == entry->held) {
+            // it has stopped repeating
+            g_hash_table_remove(coalescer->entries, entry);
+            free(entry);
+            continue;
+        }
+
+        // still going: hand out what this window folded together and start another
+        values[count++] = entry->held;
+        entry->held = NULL;
+        entry->deadline = now_ms + coalescer->window_ms;
+        append_entry(coalescer, entry);
+    }
+
+    return count;
+}
+
+uint64_t coalesce_next_deadline(const Coalescer *coalescer) {
+    return (NULL == coalescer->head) ? 0 : coalescer->head->deadline;
+}
+
+size_t coalesce_size(const Coalescer *coalescer) {
+    return g_hash_table_size(coalescer->entries);
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * epoch.c
+ * Epoch based reclamation (see edsac_epoch.h)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_epoch.h"
+#include <sched.h>
+
+#define EPOCH_ACTIVE 1
+
+// which record each thread tries first, so that readers on different threads don't fight over the same cache line
+static atomic_uint next_hint = 0;
+static _Thread_local unsigned int hint = EPOCH_MAX_READERS;
+
+void epoch_domain_init(EpochDomain *domain) {
+    atomic_init(&(domain->epoch), 0);
+    for (unsigned int i = 0; i < EPOCH_MAX_READERS; i++) {
+        atomic_init(&(domain->records[i].state), 0);
+    }
+}
+
+EpochRecord *epoch_enter(EpochDomain *domain) {
+    if (EPOCH_MAX_READERS == hint) {
+        hint = atomic_fetch_add_explicit(&next_hint, 1, memory_order_relaxed) % EPOCH_MAX_READERS;
+    }
+
+    for (unsigned int i = hint; ; i = (i + 1) % EPOCH_MAX_READERS) {
+        EpochRecord *record = &(domain->records[i]);
+
+        // cheap check first so that we don't take the cache line unless it is free
+        uint_least64_t expected = 0;
+        if (0 != atomic_load_explicit(&(record->state), memory_order_relaxed)) {
+            if ((i + 1) % EPOCH_MAX_READERS == hint) { // every record is taken
+                sched_yield();
+            }
+            continue;
+        }
+
+        // claiming the record announces the epoch. The seq_cst exchange orders it before anything we go on to read
+        uint_least64_t epoch = atomic_load(&(domain->epoch));
+        if (atomic_compare_exchange_strong(&(record->state), &expected, (epoch << 1) | EPOCH_ACTIVE)) {
+            return record;
+        }
+    }
+}
+
+void epoch_exit(EpochRecord *record) {
+    atomic_store_explicit(&(record->state), 0, memory_order_release);
+}
+
+void epoch_limbo_init(EpochLimbo *limbo, epoch_reclaim_t reclaim, void *arg) {
+    limbo->head = NULL;
+    limbo->tail = NULL;
+    limbo->count = 0;
+    limbo->reclaim = reclaim;
+    limbo->arg = arg;
+}
+
+void epoch_retire(EpochDomain *domain, EpochLimbo *limbo, EpochNode *node) {
+    // seq_cst: whatever made node unreachable happens before we read the epoch
+    node->epoch = atomic_load(&(domain->epoch));
+    node->next = NULL;
+
+    // epochs only go up so the list stays oldest first
+    if (NULL == limbo->tail) {
+        limbo->head = node;
+    } else {
+        limbo->tail->next = node;
+    }
+    limbo->tail = node;
+    limbo->count += 1;
+}
+
+// moves the global epoch on if every reader has seen the current one
+// returns the global epoch
+static uint_least64_t try_advance(EpochDomain *domain) {
+    uint_least64_t epoch = atomic_load(&(domain->epoch));
+
+    for (unsigned int i = 0; i < EPOCH_MAX_READERS; i++) {
+        uint_least64_t state = atomic_load(&(domain->records[i].state));
+        if ((state & EPOCH_ACTIVE) && ((state >> 1) != epoch)) {
+            return epoch;
+        }
+    }
+
+    // if someone else moved it on first then that is just as good
+    if (atomic_compare_exchange_strong(&(domain->epoch), &epoch, epoch + 1)) {
+        return epoch + 1;
+    }
+    return epoch;
+}
+
+// hands over everything at the front of limbo which was retired before epoch - 1
+static size_t reclaim_before(EpochLimbo *limbo, uint_least64_t epoch) {
+    size_t count = 0;
+
+    while ((NULL != limbo->head) && (limbo->head->epoch + 2 <= epoch)) {
+        EpochNode *node = limbo->head;
+        limbo->head = node->next;
+        if (NULL == limbo->head) {
+            limbo->tail = NULL;
+        }
+        limbo->count -= 1;
+
+        limbo->reclaim(node, limbo->arg);
+        count += 1;
+    }
+
+    return count;
+}
+
+size_t epoch_reclaim(EpochDomain *domain, EpochLimbo *limbo) {
+    if (NULL == limbo->head) {
+        return 0;
+    }
+
+    // a node needs the epoch to be two past when it was retired. Without readers in the way everything can go after at most two steps
+    uint_least64_t epoch = try_advance(domain);
+    if (limbo->tail->epoch + 2 > epoch) {
+        epoch = try_advance(domain);
+    }
+
+    return reclaim_before(limbo, epoch);
+}
+
+void epoch_limbo_drain(EpochLimbo *limbo) {
+    reclaim_before(limbo, UINT_LEAST64_MAX);
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * fair.c
+ * Queues which take turns between flows (see edsac_fair.h)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_fair.h"
+#include <stdlib.h>
+
+// the size of a new flow's queue. It doubles when it fills up
+#define FAIR_FLOW_INITIAL 16
+
+// how many empty flows are kept around for reuse
+#define FAIR_MAX_SPARE 64
+
+// a queued value and what it costs
+typedef struct {
+    void *value;
+    size_t cost;
+} FairEntry;
+
+struct FairFlow {
+    uint32_t key;
+    FairEntry *entries; // a ring of capacity entries, count of them from head
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t deficit; // credit left over from this turn (or the last)
+    bool in_turn;   // has been given its quantum for the turn it is having
+    bool watched;
+    struct FairFlow *next; // the next to have a turn
+};
+
+bool fair_init(FairQueue *queue, size_t capacity, size_t quantum, size_t watch_below) {
+    queue->flows = g_hash_table_new(g_direct_hash, g_direct_equal);
+    if (NULL == queue->flows) {
+        return false;
+    }
+    if (0 != pthread_mutex_init(&(queue->lock), NULL)) {
+        g_hash_table_destroy(queue->flows);
+        queue->flows = NULL;
+        return false;
+    }
+
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->spare = NULL;
+    queue->num_spare = 0;
+    queue->quantum = (0 == quantum) ? 1 : quantum;
+    queue->capacity = capacity;
+    queue->watch_below = watch_below;
+    atomic_init(&(queue->size), 0);
+    return true;
+}
+
+static void free_flow(FairFlow *flow) {
+    free(flow->entries);
+    free(flow);
+}
+
+void fair_free(FairQueue *queue) {
+    if (NULL == queue->flows) {
+        return;
+    }
+
+    while (NULL != queue->head) {
+        FairFlow *next = queue->head->next;
+        free_flow(queue->head);
+        queue->head = next;
+    }
+    while (NULL != queue->spare) {
+        FairFlow *next = queue->spare->next;
+        free_flow(queue->spare);
+        queue->spare = next;
+    }
+
+    g_hash_table_destroy(queue->flows);
+    queue->flows = NULL;
+    pthread_mutex_destroy(&(queue->lock));
+}
+
+// finds flow key, or starts it at the back of the turns
+// returns NULL if we run out of memory
+static FairFlow *get_flow(FairQueue *queue, uint32_t key) {
+    FairFlow *flow = g_hash_table_lookup(queue->flows, GUINT_TO_POINTER(key));
+    if (NULL != flow) {
+        return flow;
+    }
+
+    if (NULL != queue->spare) {
+        flow = queue->spare;
+        queue->spare = flow->next;
+        queue->num_spare -= 1;
+    } else {
+        flow = malloc(sizeof(FairFlow));
+        if (NULL == flow) {
+            return NULL;
+        }
+        flow->entries = malloc(FAIR_FLOW_INITIAL * sizeof(FairEntry));
+        if (NULL == flow->entries) {
+            free(flow);
+            return NULL;
+        }
+        flow->capacity = FAIR_FLOW_INITIAL;
+    }
+
+    flow->key = key;
+    flow->head = 0;
+    flow->count = 0;
+    flow->deficit = 0;
+    flow->in_turn = false;
+    flow->watched = false;
+    flow->next = NULL;
+    g_hash_table_insert(queue->flows, GUINT_TO_POINTER(key), flow);
+
+    if (NULL == queue->tail) {
+        queue->head = flow;
+    } else {
+        queue->tail->next = flow;
+    }
+    queue->tail = flow;
+    return flow;
+}
+
+// doubles the room in a flow's ring
+static bool grow_flow(FairFlow *flow) {
+    FairEntry *entries = malloc(2 * flow->capacity * sizeof(FairEntry));
+    if (NULL == entries) {
+        return false;
+    }
+
+    for (size_t i = 0; i < flow->count; i++) {
+        entries[i] = flow->entries[(flow->head + i) % flow->capacity];
+    }
+    free(flow->entries);
+    flow->entries = entries;
+    flow->capacity *= 2;
+    flow->head = 0;
+    return true;
+}
+
+bool fair_push(FairQueue *queue, uint32_t key, void *value, size_t cost) {
+    pthread_mutex_lock(&(queue->lock));
+
+    bool ret = false;
+    FairFlow *flow = NULL;
+    if (atomic_load_explicit(&(queue->size), memory_order_relaxed) < queue->capacity) {
+        flow = get_flow(queue, key);
+    }
+    if ((NULL != flow) && ((flow->count < flow->capacity) || grow_flow(flow))) {
+        FairEntry *entry = &(flow->entries[(flow->head + flow->count) % flow->capacity]);
+        entry->value = value;
+        entry->cost = cost;
+        flow->count += 1;
+        atomic_fetch_add_explicit(&(queue->size), 1, memory_order_relaxed);
+        ret = true;
+    }
+
+    pthread_mutex_unlock(&(queue->lock));
+    return ret;
+}
+
+// takes the flow at the head off the turns now that it is empty
+static void retire_head(FairQueue *queue) {
+    FairFlow *flow = queue->head;
+    queue->head = flow->next;
+    if (NULL == queue->head) {
+        queue->tail = NULL;
+    }
+    g_hash_table_remove(queue->flows, GUINT_TO_POINTER(flow->key));
+
+    if (queue->num_spare < FAIR_MAX_SPARE) {
+        flow->next = queue->spare;
+        queue->spare = flow;
+        queue->num_spare += 1;
+    } else {
+        free_flow(flow);
+    }
+}
+
+// moves the flow at the head to the back of the turns
+static void rotate_head(FairQueue *queue) {
+    FairFlow *flow = queue->head;
+    flow->in_turn = false;
+    if (flow == queue->tail) {
+        return;
+    }
+
+    queue->head = flow->next;
+    flow->next = NULL;
+    queue->tail->next = flow;
+    queue->tail = flow;
+}
+
+size_t fair_pop_batch(FairQueue *queue, void **values, size_t max, bool *drained) {
+    if (NULL != drained) {
+        *drained = false;
+    }
+    if (0 == atomic_load_explicit(&(queue->size), memory_order_relaxed)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(queue->lock));
+
+    size_t count = 0;
+    while ((count < max) && (NULL != queue->head)) {
+        FairFlow *flow = queue->head;
+        if (!flow->in_turn) {
+            flow->deficit += queue->quantum;
+            flow->in_turn = true;
+        }
+
+        // hand out what fits in its credit
+        while ((count < max) && (0 != flow->count) && (flow->entries[flow->head].cost <= flow->deficit)) {
+            FairEntry *entry = &(flow->entries[flow->head]);
+            values[count++] = entry->value;
+            flow->deficit -= entry->cost;
+            flow->head = (flow->head + 1) % flow->capacity;
+            flow->count -= 1;
+        }
+
+        if (flow->watched && (flow->count <= queue->watch_below)) {
+            flow->watched = false;
+            if (NULL != drained) {
+                *drained = true;
+            }
+        }
+
+        if (0 == flow->count) {
+            retire_head(queue); // an empty flow doesn't save up credit
+        } else if (flow->entries[flow->head].cost > flow->deficit) {
+            rotate_head(queue); // its turn is over
+        }
+        // otherwise values is full and the flow carries on with its turn next time
+    }
+
+    atomic_fetch_sub_explicit(&(queue->size), count, memory_order_relaxed);
+    pthread_mutex_unlock(&(queue->lock));
+    return count;
+}
+
+void *fair_pop(FairQueue *queue) {
+    void *value = NULL;
+    fair_pop_batch(queue, &value, 1, NULL);
+    return value;
+}
+
+bool fair_watch(FairQueue *queue, uint32_t key, size_t limit) {
+    pthread_mutex_lock(&(queue->lock));
+    FairFlow *flow = g_hash_table_lookup(queue->flows, GUINT_TO_POINTER(key));
+    bool ret = (NULL != flow) && (flow->count >= limit);
+    if (ret) {
+        flow->watched = true;
+    }
+    pthread_mutex_unlock(&(queue->lock));
+    return ret;
+}
+
+size_t fair_flow_size(FairQueue *queue, uint32_t key) {
+    pthread_mutex_lock(&(queue->lock));
+    FairFlow *flow = g_hash_table_lookup(queue->flows, GUINT_TO_POINTER(key));
+    size_t ret = (NULL == flow) ? 0 : flow->count;
+    pthread_mutex_unlock(&(queue->lock));
+    return ret;
+}
+
+size_t fair_size(FairQueue *queue) {
+    return atomic_load_explicit(&(queue->size), memory_order_relaxed);
+}
@@ -0,0 +1,515 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * framing.c
+ * Receive buffers and finding where messages start and end in a stream of bytes
+ */
+
+// includes
+#include "config.h"
+#include "edsac_framing.h"
+#include "edsac_arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// functions
+
+// initialises an empty receive buffer
+void recv_buffer_init(RecvBuffer *buf) {
+    buf->data = NULL;
+    buf->start = 0;
+    buf->end = 0;
+    buf->capacity = 0;
+    buf->shared = false;
+    buf->block = NULL;
+}
+
+// initialises an empty receive buffer kept in an arena
+void recv_buffer_init_shared(RecvBuffer *buf) {
+    recv_buffer_init(buf);
+    buf->shared = true;
+}
+
+// frees the memory held by a receive buffer
+void recv_buffer_free(RecvBuffer *buf) {
+    bool shared = buf->shared;
+    if (shared) {
+        if (NULL != buf->block) {
+            arena_unref(buf->block);
+        }
+    } else {
+        free(buf->data);
+    }
+    recv_buffer_init(buf);
+    buf->shared = shared;
+}
+
+// takes a reference to the arena holding the data
+struct Arena *recv_buffer_share(RecvBuffer *buf) {
+    if (NULL != buf->block) {
+        arena_ref(buf->block);
+    }
+    return buf->block;
+}
+
+// can bytes which have already been consumed be moved or written over
+static bool recv_buffer_reusable(const RecvBuffer *buf) {
+    // only this thread takes references, so nobody else can take one between this check and us writing
+    return (NULL == buf->block) || (1 == atomic_load_explicit(&(buf->block->refs), memory_order_acquire));
+}
+
+// allocates somewhere for capacity bytes and a '\0'
+// returns NULL if we run out of memory
+static char *recv_buffer_alloc(RecvBuffer *buf, size_t capacity, Arena **block) {
+    if (!buf->shared) {
+        return malloc(capacity + 1);
+    }
+
+    *block = arena_new(capacity + 1);
+    return (NULL == *block) ? NULL : (*block)->data;
+}
+
+// makes room for at least len more bytes
+char *recv_buffer_reserve(RecvBuffer *buf, size_t len, size_t *space) {
+    size_t waiting = buf->end - buf->start;
+
+    if (buf->capacity - buf->end < len) {
+        if ((buf->capacity - waiting >= len) && recv_buffer_reusable(buf)) {
+            // there is enough room if we move what is waiting to the front
+            memmove(buf->data, buf->data + buf->start, waiting);
+        } else {
+            // grow (or move to a new arena of the same size if someone is still using the old one)
+            size_t capacity = (0 == buf->capacity) ? RECV_BUFFER_INITIAL : buf->capacity;
+            while (capacity - waiting < len) {
+                capacity *= 2;
+            }
+            if (capacity > RECV_BUFFER_MAX) {
+                return NULL;
+            }
+
+            Arena *block = NULL;
+            char *data = recv_buffer_alloc(buf, capacity, &block);
+            if (NULL == data) {
+                return NULL;
+            }
+            if (NULL != buf->data) {
+                memcpy(data, buf->data + buf->start, waiting);
+                if (buf->shared) {
+                    arena_unref(buf->block);
+                } else {
+                    free(buf->data);
+                }
+            }
+            buf->data = data;
+            buf->block = block;
+            buf->capacity = capacity;
+        }
+
+        buf->start = 0;
+        buf->end = waiting;
+    }
+
+    *space = buf->capacity - buf->end;
+    return buf->data + buf->end;
+}
+
+// records that len bytes were written where recv_buffer_reserve said
+void recv_buffer_commit(RecvBuffer *buf, size_t len) {
+    buf->end += len;
+}
+
+// copies len bytes onto the end of the buffer
+bool recv_buffer_append(RecvBuffer *buf, const char *data, size_t len) {
+    size_t space;
+    char *dest = recv_buffer_reserve(buf, len, &space);
+    if (NULL == dest) {
+        return false;
+    }
+
+    memcpy(dest, data, len);
+    recv_buffer_commit(buf, len);
+    return true;
+}
+
+// drops len bytes from the start of the buffer
+void recv_buffer_consume(RecvBuffer *buf, size_t len) {
+    buf->start += len;
+
+    // start again from the front when we can do so for free
+    if ((buf->start == buf->end) && recv_buffer_reusable(buf)) {
+        buf->start = 0;
+        buf->end = 0;
+    }
+}
+
+/* Finding the end of a frame
+A frame ends at the '}' which closes the first '{', but braces inside strings don't count and a string ends at the first quote which isn't escaped.
+The scalar scanner goes through this one byte at a time.
+
+The SIMD scanners follow stage 1 of simdjson instead. 64 bytes are compared at once against '"', '\\', '{' and '}' to get a bitmask for each (bit i for byte i).
+Escaped characters are found from runs of backslashes using a carrying add, then a prefix xor of the unescaped quotes gives a mask of everything inside strings.
+This leaves the braces which count. Those are rare so they are walked one set bit at a time to follow the nesting.
+Anything left over at the end which doesn't fill 64 bytes is done by the scalar scanner: the scanners share their state so they can take over from each other at any point. */
+
+// starts looking for a new frame
+void frame_scanner_reset(FrameScanner *scanner) {
+    scanner->scanned = 0;
+    scanner->depth = 0;
+    scanner->in_string = false;
+    scanner->escaped = false;
+}
+
+// scans frame[scanner->scanned] to frame[len - 1] one byte at a time
+// returns true and sets *end (just after the closing '}') if the frame ends
+static bool scan_scalar(FrameScanner *scanner, const char *frame, size_t len, size_t *end) {
+    for (size_t i = scanner->scanned; i < len; i++) {
+        char c = frame[i];
+
+        if (scanner->escaped) { // an escaped character doesn't do anything
+            scanner->escaped = false;
+        } else if ('\\' == c) {
+            scanner->escaped = true;
+        } else if ('"' == c) {
+            scanner->in_string = !scanner->in_string;
+        } else if (!scanner->in_string) {
+            if ('{' == c) {
+                scanner->depth += 1;
+            } else if (('}' == c) && (0 == --scanner->depth)) {
+                *end = i + 1;
+                return true;
+            }
+        }
+    }
+
+    scanner->scanned = len;
+    return false;
+}
+
+// which bytes of a 64 byte block are each character we care about
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t open;
+    uint64_t close;
+} BlockMasks;
+
+// bit i of the result is the xor of bits 0 to i of x
+static inline uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// updates the scanner with the next 64 byte block
+// returns true and sets *end (offset in the block just after the closing '}') if the frame ends in this block
+static inline bool scan_block(FrameScanner *scanner, const BlockMasks *masks, size_t *end) {
+    // find escaped characters (simdjson's find_escaped). Runs of backslashes escape every other character.
+    // Adding the runs starting on odd bits to all of the backslashes carries them off the end of the run, so that
+    // after the xor with the even bits the characters after odd length runs are left
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    uint64_t carry = scanner->escaped ? 1 : 0;
+    uint64_t backslash = masks->backslash & ~carry;
+    uint64_t follows_escape = (backslash << 1) | carry;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_starts;
+    bool overflow = __builtin_add_overflow(odd_starts, backslash, &even_starts);
+    uint64_t escaped = (even_bits ^ (even_starts << 1)) & follows_escape;
+
+    // every byte from an unescaped quote up to the next one is in a string
+    uint64_t in_string = prefix_xor(masks->quote & ~escaped) ^ (scanner->in_string ? ~0ULL : 0);
+
+    // follow the nesting of the braces which count
+    uint64_t braces = (masks->open | masks->close) & ~in_string & ~escaped;
+    while (0 != braces) {
+        unsigned int bit = (unsigned int) __builtin_ctzll(braces);
+        if (masks->open & (1ULL << bit)) {
+            scanner->depth += 1;
+        } else if (0 == --scanner->depth) {
+            *end = bit + 1;
+            return true;
+        }
+        braces &= braces - 1;
+    }
+
+    scanner->escaped = overflow;
+    scanner->in_string = 0 != (in_string >> 63);
+    return false;
+}
+
+#ifdef __x86_64__
+// bitmask of which bytes in a 16 byte vector equal c
+#define SSE2_MASK(_vec, _c) ((uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8((_vec), _mm_set1_epi8(_c))))
+
+// classifies 64 bytes 16 at a time
+static inline void classify_sse2(const char *block, BlockMasks *masks) {
+    memset(masks, 0, sizeof(*masks));
+    for (unsigned int i = 0; i < 4; i++) {
+        __m128i vec = _mm_loadu_si128((const __m128i *) (const void *) (block + 16 * i));
+        masks->quote |= SSE2_MASK(vec, '"') << (16 * i);
+        masks->backslash |= SSE2_MASK(vec, '\\') << (16 * i);
+        masks->open |= SSE2_MASK(vec, '{') << (16 * i);
+        masks->close |= SSE2_MASK(vec, '}') << (16 * i);
+    }
+}
+
+// scans frame[scanner->scanned] to frame[len - 1] 64 bytes at a time using SSE2
+static bool scan_sse2(FrameScanner *scanner, const char *frame, size_t len, size_t *end) {
+    size_t i;
+    for (i = scanner->scanned; i + 64 <= len; i += 64) {
+        BlockMasks masks;
+        classify_sse2(frame + i, &masks);
+
+        size_t block_end;
+        if (scan_block(scanner, &masks, &block_end)) {
+            *end = i + block_end;
+            return true;
+        }
+    }
+
+    scanner->scanned = i;
+    return scan_scalar(scanner, frame, len, end);
+}
+
+// bitmask of which bytes in a 32 byte vector equal c
+#define AVX2_MASK(_vec, _c) ((uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8((_vec), _mm256_set1_epi8(_c))))
+
+// classifies 64 bytes 32 at a time
+__attribute__((target("avx2")))
+static inline void classify_avx2(const char *block, BlockMasks *masks) {
+    __m256i lo = _mm256_loadu_si256((const __m256i *) (const void *) block);
+    __m256i hi = _mm256_loadu_si256((const __m256i *) (const void *) (block + 32));
+    masks->quote = AVX2_MASK(lo, '"') | (AVX2_MASK(hi, '"') << 32);
+    masks->backslash = AVX2_MASK(lo, '\\') | (AVX2_MASK(hi, '\\') << 32);
+    masks->open = AVX2_MASK(lo, '{') | (AVX2_MASK(hi, '{') << 32);
+    masks->close = AVX2_MASK(lo, '}') | (AVX2_MASK(hi, '}') << 32);
+}
+
+// scans frame[scanner->scanned] to frame[len - 1] 64 bytes at a time using AVX2
+__attribute__((target("avx2")))
+static bool scan_avx2(FrameScanner *scanner, const char *frame, size_t len, size_t *end) {
+    size_t i;
+    for (i = scanner->scanned; i + 64 <= len; i += 64) {
+        BlockMasks masks;
+        classify_avx2(frame + i, &masks);
+
+        size_t block_end;
+        if (scan_block(scanner, &masks, &block_end)) {
+            *end = i + block_end;
+            return true;
+        }
+    }
+
+    scanner->scanned = i;
+    return scan_scalar(scanner, frame, len, end);
+}
+#endif // __x86_64__
+
+// the scanner find_frame uses
+typedef bool (*ScanFunction)(FrameScanner *scanner, const char *frame, size_t len, size_t *end);
+static ScanFunction scan = scan_scalar;
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+// the fastest way this CPU supports
+FrameScanImpl frame_scan_best(void) {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return FRAME_SCAN_AVX2;
+    }
+    return FRAME_SCAN_SSE2; // every x86_64 has SSE2
+#else
+    return FRAME_SCAN_SCALAR;
+#endif
+}
+
+// makes find_frame use impl
+static bool set_scan(FrameScanImpl impl) {
+    switch (impl) {
+        case FRAME_SCAN_SCALAR:
+            scan = scan_scalar;
+            return true;
+#ifdef __x86_64__
+        case FRAME_SCAN_SSE2:
+            scan = scan_sse2;
+            return true;
+        case FRAME_SCAN_AVX2:
+            if (!__builtin_cpu_supports("avx2")) {
+                return false;
+            }
+            scan = scan_avx2;
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+// picks the fastest scanner the first time find_frame is used
+static void init_scan(void) {
+    set_scan(frame_scan_best());
+}
+
+// makes find_frame use impl
+bool frame_scan_use(FrameScanImpl impl) {
+    pthread_once(&scan_once, init_scan);
+    return set_scan(impl);
+}
+
+// looks for a json object at the start of data
+FrameStatus find_frame(FrameScanner *scanner, const char *data, size_t len, size_t *frame_start, size_t *frame_end) {
+    pthread_once(&scan_once, init_scan);
+
+    size_t start = 0;
+
+    // a new frame
+    if (0 == scanner->scanned) {
+        // skip newline characters so we can telnet in for testing
+        while ((start < len) && (('\n' == data[start]) || (13 /*CR*/ == data[start]))) {
+            start += 1;
+        }
+
+        if (start == len) {
+            *frame_start = start;
+            return FRAME_PARTIAL;
+        }
+
+        // the first character must be {
+        if ('{' != data[start]) {
+            printf("invalid c=%i\n", (int) data[start]);
+            return FRAME_INVALID;
+        }
+    }
+    *frame_start = start;
+
+    // find the end of the object
+    size_t end;
+    if (!scan(scanner, data + start, len - start, &end)) {
+        return FRAME_PARTIAL;
+    }
+
+    *frame_end = start + end;
+    frame_scanner_reset(scanner);
+    return FRAME_FOUND;
+}
+
+// writes the preamble for mode
+size_t framing_preamble(FramingMode mode, char *preamble) {
+    if (FRAMING_BRACES == mode) {
+        return 0;
+    }
+
+    preamble[0] = '\0';
+    preamble[1] = 'E';
+    preamble[2] = 'D';
+    preamble[3] = (FRAMING_NDJSON == mode) ? 'N' : 'L';
+    return FRAMING_PREAMBLE_LEN;
+}
+
+// works out how a connection is framed from the first bytes received on it
+FrameStatus detect_framing(const char *data, size_t len, FramingMode *mode, size_t *preamble_len) {
+    if (0 == len) {
+        return FRAME_PARTIAL;
+    }
+
+    // no preamble
+    if ('\0' != data[0]) {
+        *mode = FRAMING_BRACES;
+        *preamble_len = 0;
+        return FRAME_FOUND;
+    }
+
+    if (len < FRAMING_PREAMBLE_LEN) {
+        return FRAME_PARTIAL;
+    }
+
+    if (('E' != data[1]) || ('D' != data[2])) {
+        puts("invalid preamble");
+        return FRAME_INVALID;
+    }
+
+    if ('N' == data[3]) {
+        *mode = FRAMING_NDJSON;
+    } else if ('L' == data[3]) {
+        *mode = FRAMING_LENGTH_PREFIXED;
+    } else {
+        printf("unknown framing mode c=%i\n", (int) data[3]);
+        return FRAME_INVALID;
+    }
+
+    *preamble_len = FRAMING_PREAMBLE_LEN;
+    return FRAME_FOUND;
+}
+
+// looks for a newline terminated message at the start of data
+FrameStatus find_ndjson_frame(FrameScanner *scanner, const char *data, size_t len, size_t *frame_start, size_t *frame_end) {
+    size_t start = 0;
+
+    // skip blank lines (including the newline after the last message)
+    if (0 == scanner->scanned) {
+        while ((start < len) && (('\n' == data[start]) || (13 /*CR*/ == data[start]))) {
+            start += 1;
+        }
+    }
+    *frame_start = start;
+
+    // everything up to scanned is already known not to contain a newline
+    const char *newline = memchr(data + start + scanner->scanned, '\n', len - start - scanner->scanned);
+    if (NULL == newline) {
+        scanner->scanned = len - start;
+        return FRAME_PARTIAL;
+    }
+
+    size_t end = (size_t) (newline - data);
+    if (13 /*CR*/ == data[end - 1]) {
+        end -= 1;
+    }
+    *frame_end = end;
+    frame_scanner_reset(scanner);
+    return FRAME_FOUND;
+}
+
+// looks for a length prefixed message at the start of data
+FrameStatus find_length_prefixed_frame(const char *data, size_t len, size_t *frame_start, size_t *frame_end) {
+    *frame_start = 0;
+    if (len < 4) {
+        return FRAME_PARTIAL;
+    }
+
+    const unsigned char *prefix = (const unsigned char *) data;
+    size_t frame_len = ((size_t) prefix[0] << 24) | ((size_t) prefix[1] << 16) | ((size_t) prefix[2] << 8) | (size_t) prefix[3];
+    if ((0 == frame_len) || (frame_len > FRAME_MAX_LEN)) {
+        printf("invalid frame length %zu\n", frame_len);
+        return FRAME_INVALID;
+    }
+
+    if (len - 4 < frame_len) {
+        return FRAME_PARTIAL;
+    }
+
+    *frame_start = 4;
+    *frame_end = 4 + frame_len;
+    return FRAME_FOUND;
+}
+
+// finds the next message using whichever of the above goes with mode
+FrameStatus next_frame(FramingMode mode, FrameScanner *scanner, const char *data, size_t len, size_t *frame_start, size_t *frame_end) {
+    switch (mode) {
+        case FRAMING_NDJSON:
+            return find_ndjson_frame(scanner, data, len, frame_start, frame_end);
+        case FRAMING_LENGTH_PREFIXED:
+            return find_length_prefixed_frame(data, len, frame_start, frame_end);
+        case FRAMING_BRACES:
+        default:
+            return find_frame(scanner, data, len, frame_start, frame_end);
+    }
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * pool.c
+ * Per-thread slab pools (see edsac_pool.h)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_pool.h"
+#include <stdlib.h>
+#include <stdint.h>
+
+// a slab starts with a link to the next one, then its objects
+#define SLAB_HEADER sizeof(PoolObject)
+
+// bumps a counter only the owner writes, without a locked instruction
+static inline void count(atomic_size_t *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+void pool_set_init(PoolSet *set, size_t object_size, size_t slab_objects) {
+    atomic_init(&(set->pools), NULL);
+    // round up so that every object in a slab stays aligned
+    size_t align = sizeof(PoolObject);
+    set->object_size = (sizeof(PoolObject) + object_size + align - 1) / align * align;
+    set->slab_objects = slab_objects;
+}
+
+void pool_set_free(PoolSet *set) {
+    Pool *pool = atomic_exchange(&(set->pools), NULL);
+    while (NULL != pool) {
+        Pool *next = pool->next;
+        void *slab = pool->slabs;
+        while (NULL != slab) {
+            void *next_slab = *(void **) slab;
+            free(slab);
+            slab = next_slab;
+        }
+        free(pool);
+        pool = next;
+    }
+}
+
+void pool_set_stats(PoolSet *set, PoolStats *stats) {
+    stats->allocations = 0;
+    stats->hits = 0;
+    stats->slabs = 0;
+    for (Pool *pool = atomic_load_explicit(&(set->pools), memory_order_acquire); NULL != pool; pool = pool->next) {
+        stats->allocations += atomic_load_explicit(&(pool->allocations), memory_order_relaxed);
+        stats->hits += atomic_load_explicit(&(pool->hits), memory_order_relaxed);
+        stats->slabs += atomic_load_explicit(&(pool->num_slabs), memory_order_relaxed);
+    }
+    stats->resident_bytes = stats->slabs * (SLAB_HEADER + set->slab_objects * set->object_size);
+}
+
+Pool *pool_claim(PoolSet *set) {
+    // reuse a pool someone has given up, along with everything in it
+    for (Pool *pool = atomic_load_explicit(&(set->pools), memory_order_acquire); NULL != pool; pool = pool->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&(pool->owned), memory_order_relaxed)
+                && atomic_compare_exchange_strong_explicit(&(pool->owned), &expected, true, memory_order_acquire, memory_order_relaxed)) {
+            return pool;
+        }
+    }
+
+    Pool *pool = aligned_alloc(POOL_CACHE_LINE, sizeof(Pool));
+    if (NULL == pool) {
+        return NULL;
+    }
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->object_size = set->object_size;
+    pool->slab_objects = set->slab_objects;
+    atomic_init(&(pool->allocations), 0);
+    atomic_init(&(pool->hits), 0);
+    atomic_init(&(pool->num_slabs), 0);
+    atomic_init(&(pool->remote_free), NULL);
+    atomic_init(&(pool->owned), true);
+
+    // pools are only ever added at the front so nobody walking the list can miss one
+    pool->next = atomic_load_explicit(&(set->pools), memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&(set->pools), &(pool->next), pool, memory_order_release, memory_order_relaxed)) {
+        // pool->next is now the new head
+    }
+
+    return pool;
+}
+
+void pool_release(Pool *pool) {
+    // the next owner sees the free list as we left it
+    atomic_store_explicit(&(pool->owned), false, memory_order_release);
+}
+
+// carves a new slab up into free objects
+static bool add_slab(Pool *pool) {
+    char *slab = malloc(SLAB_HEADER + pool->slab_objects * pool->object_size);
+    if (NULL == slab) {
+        return false;
+    }
+    *(void **) slab = pool->slabs;
+    pool->slabs = slab;
+    count(&(pool->num_slabs));
+
+    // in order, so that consecutive allocations are next to each other
+    for (size_t i = pool->slab_objects; i > 0; i--) {
+        PoolObject *obj = (PoolObject *) (void *) (slab + SLAB_HEADER + (i - 1) * pool->object_size);
+        obj->pool = pool;
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+    }
+
+    return true;
+}
+
+void *pool_alloc(Pool *pool) {
+    count(&(pool->allocations));
+
+    if (NULL == pool->free_list) {
+        // take back everything other threads have freed in one go
+        pool->free_list = atomic_exchange_explicit(&(pool->remote_free), NULL, memory_order_acquire);
+    }
+    if (NULL == pool->free_list) {
+        if (!add_slab(pool)) {
+            return NULL;
+        }
+    } else {
+        count(&(pool->hits));
+    }
+
+    PoolObject *obj = pool->free_list;
+    pool->free_list = obj->next;
+    return obj + 1;
+}
+
+void *pool_alloc_unpooled(size_t size) {
+    PoolObject *obj = malloc(sizeof(PoolObject) + size);
+    if (NULL == obj) {
+        return NULL;
+    }
+    obj->pool = NULL;
+    return obj + 1;
+}
+
+void pool_free(void *object, Pool *local) {
+    PoolObject *obj = (PoolObject *) object - 1;
+    Pool *pool = obj->pool;
+
+    if (NULL == pool) {
+        free(obj);
+    } else if (pool == local) {
+        obj->next = pool->free_list;
+        pool->free_list = obj;
+    } else {
+        // nobody takes single objects off the remote list (only all of them at once) so there is no ABA problem
+        obj->next = atomic_load_explicit(&(pool->remote_free), memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&(pool->remote_free), &(obj->next), obj, memory_order_release, memory_order_relaxed)) {
+            // obj->next is now the new head
+        }
+    }
+}
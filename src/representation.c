@@ -12,6 +12,8 @@
 #include "contrib/cJSON.h"
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <strings.h> // strncasecmp
 
 // shorthand for the initialisation functions
 #define PRINTABLE_MSG(_message, _string, _data_type, _type) \
@@ -132,84 +134,487 @@ ssize_t encode_message(const Message *message, char **encoded_message) {
     return len;
 }
 
-// shorthand to check the type of a node in the cJSON tree
-#define EXPECT_TYPE(_ptr, _type) \
-    if (!cJSON_Is##_type(_ptr)) { \
-        cJSON_Delete(root); \
-        return false; \
-    } \
+// frees the copy of the last message if it didn't fit in the scratch
+static void release_scratch(DecodeScratch *scratch) {
+    free(scratch->spill);
+    scratch->spill = NULL;
+}
 
-// shorthand for decoding similar message types
-#define PRINTABLE_MSG_ENCODE(_type) \
-    if (0 == strncmp(_type, type->valuestring, strlen(_type))) { \
-        /* it was a software error packet */ \
-        /* get description string */ \
-        cJSON *description = cJSON_GetObjectItem(data, "message"); \
-        NULL_CHECK(description, root, false) \
-        EXPECT_TYPE(description, String)
+void decode_scratch_init(DecodeScratch *scratch) {
+    scratch->spill = NULL;
+}
 
-// decode a string into a message structure
+void decode_scratch_free(DecodeScratch *scratch) {
+    release_scratch(scratch);
+}
+
+// decode a string into its fields, leaving the text in the scratch
+// the message is copied into the scratch and decoded there with decode_message_in_place, so no JSON tree is built and cJSON's
+// allocator is left alone
 // returns success
-bool decode_message(const char* encoded_message, Message *message) {
+bool decode_message_fields(const char *encoded_message, DecodeScratch *scratch, DecodedFields *fields) {
     // arguments check
-    if ((NULL == encoded_message) || (NULL == message))
+    if ((NULL == encoded_message) || (NULL == scratch) || (NULL == fields))
+        return false;
+
+    // the copy stays in the scratch (even if we fail) until next time
+    release_scratch(scratch);
+    size_t len = strlen(encoded_message);
+    char *copy = scratch->buf;
+    if (len >= DECODE_SCRATCH_SIZE) {
+        copy = malloc(len + 1);
+        if (NULL == copy)
+            return false;
+        scratch->spill = copy;
+    }
+    memcpy(copy, encoded_message, len + 1);
+
+    return decode_message_in_place(copy, len, fields);
+}
+
+/* Decoding in place
+Messages are small and we only want three fields from them, so decode_message_in_place walks the JSON where it is instead of building a tree.
+It accepts what cJSON would (apart from keys with escapes in them) and finds the same fields: the first of each name, ignoring case.
+Everything is checked before anything is written, so the only write is the unescaping of the text, which can only get shorter. */
+
+// how deeply values we aren't interested in can be nested (the same as cJSON)
+#define JSON_NESTING_LIMIT 1000
+
+// where we have got to in the JSON
+typedef struct {
+    char *pos;
+    const char *end;
+} JsonCursor;
+
+// a string found in the JSON: the bytes between the quotes, still escaped
+typedef struct {
+    char *start;
+    size_t len;
+} JsonString;
+
+static void skip_whitespace(JsonCursor *c) {
+    while ((c->pos < c->end) && ((unsigned char) *(c->pos) <= 32)) {
+        c->pos += 1;
+    }
+}
+
+// is the next thing ch? If so, moves past it
+static bool accept(JsonCursor *c, char ch) {
+    skip_whitespace(c);
+    if ((c->pos < c->end) && (ch == *(c->pos))) {
+        c->pos += 1;
+        return true;
+    }
+    return false;
+}
+
+// reads 4 hex digits
+static bool read_hex4(const char *p, const char *end, uint32_t *value) {
+    if (end - p < 4) {
+        return false;
+    }
+
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        char ch = p[i];
+        uint32_t digit;
+        if ((ch >= '0') && (ch <= '9')) {
+            digit = (uint32_t) (ch - '0');
+        } else if ((ch >= 'a') && (ch <= 'f')) {
+            digit = (uint32_t) (ch - 'a' + 10);
+        } else if ((ch >= 'A') && (ch <= 'F')) {
+            digit = (uint32_t) (ch - 'A' + 10);
+        } else {
+            return false;
+        }
+        *value = (*value << 4) | digit;
+    }
+    return true;
+}
+
+// reads the escape sequence starting at the backslash at p into the character it stands for
+// *len is set to how many bytes the sequence was
+// returns false if it isn't a valid escape sequence
+static bool read_escape(const char *p, const char *end, uint32_t *codepoint, size_t *len) {
+    if (end - p < 2) {
         return false;
+    }
 
-    // parse JSON
-    cJSON *root = cJSON_Parse(encoded_message);
-    if (NULL == root)
+    *len = 2;
+    switch (p[1]) {
+        case 'b': *codepoint = '\b'; return true;
+        case 'f': *codepoint = '\f'; return true;
+        case 'n': *codepoint = '\n'; return true;
+        case 'r': *codepoint = '\r'; return true;
+        case 't': *codepoint = '\t'; return true;
+        case '"':
+        case '\\':
+        case '/':
+            *codepoint = (uint32_t) p[1];
+            return true;
+        case 'u':
+            break;
+        default:
+            return false;
+    }
+
+    // \uXXXX, or a pair of them for characters outside the basic multilingual plane
+    if (!read_hex4(p + 2, end, codepoint) || ((*codepoint >= 0xDC00) && (*codepoint <= 0xDFFF))) {
         return false;
+    }
+    *len = 6;
+    if ((*codepoint >= 0xD800) && (*codepoint <= 0xDBFF)) {
+        uint32_t low;
+        if ((end - p < 12) || ('\\' != p[6]) || ('u' != p[7]) || !read_hex4(p + 8, end, &low) || (low < 0xDC00) || (low > 0xDFFF)) {
+            return false;
+        }
+        *codepoint = 0x10000 + (((*codepoint & 0x3FF) << 10) | (low & 0x3FF));
+        *len = 12;
+    }
+    return true;
+}
 
-    // check the version number
-    cJSON *version = cJSON_GetObjectItem(root, "version");
-    NULL_CHECK(version, root, false)
-    EXPECT_TYPE(version, Number)
-    if (DATA_FORMAT_VERSION != version->valuedouble) {
-        cJSON_Delete(root);
+// finds the end of the string the cursor is on, checking its escape sequences
+static bool scan_string(JsonCursor *c, JsonString *str) {
+    if (!accept(c, '"')) {
         return false;
     }
 
-    // data subroot
-    cJSON *data = cJSON_GetObjectItem(root, "data");
-    NULL_CHECK(data, root, false)
-
-    // message type
-    cJSON *type = cJSON_GetObjectItem(root, "type");
-    NULL_CHECK(type, root, false)
-    EXPECT_TYPE(type, String)
-
-    PRINTABLE_MSG_ENCODE("SOFT_ERR")
-        /* initialise message */
-        /* GLIB makes a copy so we don't need to worry when calling cJSON_Delete */
-        software_error(message, description->valuestring);
-    } else PRINTABLE_MSG_ENCODE("HARD_ERROR_OTHER")
-        // it was a hardware error other packet
-        // initialise message
-        // GLIB copies the message so we don't need to worry about cJSON_Delete
-        hardware_error_other(message, description->valuestring);
-    } else PRINTABLE_MSG_ENCODE("HARD_ERROR_VALVE")
-        // it was a hardware error valve packet
-
-        // valve_no
-        cJSON *valve_no = cJSON_GetObjectItem(data, "valve_no");
-        NULL_CHECK(valve_no, root, false)
-        EXPECT_TYPE(valve_no, Number)
-
-        // initialize message
-        hardware_error_valve(message, valve_no->valueint, description->valuestring);
-    } else if (0 == strncmp("KEEP_ALIVE", type->valuestring, 11)) {
-        // it was a KEEP_ALIVE packet
-        keep_alive(message);
+    str->start = c->pos;
+    while (c->pos < c->end) {
+        if ('"' == *(c->pos)) {
+            str->len = (size_t) (c->pos - str->start);
+            c->pos += 1;
+            return true;
+        } else if ('\\' == *(c->pos)) {
+            uint32_t codepoint;
+            size_t len;
+            if (!read_escape(c->pos, c->end, &codepoint, &len)) {
+                return false;
+            }
+            c->pos += len;
+        } else {
+            c->pos += 1;
+        }
+    }
+    return false; // never finished
+}
+
+// writes the unescaped string to dest, which can be where it already is. It must have been checked by scan_string
+// stops early rather than writing more than max bytes
+// returns the unescaped length
+static size_t unescape_string(const JsonString *str, char *dest, size_t max) {
+    const char *p = str->start;
+    const char *end = str->start + str->len;
+    size_t out = 0;
+    while (p < end) {
+        if ('\\' != *p) {
+            if (out == max) {
+                break;
+            }
+            dest[out++] = *(p++);
+            continue;
+        }
+
+        // UTF-8 takes fewer bytes than the escape sequence did
+        uint32_t codepoint;
+        size_t len;
+        read_escape(p, end, &codepoint, &len);
+        size_t needed = (codepoint < 0x80) ? 1 : (codepoint < 0x800) ? 2 : (codepoint < 0x10000) ? 3 : 4;
+        if (out + needed > max) {
+            break;
+        }
+        p += len;
+
+        if (1 == needed) {
+            dest[out++] = (char) codepoint;
+        } else if (2 == needed) {
+            dest[out++] = (char) (0xC0 | (codepoint >> 6));
+            dest[out++] = (char) (0x80 | (codepoint & 0x3F));
+        } else if (3 == needed) {
+            dest[out++] = (char) (0xE0 | (codepoint >> 12));
+            dest[out++] = (char) (0x80 | ((codepoint >> 6) & 0x3F));
+            dest[out++] = (char) (0x80 | (codepoint & 0x3F));
+        } else {
+            dest[out++] = (char) (0xF0 | (codepoint >> 18));
+            dest[out++] = (char) (0x80 | ((codepoint >> 12) & 0x3F));
+            dest[out++] = (char) (0x80 | ((codepoint >> 6) & 0x3F));
+            dest[out++] = (char) (0x80 | (codepoint & 0x3F));
+        }
+    }
+    return out;
+}
+
+// reads the number the cursor is on the same way as cJSON does
+static bool scan_number(JsonCursor *c, double *value) {
+    skip_whitespace(c);
+    char number[64];
+    size_t len = 0;
+    while ((c->pos + len < c->end) && (NULL != strchr("0123456789+-.eE", c->pos[len])) && ('\0' != c->pos[len])) {
+        if (len == sizeof(number) - 1) {
+            return false;
+        }
+        number[len] = c->pos[len];
+        len += 1;
+    }
+    number[len] = '\0';
+
+    char *after;
+    *value = strtod(number, &after);
+    if (after == number) {
+        return false;
+    }
+    c->pos += after - number;
+    return true;
+}
+
+// is the next thing the literal word
+static bool accept_word(JsonCursor *c, const char *word) {
+    size_t len = strlen(word);
+    if (((size_t) (c->end - c->pos) < len) || (0 != strncmp(c->pos, word, len))) {
+        return false;
+    }
+    c->pos += len;
+    return true;
+}
+
+static bool skip_value(JsonCursor *c, unsigned int depth);
+
+// moves on to the next key of the object, leaving the cursor on its value. first says whether this is the first key
+// *more is set to false once the object has ended
+static bool next_key(JsonCursor *c, bool first, JsonString *key, bool *more) {
+    *more = !accept(c, '}');
+    if (!*more) {
+        return true;
+    }
+    if (!first && !accept(c, ',')) {
+        return false;
+    }
+    return scan_string(c, key) && accept(c, ':');
+}
+
+// is key name (ignoring case, like cJSON_GetObjectItem)
+static bool key_is(const JsonString *key, const char *name) {
+    return (strlen(name) == key->len) && (0 == strncasecmp(key->start, name, key->len));
+}
+
+// skips over whatever value the cursor is on
+static bool skip_value(JsonCursor *c, unsigned int depth) {
+    if (depth > JSON_NESTING_LIMIT) {
+        return false;
+    }
+
+    skip_whitespace(c);
+    if (c->pos >= c->end) {
+        return false;
+    }
+
+    JsonString str;
+    double number;
+    bool more = true;
+    switch (*(c->pos)) {
+        case '"':
+            return scan_string(c, &str);
+        case '{':
+            c->pos += 1;
+            for (bool first = true; ; first = false) {
+                if (!next_key(c, first, &str, &more)) {
+                    return false;
+                } else if (!more) {
+                    return true;
+                } else if (!skip_value(c, depth + 1)) {
+                    return false;
+                }
+            }
+        case '[':
+            c->pos += 1;
+            if (accept(c, ']')) {
+                return true;
+            }
+            do {
+                if (!skip_value(c, depth + 1)) {
+                    return false;
+                }
+            } while (accept(c, ','));
+            return accept(c, ']');
+        case 't':
+            return accept_word(c, "true");
+        case 'f':
+            return accept_word(c, "false");
+        case 'n':
+            return accept_word(c, "null");
+        default:
+            return scan_number(c, &number);
+    }
+}
+
+// what decode_message_in_place found. found_* say whether each has been seen yet: only the first of each counts
+typedef struct {
+    bool found_version, found_data, found_type, found_message, found_valve_no;
+    bool version_ok, type_ok, message_ok, valve_no_ok; // was it the right kind of value
+    double version, valve_no;
+    JsonString type, message;
+} InPlaceFields;
+
+// reads one value we might be interested in. If it's the first one called this, the right kind of value is recorded
+#define READ_STRING(_name, _field) \
+    if (!found->found_##_field && key_is(&key, _name)) { \
+        found->found_##_field = true; \
+        skip_whitespace(c); \
+        found->_field##_ok = (c->pos < c->end) && ('"' == *(c->pos)); \
+        if (found->_field##_ok) { \
+            if (!scan_string(c, &(found->_field))) { \
+                return false; \
+            } \
+            continue; \
+        } \
+    }
+
+#define READ_NUMBER(_name, _field) \
+    if (!found->found_##_field && key_is(&key, _name)) { \
+        found->found_##_field = true; \
+        skip_whitespace(c); \
+        found->_field##_ok = (c->pos < c->end) && (NULL != strchr("-0123456789", *(c->pos))) && ('\0' != *(c->pos)); \
+        if (found->_field##_ok) { \
+            if (!scan_number(c, &(found->_field))) { \
+                return false; \
+            } \
+            continue; \
+        } \
+    }
+
+// walks the object the cursor is on. nested says it is the "data" object
+static bool scan_message_object(JsonCursor *c, bool nested, InPlaceFields *found) {
+    if (!accept(c, '{')) {
+        return false;
+    }
+
+    JsonString key;
+    bool more;
+    for (bool first = true; ; first = false) {
+        if (!next_key(c, first, &key, &more)) {
+            return false;
+        } else if (!more) {
+            return true;
+        }
+
+        if (nested) {
+            READ_STRING("message", message)
+            READ_NUMBER("valve_no", valve_no)
+        } else {
+            READ_NUMBER("version", version)
+            READ_STRING("type", type)
+            if (!found->found_data && key_is(&key, "data")) {
+                found->found_data = true;
+                skip_whitespace(c);
+                if ((c->pos < c->end) && ('{' == *(c->pos))) {
+                    if (!scan_message_object(c, true, found)) {
+                        return false;
+                    }
+                    continue;
+                }
+            }
+        }
+
+        if (!skip_value(c, 1)) {
+            return false;
+        }
+    }
+}
+
+// decode a message where it is
+bool decode_message_in_place(char *encoded_message, size_t len, DecodedFields *fields) {
+    // arguments check
+    if ((NULL == encoded_message) || (NULL == fields))
+        return false;
+
+    InPlaceFields found;
+    memset(&found, 0, sizeof(found));
+    JsonCursor cursor = {.pos = encoded_message, .end = encoded_message + len};
+    if (!scan_message_object(&cursor, false, &found))
+        return false;
+
+    // the same checks as decode_message_fields
+    if (!found.version_ok || (DATA_FORMAT_VERSION != found.version) || !found.found_data || !found.type_ok)
+        return false;
+
+    // the type is unescaped on the side in case we turn out not to want this message. We only need enough of it to compare
+    char type[32];
+    type[unescape_string(&(found.type), type, sizeof(type) - 1)] = '\0';
+
+    fields->valve_no = 0;
+    fields->text = NULL;
+    fields->text_len = 0;
+
+    if (0 == strcmp("KEEP_ALIVE", type)) {
+        fields->type = KEEP_ALIVE;
+        return true;
+    } else if (0 == strncmp("SOFT_ERR", type, 8)) {
+        fields->type = SOFT_ERROR;
+    } else if (0 == strncmp("HARD_ERROR_OTHER", type, 16)) {
+        fields->type = HARD_ERROR_OTHER;
+    } else if (0 == strncmp("HARD_ERROR_VALVE", type, 16)) {
+        fields->type = HARD_ERROR_VALVE;
+
+        if (!found.valve_no_ok)
+            return false;
+        // cJSON's valueint
+        if (found.valve_no >= INT_MAX) {
+            fields->valve_no = INT_MAX;
+        } else if (found.valve_no <= (double) INT_MIN) {
+            fields->valve_no = INT_MIN;
+        } else {
+            fields->valve_no = (int) found.valve_no;
+        }
     } else {
-        // we don't know what kind of packet that is
-        cJSON_Delete(root);
         return false;
     }
-    
-    cJSON_Delete(root);
+
+    if (!found.message_ok)
+        return false;
+
+    // there is always room for the '\0' where the closing quote was
+    char *text = found.message.start;
+    text[unescape_string(&(found.message), text, found.message.len)] = '\0';
+    fields->text = text;
+    fields->text_len = strlen(text); // an escaped nul ends it, as it would for cJSON
     return true;
 }
 
+// decode a string into a message structure
+// returns success
+bool decode_message(const char* encoded_message, Message *message) {
+    // arguments check
+    if ((NULL == encoded_message) || (NULL == message))
+        return false;
+
+    DecodeScratch scratch;
+    decode_scratch_init(&scratch);
+    DecodedFields fields;
+    bool ret = decode_message_fields(encoded_message, &scratch, &fields);
+
+    // GLIB makes a copy of the text so it doesn't matter that the scratch is about to go
+    if (ret) {
+        switch (fields.type) {
+            case HARD_ERROR_VALVE:
+                hardware_error_valve(message, fields.valve_no, fields.text);
+                break;
+            case HARD_ERROR_OTHER:
+                hardware_error_other(message, fields.text);
+                break;
+            case SOFT_ERROR:
+                software_error(message, fields.text);
+                break;
+            default:
+                keep_alive(message);
+                break;
+        }
+    }
+
+    decode_scratch_free(&scratch);
+    return ret;
+}
+
 // frees dynamically allocated memory *within* a message (aka this will not free the message structure itself)
 void free_message(Message *msg) {
     if (!msg)
@@ -230,3 +635,133 @@ void free_message(Message *msg) {
     // mark the message as free'ed
     msg->type = INVALID;
 }
+
+// shorthand for the compact initialisation functions
+static void compact_printable(CompactMessage *message, MessageType type, const char *string) {
+    if (NULL == message)
+        return;
+
+    message->type = type;
+    message->valve_no = 0;
+    size_t len = 0;
+    if (NULL != string) {
+        len = strnlen(string, MAX_MSG_LEN);
+        memcpy(message->text, string, len);
+    }
+    message->text[len] = '\0';
+    message->len = (uint8_t) len;
+}
+
+void compact_hardware_error_valve(CompactMessage *message, int valve_no, const char *string) {
+    compact_printable(message, HARD_ERROR_VALVE, string);
+    if (NULL != message)
+        message->valve_no = valve_no;
+}
+
+void compact_hardware_error_other(CompactMessage *message, const char *string) {
+    compact_printable(message, HARD_ERROR_OTHER, string);
+}
+
+void compact_software_error(CompactMessage *message, const char *string) {
+    compact_printable(message, SOFT_ERROR, string);
+}
+
+void compact_keep_alive(CompactMessage *message) {
+    compact_printable(message, KEEP_ALIVE, NULL);
+}
+
+// appends len bytes of str to the encoding if there is room
+#define APPEND(_str, _len) \
+    if ((_len) > size - pos) { \
+        return -1; \
+    } \
+    memcpy(buf + pos, _str, _len); \
+    pos += (_len);
+
+#define APPEND_STR(_str) APPEND(_str, strlen(_str))
+
+// writes text as a JSON string, escaped the same way as cJSON does it
+static ssize_t encode_json_string(const char *text, size_t len, char *buf, size_t size) {
+    size_t pos = 0;
+    APPEND("\"", 1)
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) text[i];
+        char escaped[7];
+        switch (c) {
+            case '"': APPEND("\\\"", 2) break;
+            case '\\': APPEND("\\\\", 2) break;
+            case '\b': APPEND("\\b", 2) break;
+            case '\f': APPEND("\\f", 2) break;
+            case '\n': APPEND("\\n", 2) break;
+            case '\r': APPEND("\\r", 2) break;
+            case '\t': APPEND("\\t", 2) break;
+            default:
+                if (c < 32) {
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    APPEND(escaped, 6)
+                } else {
+                    APPEND(&c, 1)
+                }
+        }
+    }
+    APPEND("\"", 1)
+    return (ssize_t) pos;
+}
+
+// the same fields in the same order as encode_message
+ssize_t encode_compact_message(const CompactMessage *message, char *buf, size_t size) {
+    if ((NULL == message) || (NULL == buf) || (0 == size))
+        return -1;
+    size -= 1; // room for the '\0'
+
+    const char *type;
+    switch (message->type) {
+        case HARD_ERROR_VALVE: type = "HARD_ERROR_VALVE"; break;
+        case HARD_ERROR_OTHER: type = "HARD_ERROR_OTHER"; break;
+        case SOFT_ERROR: type = "SOFT_ERROR"; break;
+        case KEEP_ALIVE: type = "KEEP_ALIVE"; break;
+        default: return -1;
+    }
+
+    size_t pos = 0;
+    APPEND_STR("{\"version\":2,\"data\":{")
+    if (KEEP_ALIVE != message->type) {
+        APPEND_STR("\"message\":")
+        ssize_t len = encode_json_string(message->text, message->len, buf + pos, size - pos);
+        if (-1 == len) {
+            return -1;
+        }
+        pos += (size_t) len;
+    }
+    if (HARD_ERROR_VALVE == message->type) {
+        char valve_no[32];
+        snprintf(valve_no, sizeof(valve_no), ",\"valve_no\":%d", message->valve_no);
+        APPEND_STR(valve_no)
+    }
+    APPEND_STR("},\"type\":\"")
+    APPEND_STR(type)
+    APPEND_STR("\"}")
+
+    buf[pos] = '\0';
+    return (ssize_t) pos;
+}
+
+bool decode_compact_message(const char *encoded_message, CompactMessage *message) {
+    if ((NULL == encoded_message) || (NULL == message))
+        return false;
+
+    DecodeScratch scratch;
+    decode_scratch_init(&scratch);
+    DecodedFields fields;
+    bool ret = decode_message_fields(encoded_message, &scratch, &fields);
+    if (ret) {
+        compact_printable(message, fields.type, fields.text);
+        message->valve_no = fields.valve_no;
+    }
+
+    decode_scratch_free(&scratch);
+    return ret;
+}
+
+void free_compact_message(__attribute__((unused)) CompactMessage *msg) {
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * ring.c
+ * Bounded lock-free queues of pointers (see edsac_ring.h)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_ring.h"
+#include <stdlib.h>
+
+bool ring_init(Ring *ring, size_t capacity, bool multi_consumer) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    ring->cells = malloc(size * sizeof(RingCell));
+    if (NULL == ring->cells) {
+        return false;
+    }
+
+    // cell i is ready for the push at position i
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&(ring->cells[i].sequence), i);
+        ring->cells[i].value = NULL;
+    }
+    ring->mask = size - 1;
+    ring->multi_consumer = multi_consumer;
+    atomic_init(&(ring->head), 0);
+    atomic_init(&(ring->tail), 0);
+
+    return true;
+}
+
+void ring_free(Ring *ring) {
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+bool ring_push(Ring *ring, void *value) {
+    size_t pos = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+
+    while (true) {
+        RingCell *cell = &(ring->cells[pos & ring->mask]);
+        size_t sequence = atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) sequence - (ptrdiff_t) pos;
+
+        if (0 == diff) {
+            // the cell is free: try to claim it. On failure pos is updated to the new tail
+            if (atomic_compare_exchange_weak_explicit(&(ring->tail), &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                cell->value = value;
+                atomic_store_explicit(&(cell->sequence), pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            // the consumer hasn't got to this cell since last time round
+            return false;
+        } else {
+            // another producer got here first
+            pos = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+        }
+    }
+}
+
+void *ring_pop(Ring *ring) {
+    size_t pos = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+
+    while (true) {
+        RingCell *cell = &(ring->cells[pos & ring->mask]);
+        size_t sequence = atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t) sequence - (ptrdiff_t) (pos + 1);
+
+        if (diff < 0) {
+            // empty (or the producer which claimed this cell hasn't filled it in yet)
+            return NULL;
+        } else if (diff > 0) {
+            // another consumer took this cell
+            pos = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+            continue;
+        }
+
+        // take the cell. Without other consumers nobody else writes the head
+        if (!ring->multi_consumer) {
+            atomic_store_explicit(&(ring->head), pos + 1, memory_order_relaxed);
+        } else if (!atomic_compare_exchange_weak_explicit(&(ring->head), &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+            continue; // another consumer got here first. pos is the new head
+        }
+
+        // hand the cell back to the producers for the next time round the ring
+        void *value = cell->value;
+        atomic_store_explicit(&(cell->sequence), pos + ring->mask + 1, memory_order_release);
+        return value;
+    }
+}
+
+size_t ring_pop_batch(Ring *ring, void **values, size_t max) {
+    size_t pos = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+
+    while (true) {
+        // count how many cells from the head on have been filled in
+        size_t count = 0;
+        while (count < max) {
+            RingCell *cell = &(ring->cells[(pos + count) & ring->mask]);
+            size_t sequence = atomic_load_explicit(&(cell->sequence), memory_order_acquire);
+            if (sequence != pos + count + 1) {
+                break;
+            }
+            count += 1;
+        }
+
+        if (0 == count) {
+            size_t head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+            if (head == pos) {
+                return 0; // empty
+            }
+            pos = head; // another consumer took this cell
+            continue;
+        }
+
+        // take all of them at once
+        if (!ring->multi_consumer) {
+            atomic_store_explicit(&(ring->head), pos + count, memory_order_relaxed);
+        } else if (!atomic_compare_exchange_weak_explicit(&(ring->head), &pos, pos + count, memory_order_relaxed, memory_order_relaxed)) {
+            continue; // another consumer got here first. pos is the new head
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            RingCell *cell = &(ring->cells[(pos + i) & ring->mask]);
+            values[i] = cell->value;
+            atomic_store_explicit(&(cell->sequence), pos + i + ring->mask + 1, memory_order_release);
+        }
+        return count;
+    }
+}
+
+size_t ring_capacity(const Ring *ring) {
+    return ring->mask + 1;
+}
+
+size_t ring_size(Ring *ring) {
+    size_t head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&(ring->tail), memory_order_relaxed);
+
+    // the loads can't both happen at once so this could briefly look negative or too big
+    if (tail <= head) {
+        return 0;
+    }
+    return (tail - head > ring->mask + 1) ? ring->mask + 1 : tail - head;
+}
@@ -20,14 +20,20 @@
 #include <errno.h>
 #include "edsac_timer.h"
 #include <assert.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 
 // file descriptor for the TCP connection to the remote host
 static int sending_fd = -1;
 static pthread_mutex_t fd_mux = PTHREAD_MUTEX_INITIALIZER;
 static timer_t timer;
+static FramingMode framing = FRAMING_BRACES;
+static bool skip_keep_alives = false; // see SendingOptions
+// a message has been sent since the last KEEP_ALIVE was due (only kept track of with skip_keep_alives)
+static atomic_bool sent_since_keep_alive = false;
 
 // locking has to be done first but this will unlock
-static bool send_encoded_message(const char* encoded) {
+static bool send_encoded_message(const char* encoded, size_t len) {
     // lock mutex
     if (-1 == pthread_mutex_lock(&fd_mux)) {
         perror("failed to lock sending mutex");
@@ -35,9 +41,26 @@ static bool send_encoded_message(const char* encoded) {
         return false;
     }
 
-    // send the encoded message
-    size_t expected_count = strnlen(encoded, MAX_ENCODED_LEN);
-    ssize_t count = write(sending_fd, encoded, expected_count);
+    // send the encoded message with whatever the framing needs around it
+    unsigned char prefix[4] = {(unsigned char) (len >> 24), (unsigned char) (len >> 16), (unsigned char) (len >> 8), (unsigned char) len};
+    struct iovec iov[2];
+    int iovcnt = 0;
+    if (FRAMING_LENGTH_PREFIXED == framing) {
+        iov[iovcnt].iov_base = prefix;
+        iov[iovcnt++].iov_len = sizeof(prefix);
+    }
+    iov[iovcnt].iov_base = (void *) encoded;
+    iov[iovcnt++].iov_len = len;
+    if (FRAMING_NDJSON == framing) {
+        iov[iovcnt].iov_base = (void *) "\n";
+        iov[iovcnt++].iov_len = 1;
+    }
+
+    size_t expected_count = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        expected_count += iov[i].iov_len;
+    }
+    ssize_t count = writev(sending_fd, iov, iovcnt);
     const int write_errno = errno; // incase pthread_mutex_unlock changes errno
     int err = pthread_mutex_unlock(&fd_mux);
     if (0 != err) {
@@ -54,13 +77,37 @@ static bool send_encoded_message(const char* encoded) {
 }
 
 // called periodically to send a KEEP_ALIVE message
+// with skip_keep_alives it isn't sent if something else was sent since the last time: the server counts any message as a sign of life
 static void send_keep_alive(__attribute__((unused)) void *compulsory) {
+    if (skip_keep_alives && atomic_exchange_explicit(&sent_since_keep_alive, false, memory_order_relaxed)) {
+        return;
+    }
+
     const char* keep_alive_msg = "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}";
 
-    send_encoded_message(keep_alive_msg); // unlocks mutex
+    send_encoded_message(keep_alive_msg, strlen(keep_alive_msg)); // unlocks mutex
+}
+
+// fills in the options start_sending uses
+void sending_default_options(SendingOptions *options) {
+    options->framing = FRAMING_BRACES;
+    options->skip_keep_alives = false;
 }
 
 bool start_sending(const struct sockaddr *addr, socklen_t addrlen) {
+    return start_sending_with_options(addr, addrlen, NULL);
+}
+
+bool start_sending_with_options(const struct sockaddr *addr, socklen_t addrlen, const SendingOptions *options) {
+    SendingOptions defaults;
+    if (NULL == options) {
+        sending_default_options(&defaults);
+        options = &defaults;
+    }
+    framing = options->framing;
+    skip_keep_alives = options->skip_keep_alives;
+    atomic_store(&sent_since_keep_alive, false);
+
     // open a socket
     sending_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (-1 == sending_fd) {
@@ -72,6 +119,16 @@ bool start_sending(const struct sockaddr *addr, socklen_t addrlen) {
         return false;
     }
 
+    // tell the server how messages will be framed
+    char preamble[FRAMING_PREAMBLE_LEN];
+    size_t preamble_len = framing_preamble(framing, preamble);
+    if ((0 != preamble_len) && ((ssize_t) preamble_len != write(sending_fd, preamble, preamble_len))) {
+        // the server doesn't know how our messages are framed so the connection is no use
+        close(sending_fd);
+        sending_fd = -1;
+        return false;
+    }
+
     // periodically send KEEP_ALIVE message
     return create_timer((timer_handler_t) send_keep_alive, &timer, KEEP_ALIVE_INTERVAL);
 }
@@ -85,13 +142,32 @@ bool send_message(const Message *msg) {
     if (!encoded)
         return false;
 
-    bool ret = send_encoded_message(encoded);    
+    bool ret = send_encoded_message(encoded, strnlen(encoded, MAX_ENCODED_LEN));
+    if (ret && skip_keep_alives) {
+        atomic_store_explicit(&sent_since_keep_alive, true, memory_order_relaxed);
+    }
 
     free(encoded);
 
     return ret;
 }
 
+// encodes into a buffer on the stack so that nothing is allocated
+bool send_compact_message(const CompactMessage *msg) {
+    char encoded[MAX_COMPACT_ENCODED_LEN + 1];
+    ssize_t len = encode_compact_message(msg, encoded, sizeof(encoded));
+    if (-1 == len)
+        return false;
+
+    if (!send_encoded_message(encoded, (size_t) len))
+        return false;
+
+    if (skip_keep_alives) {
+        atomic_store_explicit(&sent_since_keep_alive, true, memory_order_relaxed);
+    }
+    return true;
+}
+
 void stop_sending(void) {
     stop_timer(timer);
 
@@ -6,13 +6,25 @@
  */
 
 /* So what is going on here?
-The server uses signal driven IO so that it is not constantly polling dosens of clients.
-We use two signal handlers: CONNECT_SIG for when a new client connects and READ_SIG for when new IO is available on a socket
-
-When a message is read in it is added to the read_buff queue. Items are requested and returned from this queue at some later time using read_message()
-
-Also, clients are expected to periodically send KEEP_ALIVE messages so that we know that they are running. The time of the most recent one of these is stored in the connection table.
-Periodically these times are checked against the current time to see if everything is it should be. 
+The server runs a reactor thread built on edge-triggered epoll so that it is not constantly polling dosens of clients.
+The listening socket and every client connection are registered with one epoll instance. The reactor accepts new clients, reads in objects and notices hang-ups.
+An eventfd is also registered so that stop_server() can wake the reactor up and ask it to exit. No signal handlers are installed.
+
+The server may be split into several shards. Each shard has its own listening socket (all bound to the same address with SO_REUSEPORT), reactor thread, connections table and queue
+so that shards never contend with each other. The kernel spreads new connections over the listening sockets, optionally steered by a BPF program so that a node always lands on the same shard.
+
+When a message is read in it is added to its shard's queue: a bounded lock-free ring which the reactor pushes onto and read_message() pops from.
+A full ring makes the reactors stop reading (like the ingress watermarks) rather than dropping anything.
+With ServerOptions.priority each shard has a ring for each type of message (a lane) instead, and read_message chooses which lane to take from
+before which shard, so that a valve alarm doesn't wait behind a flood of software errors. With ServerOptions.fair_by_address each lane is a FairQueue
+instead, which takes turns between the nodes which sent the messages.
+With ServerOptions.coalesce_window_ms the reactor folds repeats of a message together before queueing them. A timerfd tells it when each window ends
+With ServerOptions.rate_limit_* each connection has a token bucket for messages and one for bytes, topped up once per read and checked for each message.
+A connection which runs out is either paused (and the same timerfd gives it another go a little later) or has what is over the limit dropped and counted.
+
+Also, clients are expected to periodically send KEEP_ALIVE messages (or anything else) so that we know that they are running. Each connection has a timer, on its shard's
+timing wheel, for when it will have been quiet for too long. Each message only notes the time; when the timer goes off it is moved on to KEEP_ALIVE_PROD after the last
+message, so the reactor only ever looks at the connections whose timers are due.
 */
 
 // includes
@@ -29,57 +41,256 @@ Periodically these times are checked against the current time to see if everythi
 #include <time.h>
 #include <stdio.h>
 #include <assert.h>
-#include "edsac_timer.h"
+#include "edsac_uring.h"
+#include "edsac_framing.h"
+#include "edsac_epoch.h"
+#include "edsac_ring.h"
+#include "edsac_pool.h"
+#include "edsac_arena.h"
+#include "edsac_fair.h"
+#include "edsac_coalesce.h"
+#include "edsac_wheel.h"
 #include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <stdatomic.h>
+#include <linux/filter.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <sched.h>
+
+// one reactor with everything it needs to run independently of the others
+typedef struct {
+    int listen_socket;
+    // the reactor: epoll instance, eventfd used to wake it up and the thread running it
+    int epoll_fd;
+    int wakeup_fd;
+    pthread_t reactor_thread;
+    bool reactor_running;
+    atomic_bool stopping; // the reactor should exit when woken up (otherwise a wake up means that reading can resume)
+    GQueue *paused; // fds of connections which we stopped reading from because too much is queued. Only used by the reactor
+    // io_uring backend. When use_uring is set the ring is used instead of epoll_fd
+    bool use_uring;
+    Uring ring;
+    uint64_t wakeup_value; // somewhere for the ring to read wakeup_fd into
+    uint32_t next_generation;
+    // the reactor decodes into this so that the JSON tree doesn't need allocating
+    DecodeScratch scratch;
+    // messages received on this shard waiting for read_message, in a lane for each type of message with ServerOptions.priority
+    // (otherwise only lanes[0] is used)
+    Ring lanes[SERVER_NUM_LANES];
+    FairQueue fair_lanes[SERVER_NUM_LANES]; // instead of lanes with ServerOptions.fair_by_address
+    bool pushed; // the reactor has queued something since it last woke up the readers
+    // ServerOptions.coalesce_window_ms: repeats seen lately
+    Coalescer coalescer;
+    // ServerOptions.rate_limit_* (SERVER_RATE_DELAY): fds of connections which we stopped reading from because they ran out of tokens
+    // and when to next give them another go. Only used by the reactor
+    GQueue *throttled;
+    uint64_t throttle_deadline;
+    // ConnectionData.keep_alive timers, in seconds on monotonic_ms
+    TimerWheel keep_alives;
+    // a timerfd set for when the next coalesce window ends, throttled connections are due another go or a keep alive timer could go off
+    // (on monotonic_ms)
+    int timer_fd;
+    uint64_t timer_deadline; // what it is set for. 0 if it isn't
+    uint64_t timer_expirations; // somewhere for the ring to read timer_fd into
+    // with ServerOptions.handler, messages are collected here and handed over at the end of each batch of events instead of being queued
+    BufferItem *handled[SERVER_HANDLER_BATCH];
+    size_t num_handled;
+    GQueue *overflow; // reports which didn't fit in the queue (oldest first). Only used by the reactor
+    // preallocated slots for the connections accepted by this shard. Unused slots are linked through next_free
+    // only the reactor adds and removes connections. Other threads (get_connected_list) look through them inside an epoch
+    // so a closed connection's slot is retired and only goes back on free_slots once none of them can still be looking at it
+    struct ConnectionData *slots;
+    unsigned int num_slots;
+    struct ConnectionData *free_slots;
+    EpochLimbo retired;
+    atomic_uint num_connections;
+} Shard;
 
 // stores information about an active connection
-typedef struct {
+typedef struct ConnectionData {
+    EpochNode retired; // first so that the node can be turned back into its slot
+    atomic_bool in_use; // this slot holds a connection. Set once everything else is filled in
+    struct ConnectionData *next_free; // next unused slot
     int fd;
-    pthread_mutex_t mutex;
+    Shard *shard; // the shard which accepted the connection
+    uint32_t generation; // tells apart connections which reused the same fd (io_uring backend)
+    RecvBuffer recv; // bytes received which haven't been turned into messages yet
+    FrameScanner scanner; // how far we have got through the frame at the start of recv
+    bool framing_known; // we have worked out how this client frames its messages (from the first bytes it sends)
+    FramingMode framing;
+    // bounded ingress: we stopped reading from this connection because too much is queued
+    bool paused;
+    uint32_t paused_events; // epoll events which arrived while paused
+    bool hung_up; // the client hung up while paused (io_uring backend)
+    bool recv_armed; // there is a multishot recv running (io_uring backend)
+    // ServerOptions.rate_limit_*: token buckets, in billionths of a message or byte, topped up by refill_buckets
+    // a message may be read while neither is below 0 and then takes what it costs from both, so they can go a little into debt
+    int64_t msg_tokens;
+    int64_t byte_tokens;
+    uint64_t refilled_ns; // when they were last topped up
+    bool throttled; // we stopped reading until the buckets have had time to refill (SERVER_RATE_DELAY). paused is set too
+    size_t dropped; // messages dropped since the last report about it (SERVER_RATE_DROP)
+    uint64_t dropped_since_ns; // when the first of them was dropped
     struct sockaddr_in addr;
-    time_t last_keep_alive;
-    /* this is a bit of a hack to get around an issue:
-    pthreads requires a mutex to be unlocked for it to be destroyed.
-    If anything is waiting on it when this unlock occurs (right before destruction) then it gets the lock before the mutex is destroyed
-    this flag causes it to return immediately instead of trusting the mutex lock */
-    bool destroyed;
+    // goes off KEEP_ALIVE_PROD seconds after we last heard from the client, or after that was last checked (on the shard's keep_alives)
+    WheelTimer keep_alive;
+    uint64_t heard; // when the client last sent a valid message (any type). In seconds on monotonic_ms
 } ConnectionData;
 
 // result from reading from a socket (not used externally)
 typedef enum {
     SUCCESS,
     ERROR,
-    END
+    END,    // nothing left to read for now
+    CLOSED, // the client hung up
+    PAUSED, // stopped reading because too much is queued
+    THROTTLED // stopped reading because the client is over the rate limits
 } ReadStatus;
 
-static void free_connectiondata(ConnectionData *condata);
-
-// ofsets past REALTIMESIGMIN
-#define CONNECT_SIG 1
-#define READ_SIG 2
-
-// global read buffer
-static GQueue *read_buff = NULL;
-static pthread_mutex_t read_buff_mux = PTHREAD_MUTEX_INITIALIZER;
-
-// global store of connections
-static pthread_mutex_t connections_mux = PTHREAD_MUTEX_INITIALIZER;
-static GHashTable *connections_table = NULL;
-
-// the listening socket
-static int listen_socket = -1;
+static void release_connection(ConnectionData *condata);
+
+// maximum number of events handled per epoll_wait
+#define MAX_EVENTS 64
+
+// io_uring backend: submission queue size and the provided receive buffers
+#define URING_ENTRIES 256
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+
+// io_uring user_data: what a completion is for in the top two bits, then the connection generation and fd
+#define URING_CANCEL 0
+#define URING_WAKEUP 1
+#define URING_ACCEPT 2
+#define URING_RECV 3
+#define URING_DATA(_type, _generation, _fd) (((uint64_t) (_type) << 62) | ((uint64_t) ((_generation) & 0x3FFFFFFF) << 32) | (uint32_t) (_fd))
+#define URING_TYPE(_data) ((unsigned int) ((_data) >> 62))
+#define URING_GENERATION(_data) ((uint32_t) (((_data) >> 32) & 0x3FFFFFFF))
+#define URING_FD(_data) ((int) (uint32_t) (_data))
+
+// the shards
+static Shard *shards = NULL;
+static unsigned int num_shards = 0;
+
+// every connection indexed by fd (fds are unique over the whole process so the shards can share this)
+// only the shard which accepted a connection reads or writes its entry
+static ConnectionData **connections_by_fd = NULL;
+static size_t max_fds = 0;
+
+// the lookup table is never bigger than this, whatever RLIMIT_NOFILE says
+#define MAX_FDS (1 << 20)
+
+// ServerOptions.max_connections when it is 0 (and RLIMIT_NOFILE is bigger than this)
+#define DEFAULT_MAX_CONNECTIONS 65536
+
+// readers of the connections tables which aren't the reactor that owns them
+static EpochDomain connections_epoch;
+
+// connections turned away because there were no free slots
+static atomic_ulong rejected_connections = 0;
+
+// BufferItems come from slab pools. Each reactor thread claims a pool while it runs; any other thread would use malloc
+// whichever thread frees an item gives it back to the pool it came from. The pools outlive the server so that items can too
+#define ITEMS_PER_SLAB 1024
+static PoolSet item_pools;
+static bool item_pools_ready = false;
+static _Thread_local Pool *item_pool = NULL;
+// with SERVER_DECODE_INLINE items are followed by room for their text, so they come from pools of their own
+#define INLINE_ITEM_SIZE (sizeof(BufferItem) + MAX_MSG_LEN + 1)
+static PoolSet inline_item_pools;
+static _Thread_local Pool *inline_item_pool = NULL;
+
+// the shard read_message will look at first. Rotated so that no shard gets starved
+static atomic_uint next_read_shard = 0;
+
+// ServerOptions.priority and lane_weights. There is one lane with SERVER_PRIORITY_FIFO
+static ServerPriority priority = SERVER_PRIORITY_FIFO;
+static unsigned int num_lanes = 1;
+static unsigned int lane_weights[SERVER_NUM_LANES];
+
+// SERVER_PRIORITY_WEIGHTED: the lane whose turn it is and how many messages it has had so far this turn
+// readers share these without a lock, so with several at once the turns are only roughly the right length
+static atomic_uint weighted_lane = 0;
+static atomic_uint weighted_used = 0;
+
+// ServerOptions.fair_by_address, fair_quantum and node_queue_limit
+static bool fair_by_address = false;
+static size_t fair_quantum = 0;
+static size_t node_queue_limit = 0;
+
+// ServerOptions.coalesce_window_ms and how many messages have been folded into another
+static uint64_t coalesce_window_ms = 0;
+static atomic_size_t coalesced_items = 0;
+
+// ServerOptions.rate_limit_*: the limits (per second), what a message and each byte of it cost from a connection's buckets
+// (0 if there is no limit on them) and how many messages were dropped
+#define RATE_SCALE 1000000000 // bucket units per message or byte
+#define RATE_TICK_MS 10 // how often throttled connections get another go
+static bool rate_limited = false;
+static int64_t msg_cost = 0;
+static int64_t byte_cost = 0;
+static int64_t msg_rate = 0;
+static int64_t byte_rate = 0;
+static ServerRateAction rate_action = SERVER_RATE_DELAY;
+static atomic_size_t rate_dropped = 0;
+
+// bounded ingress: what is queued on all of the shards is counted so that reading can be paused when read_message falls behind
+// the watermarks are 0 when there is no limit
+static size_t ingress_high_items = 0;
+static size_t ingress_low_items = 0;
+static size_t ingress_high_bytes = 0;
+static size_t ingress_low_bytes = 0;
+static atomic_size_t queued_items = 0;
+static atomic_size_t queued_bytes = 0;
+static atomic_bool ingress_paused = false;
+static atomic_size_t paused_connections = 0;
+
+// how many messages from clients each shard's queue takes before reading stops
+// the queue itself is bigger so that there is always room for a connection close report
+static size_t queue_capacity = 0;
+
+// ServerOptions.handler. When it is set the reactors hand messages straight to it and nothing is queued for read_message
+static ServerHandler handler = NULL;
+static void *handler_data = NULL;
+
+// ServerOptions.decode
+static ServerDecode decode_mode = SERVER_DECODE_COPY;
+
+// read_message_wait parks on reader_seq (a futex). Anything which queues messages bumps it and wakes the readers, but only if readers_parked
+// says that someone is asleep, so a burst of messages costs at most one wake up and none at all while the reader keeps up
+static atomic_uint reader_seq = 0;
+static atomic_bool readers_parked = false;
+static atomic_size_t reader_wakeups = 0;
+static atomic_bool readers_stopped = true; // stop_server was called
+static atomic_uint waiting_readers = 0; // threads in read_message_wait. stop_server waits for them to leave before freeing the queues
+
+// server_ready_fd: an eventfd which is readable while there are messages. Written once when the queues stop being empty (ready_signalled)
+// and reset by read_message once they are empty again
+static int ready_fd = -1;
+static atomic_bool ready_signalled = false;
+
+// adaptive spin before parking (ServerOptions.wait_spin_us). The budget grows while messages turn up soon after we start waiting
+// and shrinks when spinning doesn't find anything
+static unsigned int wait_spin_us = 0;
+static atomic_uint spin_budget_us = 0;
+
+// finds the connection using fd
+// only the reactor of the shard which accepted the connection may do this
+static ConnectionData *lookup_connection(int fd) {
+    if ((fd < 0) || ((size_t) fd >= max_fds)) {
+        return NULL;
+    }
 
-// the timer id
-timer_t timer_id;
+    return connections_by_fd[fd];
+}
 
 // helper for get_connected_list
-static void list_ip_addrs(__attribute__((unused)) gpointer key, gpointer value, gpointer user_data) {
-    assert(NULL != value);
-    assert(NULL != user_data);
-
-    ConnectionData *con_data = value;
-    GSList **list = user_data;
-
+static void list_ip_addrs(ConnectionData *con_data, GSList **list) {
     struct sockaddr_in *list_data = malloc(sizeof(struct sockaddr_in));
     assert(NULL != list_data);
     memcpy(list_data, &con_data->addr, sizeof(*list_data));
@@ -87,564 +298,2072 @@ static void list_ip_addrs(__attribute__((unused)) gpointer key, gpointer value,
     *list = g_slist_prepend(*list, list_data); 
 }
 
-// returns a list containing all of the IP addresses in the connections table
+// returns a list containing all of the IP addresses in the connections tables
 GSList *get_connected_list(void) {
     GSList *ret = NULL;
 
-    assert(0 == pthread_mutex_lock(&connections_mux));
-    g_hash_table_foreach(connections_table, (GHFunc) list_ip_addrs, &ret);
-    assert(0 == pthread_mutex_unlock(&connections_mux));
+    EpochRecord *epoch = epoch_enter(&connections_epoch);
+    for (unsigned int i = 0; i < num_shards; i++) {
+        for (unsigned int j = 0; j < shards[i].num_slots; j++) {
+            if (atomic_load_explicit(&(shards[i].slots[j].in_use), memory_order_acquire)) {
+                list_ip_addrs(&(shards[i].slots[j]), &ret);
+            }
+        }
+    }
+    epoch_exit(epoch);
 
     return ret;
 }
 
-// sets up a fd for realtime signal IO using signal sig, handled by handler
-static bool setup_rt_signal_io(int fd, int sig, void (*handler)(int, siginfo_t *, void *)) {
-    // establish signal handler for new connections
-    struct sigaction sa;
-    sa.sa_sigaction = handler;
-    sa.sa_flags = SA_RESTART | SA_SIGINFO; // SA_RESTART: don't break things so much when we interupt them, SA_SIGINFO: be realtime
-    sigemptyset(&sa.sa_mask); // don't mask signals
-    if (-1 == sigaction(sig, &sa, NULL)) { // install new settings for this signal
-        return false;
-    }
+// registers fd with a shard's reactor for edge-triggered notifications of events
+static bool reactor_add(Shard *shard, int fd, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLET;
+    ev.data.fd = fd;
 
-    // set the owner of the socket to us so that we get the signals
-    if (-1 == fcntl(fd, F_SETOWN, getpid())) {
-        return false;
+    return 0 == epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// the text of an item's message, if it has any
+static const GString *item_text(const BufferItem *item) {
+    switch (item->msg.type) {
+        case HARD_ERROR_VALVE:
+            return item->msg.data.hardware_valve.message;
+        case HARD_ERROR_OTHER:
+            return item->msg.data.hardware_other.message;
+        case SOFT_ERROR:
+            return item->msg.data.software.message;
+        default:
+            return NULL;
     }
+}
 
-    // specify our handler instead of the default SIGIO handler
-    // I am not sure why this is needed in addition to setting sa.sa_sigaction
-    if (-1 == fcntl(fd, F_SETSIG, sig)) {
-        return false;
+// how much memory an item in a queue holds on to
+static size_t item_size(const BufferItem *item) {
+    const GString *text = item_text(item);
+    return sizeof(BufferItem) + ((NULL == text) ? 0 : text->allocated_len);
+}
+
+// counts an item as queued and pauses reading if this takes us over a high watermark
+// this is done before the item is pushed so that read_message can't take it off the counts first
+static void account_item(BufferItem *item) {
+    size_t size = item_size(item);
+    size_t items = atomic_fetch_add(&queued_items, 1) + 1;
+    size_t bytes = atomic_fetch_add(&queued_bytes, size) + size;
+    if (((0 != ingress_high_items) && (items >= ingress_high_items)) || ((0 != ingress_high_bytes) && (bytes >= ingress_high_bytes))) {
+        atomic_store(&ingress_paused, true);
     }
+}
 
-    // enable signaling & non-blocking IO
-    int flags = fcntl(fd, F_GETFL);
-    if (-1 == fcntl(fd, F_SETFL, flags | O_ASYNC | O_NONBLOCK)) {
-        return false;
+// the lane an item goes in
+static unsigned int item_lane(const BufferItem *item) {
+    if (1 == num_lanes) {
+        return 0;
     }
+    return ((unsigned int) item->msg.type < SERVER_NUM_LANES) ? (unsigned int) item->msg.type : SOFT_ERROR;
+}
 
-    return true;
+// adds an item to its lane of a shard's queue. Safe from any thread
+// returns false if the lane is full
+static bool lane_push(Shard *shard, BufferItem *item) {
+    unsigned int lane = item_lane(item);
+    if (fair_by_address) {
+        return fair_push(&(shard->fair_lanes[lane]), item->address.s_addr, item, item_size(item));
+    }
+    return ring_push(&(shard->lanes[lane]), item);
 }
 
-// attempt to read a full json object from a fd (defined as "{*}", handling nesting)
-static ReadStatus read_json_object(int fd, GString **out_string) {
-    // assuming that we can read the whole thing at once
+// how many messages are in one of a shard's lanes
+static size_t lane_size(Shard *shard, unsigned int lane) {
+    return fair_by_address ? fair_size(&(shard->fair_lanes[lane])) : ring_size(&(shard->lanes[lane]));
+}
 
-    GString *string = g_string_new("{");
+// how many messages are in a shard's lanes
+static size_t queue_size(Shard *shard) {
+    size_t size = 0;
+    for (unsigned int i = 0; i < num_lanes; i++) {
+        size += lane_size(shard, i);
+    }
+    return size;
+}
 
-    // read first character
-    char buf;
-    ssize_t num_read = read(fd, &buf, 1);
-    if (1 != num_read) { // we could not read a whole character
-        int e = errno;
-        g_string_free(string, true);
+// there is room in the shard's queue for another message from a client
+static bool queue_has_room(Shard *shard) {
+    return queue_size(shard) < queue_capacity;
+}
 
-        // if it looks like there just wasn't any data left in the buffer for us to read
-        if ((EBADF == e) || (EAGAIN == e) || (EWOULDBLOCK == e) || (0 == num_read)) {
-            return END;
-        }
-        
-        // there may have been data but an unknown error occured
-        printf("Unknown error errno=%s num_read=%li\n", strerror(e), num_read);
-        return ERROR;
+// the connection's node hasn't got node_queue_limit messages waiting in any lane of its shard (fair_by_address)
+// if it has, the lane watches it so that read_message can wake us up once it is down to half as many
+static bool node_has_room(ConnectionData *condata) {
+    if (!fair_by_address || (0 == node_queue_limit)) {
+        return true;
     }
 
-    // the first character must be {
-    if (buf != '{') {
-        g_string_free(string, true);
-
-        // skip newline characters so we can telnet in for testing
-        if ((buf == '\n') || (buf == 13 /*CR*/)) { 
-            puts("newline");
-            return read_json_object(fd, out_string);
+    for (unsigned int i = 0; i < num_lanes; i++) {
+        if (fair_watch(&(condata->shard->fair_lanes[i]), condata->addr.sin_addr.s_addr, node_queue_limit)) {
+            return false;
         }
+    }
+    return true;
+}
 
-        printf("invalid c=%i\n", (int) buf);
-        return ERROR;
+// gives what the reactor has collected to ServerOptions.handler, which now owns it
+static void deliver_handled(Shard *shard) {
+    if (0 != shard->num_handled) {
+        handler(shard->handled, shard->num_handled, handler_data);
+        shard->num_handled = 0;
     }
+}
 
-    // read in the rest
-    int nest_count = 1; // we already have {
-    while (true) {
-        // try to read 1 character
-        num_read = read(fd, &buf, 1);
-        if (1 != num_read) {
-            int e = errno;
-            g_string_free(string, true);
-
-            // if we reached the end of the buffer
-            if ((EAGAIN == e) || (EWOULDBLOCK == e) || (0 == num_read)) {
-                puts("partial packet!");
-                return ERROR;
-            } else {
-                // unknown error
-                printf("errno=%s. num_read=%li\n", strerror(e), num_read);
-                return ERROR;
-            }
+// adds an item to a shard's queue (or with a handler, to the next batch for it). Only the shard's reactor may do this
+// if the ring is full the item waits in the overflow list, and reading stops, until read_message makes room. Nothing is dropped
+static void push_item(Shard *shard, BufferItem *item) {
+    if (NULL != handler) {
+        shard->handled[shard->num_handled++] = item;
+        if (SERVER_HANDLER_BATCH == shard->num_handled) {
+            deliver_handled(shard);
         }
+        return;
+    }
 
-        // we did read in a character successfully...
-        
-        // nesting count
-        if ('{' == buf)
-            nest_count += 1;
-        else if ('}' == buf)
-            nest_count -= 1;
-
-        // add the character to the string
-        string = g_string_append_c(string, buf);
+    account_item(item);
 
-        // are we done?
-        if (0 == nest_count)
-            break;
+    shard->pushed = true;
+    if (!g_queue_is_empty(shard->overflow) || !lane_push(shard, item)) {
+        g_queue_push_tail(shard->overflow, item);
+        atomic_store(&ingress_paused, true); // read_message wakes us up once it has drained some of the queue
     }
+}
 
-    *out_string = string;
-    return SUCCESS;
+// moves what is waiting in the overflow list into the ring
+static void flush_overflow(Shard *shard) {
+    while (!g_queue_is_empty(shard->overflow)) {
+        if (!lane_push(shard, g_queue_peek_head(shard->overflow))) {
+            atomic_store(&ingress_paused, true);
+            return;
+        }
+        g_queue_pop_head(shard->overflow);
+        shard->pushed = true;
+    }
 }
 
-// fetch a read buffer item from fd
-// mutexes are done by the caller
-static ReadStatus fetch_item(ConnectionData *condata) {
-    // the item we will add to the buffer for this read
-    BufferItem *item = malloc(sizeof(BufferItem));
-    if (NULL == item) {
-        return ERROR;
+// wakes up a shard's reactor
+static void wake_reactor(Shard *shard) {
+    uint64_t one = 1;
+    if (sizeof(one) != write(shard->wakeup_fd, &one, sizeof(one))) {
+        perror("Couldn't wake up the reactor");
     }
+}
 
-    // attempt to read in the json object
-    GString *obj;
-    ReadStatus status = read_json_object(condata->fd, &obj); // frees obj on error
-    if (SUCCESS != status) {
-        free(item);
-        return status;
+// makes server_ready_fd readable, unless it already is
+static void signal_ready(void) {
+    if (atomic_load_explicit(&ready_signalled, memory_order_relaxed) || atomic_exchange(&ready_signalled, true)) {
+        return;
     }
 
-    // decode JSON
-    if (!decode_message(obj->str, &(item->msg))) {
-        printf("decode error on: %s\n", obj->str);
-        // report this BufferItem as a software error
-        software_error(&(item->msg), "Could not decode message");
+    uint64_t one = 1;
+    if (sizeof(one) != write(ready_fd, &one, sizeof(one))) {
+        perror("Couldn't signal the ready fd");
     }
+}
 
-    g_string_free(obj, true);
+// called by read_messages when the queues look empty
+// clears server_ready_fd, unless something was queued since we last looked (in which case whoever queued it saw that it was still signalled)
+static void clear_ready(void) {
+    uint64_t value;
+    if (-1 == read(ready_fd, &value, sizeof(value))) {
+        // nothing to read is fine
+    }
+    atomic_store(&ready_signalled, false);
+    atomic_thread_fence(memory_order_seq_cst);
 
-    if (KEEP_ALIVE == item->msg.type) {
-        free_bufferitem(item);
-        // update last_keep_alive
-        condata->last_keep_alive = time(NULL);
-    } else { // "real" messages
-        item->address = condata->addr.sin_addr;
-        item->recv_time = time(NULL);
+    for (unsigned int i = 0; i < num_shards; i++) {
+        if (0 != queue_size(&shards[i])) {
+            signal_ready();
+            return;
+        }
+    }
+}
 
-        // add the item to the queue
-        g_queue_push_tail(read_buff, (gpointer) item);
+// tells server_ready_fd and any parked read_message_wait that there are messages
+// the fence orders the pushes before the checks. It pairs with the ones in park_reader and clear_ready
+static void wake_readers(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    signal_ready();
+    if (!atomic_load_explicit(&readers_parked, memory_order_relaxed) || !atomic_exchange(&readers_parked, false)) {
+        return;
     }
 
-    return SUCCESS;
+    atomic_fetch_add(&reader_seq, 1);
+    atomic_fetch_add_explicit(&reader_wakeups, 1, memory_order_relaxed);
+    syscall(SYS_futex, (void *) &reader_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
 }
 
-static void destroy_connection(ConnectionData *condata) {
-    // destroy the connection
+// lets the reactors read again once we are below both low watermarks
+static void resume_if_drained(void) {
+    if (!atomic_load(&ingress_paused)) {
+        return;
+    }
 
-    // get access to connections_table
-    if (0 != pthread_mutex_lock(&connections_mux)) {
-        puts("Couldn't remove item from hash table");
+    if (((0 != ingress_high_items) && (atomic_load(&queued_items) > ingress_low_items))
+            || ((0 != ingress_high_bytes) && (atomic_load(&queued_bytes) > ingress_low_bytes))) {
         return;
     }
-    
-    // calls free_connectiondata for us
-    if (TRUE != g_hash_table_remove(connections_table, &(condata->fd))) {
-        puts("Couldn't remove item from hash table");
-        pthread_mutex_unlock(&connections_mux);
+
+    // the queues fill up without watermarks too
+    for (unsigned int i = 0; i < num_shards; i++) {
+        if (queue_size(&shards[i]) > queue_capacity / 2) {
+            return;
+        }
     }
 
-    pthread_mutex_unlock(&connections_mux);
+    // only one thread gets to wake everything up
+    if (atomic_exchange(&ingress_paused, false)) {
+        for (unsigned int i = 0; i < num_shards; i++) {
+            wake_reactor(&shards[i]);
+        }
+    }
 }
 
-// read in an object waiting in a buffer
-static void *object_reader(ConnectionData *condata) {
-    // get exclusive access to read_buff
-    if (0 != pthread_mutex_lock(&read_buff_mux)) {
-        perror("object reader could not get the read_buff mutex");
-        return NULL;
-    }
-    
-    // read in every available object
-    ReadStatus status = fetch_item(condata);
-    if (ERROR == status) {
-        puts("Read ERROR from remote host\n"); 
-        destroy_connection(condata);
-        pthread_mutex_unlock(&read_buff_mux);
-        return NULL;
-    } 
-    
-    // clean up before returning
-    pthread_mutex_unlock(&read_buff_mux);
-    pthread_mutex_unlock(&(condata->mutex));
-    return NULL;
+// stop reading from a connection until read_message catches up
+static void pause_connection(ConnectionData *condata) {
+    condata->paused = true;
+    atomic_fetch_add(&paused_connections, 1);
+    g_queue_push_tail(condata->shard->paused, GINT_TO_POINTER(condata->fd));
 }
 
-// for reporting a connection close
-static void *report_close(ConnectionData *condata) {
-    // allocate the item to go onto the queue
-    BufferItem *item = malloc(sizeof(BufferItem));
-    if (!item) {
-        return NULL;
-    }
-    
-    item->address = condata->addr.sin_addr;
-    item->recv_time = time(NULL);
-    
-    software_error(&(item->msg), "Connection closed");
-    
-    // get access to the queue
-    if (0 != pthread_mutex_lock(&read_buff_mux)) {
-        puts("can't lock queue");
-        free_bufferitem(item);
-        return NULL;
-    }
-    
-    // add the item to the queue
-    g_queue_push_tail(read_buff, (gpointer) item);
-    
-    pthread_mutex_unlock(&read_buff_mux);
+// start reading from a paused connection again
+static void unpause_connection(ConnectionData *condata) {
+    condata->paused = false;
+    condata->paused_events = 0;
+    atomic_fetch_sub(&paused_connections, 1);
+}
 
-    destroy_connection(condata);
-    return NULL;
+// gets an empty BufferItem from this thread's pool
+static BufferItem *alloc_item(void) {
+    BufferItem *item = (NULL != item_pool) ? pool_alloc(item_pool) : pool_alloc_unpooled(sizeof(BufferItem));
+    if (NULL != item) {
+        item->text.str = NULL;
+        item->arena = NULL;
+        item->repeats = 1;
+    }
+    return item;
 }
 
-// realtime signal handler for when IO is available on a connection with a client
-static void io_handler(__attribute__ ((unused)) int sig, __attribute__ ((unused)) siginfo_t *si, __attribute__ ((unused)) void *ucontext) {
-    /* locking mutexes in something which can interupt code which already has the mutex locked may seem to be begging for deadlock
-     *   but in practice I was unable to reproduce this deadlock so we will do it here instead of a different thread (the old solution) for performance reasons
-     */
-    // look up the file descriptor in the connections table
-    if (0 != pthread_mutex_lock(&connections_mux)) {
-//        perror("Couldn't lock connections table");
-        return;
+// gets an empty BufferItem with room for MAX_MSG_LEN bytes of text after it (SERVER_DECODE_INLINE)
+static BufferItem *alloc_inline_item(void) {
+    BufferItem *item = (NULL != inline_item_pool) ? pool_alloc(inline_item_pool) : pool_alloc_unpooled(INLINE_ITEM_SIZE);
+    if (NULL != item) {
+        item->text.str = (char *) (item + 1);
+        item->arena = NULL;
+        item->repeats = 1;
     }
+    return item;
+}
 
-    ConnectionData *condata = g_hash_table_lookup(connections_table, &(si->si_fd));
-    pthread_mutex_unlock(&connections_mux);
-    if (NULL == condata) {
-//        printf("%i not in table\n", si->si_fd);
-        return;
+// the text is stored right after the item
+static bool is_inline_item(const BufferItem *item) {
+    return item->text.str == (const char *) (item + 1);
+}
+
+// finds somewhere for the text of a decoded message which isn't going to have a GString of its own
+// SERVER_DECODE_ZERO_COPY: it stays where it was decoded in the receive buffer. The item takes a reference to the buffer's arena
+// SERVER_DECODE_INLINE: in the item itself, cut short to MAX_MSG_LEN
+// SERVER_DECODE_ARENA: in the batch's arena. This is made the first time it is needed, big enough for the text of everything waiting in
+// the connection's receive buffer. The item takes a reference to it
+// returns NULL if we run out of memory
+static BufferItem *alloc_decoded_item(ConnectionData *condata, DecodedFields *fields, Arena **arena) {
+    if (SERVER_DECODE_ZERO_COPY == decode_mode) {
+        BufferItem *item = alloc_item();
+        if (NULL != item) {
+            item->text.str = (char *) fields->text;
+            item->arena = recv_buffer_share(&(condata->recv));
+        }
+        return item;
+    } else if (SERVER_DECODE_INLINE == decode_mode) {
+        BufferItem *item = alloc_inline_item();
+        if ((NULL != item) && (fields->text_len > MAX_MSG_LEN)) {
+            fields->text_len = MAX_MSG_LEN;
+        }
+        return item;
     }
-    assert(si->si_fd == condata->fd);
 
-    // get the exclusive right to do reading as early as we can incase another thread closes the file descriptor
-    if (0 != pthread_mutex_lock(&(condata->mutex))) {
-//        perror("condatamux");
-        return;
+    // the text can't be longer than the JSON it came from, so a new arena is only needed after decode error reports
+    char *text = (NULL == *arena) ? NULL : arena_alloc(*arena, fields->text_len + 1);
+    if (NULL == text) {
+        if (NULL != *arena) {
+            arena_unref(*arena);
+        }
+        size_t pending = condata->recv.end - condata->recv.start;
+        *arena = arena_new(pending > MAX_ENCODED_LEN ? pending : MAX_ENCODED_LEN);
+        if (NULL == *arena) {
+            return NULL;
+        }
+        text = arena_alloc(*arena, fields->text_len + 1);
     }
-    if (condata->destroyed) { // did we get between the unlock and destroy in free_condata?
-//        puts("condatamux dead");
-        return;
+    BufferItem *item = (NULL == text) ? NULL : alloc_item();
+    if (NULL == item) {
+        return NULL;
     }
 
-    char buf;
-    // check to see if there is any data to read
-    // checking si->si_code just seems to report the connection is closed on every signal
-    // MSG_PEEK so that the read character is not removed from the read buffer
-    ssize_t count = recv(si->si_fd, &buf, 1, MSG_PEEK);
-//    int e = errno;
-    if (1 != count) {
-//        printf("closed connection. fd=%i si_code=%i errno=%s count=%li\n",si->si_fd, si->si_code, strerror(e), count);
-
-        report_close(condata);
-        return;
-    }
+    item->text.str = text;
+    item->arena = *arena;
+    arena_ref(*arena);
+    return item;
+}
 
-    // do the actual reading 
-    object_reader((void *) condata);
+// milliseconds on the clock timer_fd uses
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
 }
 
-// realtime signal handler for when there is a connection to the listening socket
-static void connect_handler(__attribute__ ((unused)) int sig, siginfo_t *si, __attribute__ ((unused)) void *ucontext) {
-    // accepts a connection from a remote host and sets it up to do signal driven IO
-    int fd = accept(si->si_fd, NULL, NULL);
-    if (-1 == fd)
-        return;
+// nanoseconds on a clock which is cheap to read (the same clock as monotonic_ms, a few milliseconds behind)
+static uint64_t coarse_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
 
-    // add fd to the connections table:
+// a client sent a valid message (of any type), so it is still there
+// this is done for every message so it only notes the time. The connection's keep alive timer is moved when it goes off
+static inline void heard_from(ConnectionData *condata) {
+    condata->heard = coarse_ns() / 1000000000;
+}
 
-    // allocate memory for the ConnectionData
-    ConnectionData *condata = malloc(sizeof(ConnectionData));
-    if (NULL == condata) {
-        close(fd);
-        return;
+// says what couldn't be decoded. SERVER_DECODE_ZERO_COPY has already unescaped the message where it was, so then all that is
+// left to go on is its length
+static void log_decode_error(const ConnectionData *condata, const char *obj, size_t len) {
+    if (SERVER_DECODE_ZERO_COPY == decode_mode) {
+        printf("decode error on a %zu byte message (fd=%i)\n", len, condata->fd);
+    } else {
+        printf("decode error on: %.*s\n", (int) len, obj);
     }
+}
 
-    // get the remote address
-    socklen_t addrlen = sizeof(condata->addr);
-    if (0 != getpeername(fd, &(condata->addr), &addrlen)) {
-        close(fd);
-        free(condata);
-        return;
+// decodes a message into an item whose text doesn't have its own GString (any decode mode but SERVER_DECODE_COPY)
+// the JSON is decoded from a copy in the shard's scratch memory, or where it is for SERVER_DECODE_ZERO_COPY
+// returns NULL if the message is a KEEP_ALIVE (or we run out of memory)
+static BufferItem *decode_item(ConnectionData *condata, char *obj, size_t len, Arena **arena) {
+    DecodedFields fields;
+    bool decoded = (SERVER_DECODE_ZERO_COPY == decode_mode) ? decode_message_in_place(obj, len, &fields)
+                                                            : decode_message_fields(obj, &(condata->shard->scratch), &fields);
+    if (decoded) {
+        heard_from(condata);
+    } else {
+        log_decode_error(condata, obj, len);
+        fields.type = SOFT_ERROR;
+        fields.valve_no = 0;
+        fields.text = "Could not decode message";
+        fields.text_len = strlen(fields.text);
     }
-    // I found experimentally that getpeername only works on the second call. Tested on Ubuntu, Debian and CentOS
-    if (0 != getpeername(fd, &(condata->addr), &addrlen)) {
-        close(fd);
-        free(condata);
-        return;
-    }
-    char addr[160] = {'\n'}; // buffer to hold string-ified ip4 address
-    inet_ntop(AF_INET, &(condata->addr.sin_addr.s_addr), addr, sizeof(addr));
-    printf("Connect from %s\n", addr);
 
-    // set up condata->mutex
-    if (-1 == pthread_mutex_init(&(condata->mutex), NULL)) {
-        close(fd);
-        free(condata);
-        return;
+    if (KEEP_ALIVE == fields.type) {
+        return NULL;
     }
 
-    // set the last message time to now
-    if (-1 == time(&(condata->last_keep_alive))) {
-        close(fd);
-        free_connectiondata(condata);
-        return;
+    BufferItem *item = alloc_decoded_item(condata, &fields, arena);
+    if (NULL == item) {
+        return NULL;
+    }
+    if (item->text.str != fields.text) {
+        memcpy(item->text.str, fields.text, fields.text_len);
+        item->text.str[fields.text_len] = '\0';
+    }
+    item->text.len = fields.text_len;
+    item->text.allocated_len = fields.text_len + 1;
+
+    item->msg.type = fields.type;
+    switch (fields.type) {
+        case HARD_ERROR_VALVE:
+            item->msg.data.hardware_valve.valve_no = fields.valve_no;
+            item->msg.data.hardware_valve.message = &(item->text);
+            break;
+        case HARD_ERROR_OTHER:
+            item->msg.data.hardware_other.message = &(item->text);
+            break;
+        default:
+            item->msg.data.software.message = &(item->text);
+            break;
     }
 
-    condata->fd = fd;
-    condata->destroyed = false;
+    return item;
+}
 
-    // get access to connections table
-    if (0 != pthread_mutex_lock(&connections_mux)) {
-        close(fd);
-        free_connectiondata(condata);
+// sets the shard's timer to go off at deadline (on monotonic_ms) unless it is already set for sooner. 0 means never
+static void arm_timer_at(Shard *shard, uint64_t deadline) {
+    if ((0 == deadline) || ((0 != shard->timer_deadline) && (shard->timer_deadline <= deadline))) {
         return;
     }
 
-    // g_hash_table needs the key to stick around
-    int *key = malloc(sizeof(int));
-    if (NULL == key) {
-        close(fd);
-        free_connectiondata(condata);
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t) (deadline / 1000);
+    spec.it_value.tv_nsec = (long) (deadline % 1000) * 1000000;
+    if (-1 == timerfd_settime(shard->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL)) {
+        perror("Couldn't set the shard timer");
         return;
     }
-    *key = fd;
+    shard->timer_deadline = deadline;
+}
 
-    // put it into the connections table
-    if (FALSE == g_hash_table_insert(connections_table, key, condata)) {
-        puts("ERROR: duplicate entry in connections table!");
-        exit(EXIT_FAILURE);
-        return;
+// sets the shard's timer for when the next coalesce window ends, the throttled connections are due another go or a keep alive
+// timer could go off, whichever is first
+static void arm_timer(Shard *shard) {
+    if (NULL != shard->coalescer.entries) {
+        arm_timer_at(shard, coalesce_next_deadline(&(shard->coalescer)));
     }
-
-    pthread_mutex_unlock(&connections_mux);
-
-    setup_rt_signal_io(fd, SIGRTMIN + READ_SIG, io_handler);
+    if (!g_queue_is_empty(shard->throttled)) {
+        arm_timer_at(shard, shard->throttle_deadline);
+    }
+    arm_timer_at(shard, wheel_next_expiry(&(shard->keep_alives)) * 1000);
 }
 
-// function to check if a keep alive message has been received for a given connection
-static void check_keep_alive(__attribute__((unused)) gpointer key, gpointer value, __attribute__((unused)) gpointer user_data) {
-    if (NULL == value)
+// tells the reader about something which went wrong with a connection
+static void report_error(ConnectionData *condata, const char *text) {
+    BufferItem *item = alloc_item();
+    if (NULL == item) {
+        perror("Couldn't allocate message buffer");
         return;
+    }
+    software_error(&(item->msg), text);
+    item->address = condata->addr.sin_addr;
+    item->recv_time = time(NULL);
+    item->first_time = item->recv_time;
+    push_item(condata->shard, item);
+}
 
-    ConnectionData *condata = (ConnectionData *) value;
+// reports a connection which we haven't heard from for too long, and checks it again KEEP_ALIVE_INTERVAL * KEEP_ALIVE_CHECK_PERIOD
+// seconds later. now is in seconds on monotonic_ms
+static void report_timeout(ConnectionData *condata, uint64_t now) {
+    char addr[16] = {'\n'}; // buffer to hold string-ified ip4 address
+    inet_ntop(AF_INET, &(condata->addr.sin_addr.s_addr), addr, sizeof(addr));
+    printf("No KEEP_ALIVE from %s (fd=%i) for %li seconds!\n", addr, condata->fd, (long) (now - condata->heard));
+    wheel_schedule(&(condata->shard->keep_alives), &(condata->keep_alive), now + (KEEP_ALIVE_INTERVAL) * (KEEP_ALIVE_CHECK_PERIOD));
+    report_error(condata, "Connection timeout");
+}
 
-    // get current time
-    time_t now = time(NULL);
-    if (-1 == now)
-        return;
+// gives the throttled connections another go now that their buckets have had time to refill
+// while ingress is paused they wait with the connections paused for that instead
+static void resume_throttled(Shard *shard, void (*resume)(Shard *shard, int fd)) {
+    for (guint n = g_queue_get_length(shard->throttled); n > 0; n--) {
+        int fd = GPOINTER_TO_INT(g_queue_pop_head(shard->throttled));
+        ConnectionData *condata = lookup_connection(fd);
+        if ((NULL == condata) || !condata->throttled) {
+            continue; // closed since
+        }
 
-    // calculate time difference
-    time_t diff = now - condata->last_keep_alive;
+        condata->throttled = false;
+        if (atomic_load(&ingress_paused)) {
+            g_queue_push_tail(shard->paused, GINT_TO_POINTER(fd));
+        } else {
+            resume(shard, fd);
+        }
+    }
 
-    if (diff > (KEEP_ALIVE_PROD)) {
-        char addr[16] = {'\n'}; // buffer to hold string-ified ip4 address
-        inet_ntop(AF_INET, &(condata->addr.sin_addr.s_addr), addr, sizeof(addr));
-        printf("No KEEP_ALIVE from %s (fd=%i) for %li seconds!\n", addr, condata->fd, diff);
+    // the ones which ran out again
+    shard->throttle_deadline = monotonic_ms() + RATE_TICK_MS;
+}
 
-        // report error 
-        BufferItem *err = malloc(sizeof(BufferItem));
-        if (NULL == err) {
-            perror("Couldn't allocate message buffer");
-            return;
+// the shard's timer went off: queues what was folded together in each coalesce window which has ended, gives throttled
+// connections another go if they are due one and reports connections which have gone quiet
+static void timer_event(Shard *shard, void (*resume)(Shard *shard, int fd)) {
+    shard->timer_deadline = 0;
+    uint64_t now = monotonic_ms();
+
+    if (NULL != shard->coalescer.entries) {
+        void *items[SERVER_HANDLER_BATCH];
+        size_t count;
+        while (0 != (count = coalesce_expire(&(shard->coalescer), now, items, SERVER_HANDLER_BATCH))) {
+            for (size_t i = 0; i < count; i++) {
+                push_item(shard, items[i]);
+            }
         }
-        software_error(&(err->msg), "Connection timeout");
-        memcpy(&(err->address), &(condata->addr.sin_addr), sizeof(err->address));
-        err->recv_time = time(NULL);
+    }
 
-        if (0 != pthread_mutex_trylock(&read_buff_mux)) {
-            perror("Couldn't lock read_buff_mux");
-            free_bufferitem(err);
-            return;
+    if (!g_queue_is_empty(shard->throttled) && (shard->throttle_deadline <= now)) {
+        resume_throttled(shard, resume);
+    }
+
+    WheelTimer *timer = wheel_advance(&(shard->keep_alives), now / 1000);
+    while (NULL != timer) {
+        WheelTimer *next = timer->next;
+        ConnectionData *condata = (ConnectionData *) (void *) ((char *) timer - offsetof(ConnectionData, keep_alive));
+        if (condata->heard + (KEEP_ALIVE_PROD) > now / 1000) {
+            wheel_schedule(&(shard->keep_alives), timer, condata->heard + (KEEP_ALIVE_PROD)); // heard from since it was set
+        } else if (condata->paused) {
+            wheel_schedule(&(shard->keep_alives), timer, now / 1000 + (KEEP_ALIVE_PROD)); // we aren't listening so it can't be blamed
+        } else {
+            report_timeout(condata, now / 1000);
         }
+        timer = next;
+    }
+
+    arm_timer(shard);
+}
 
-        g_queue_push_tail(read_buff, err);
-        pthread_mutex_unlock(&read_buff_mux);
+// stops reading from a connection which is over the rate limits until the shard's timer gives it another go (SERVER_RATE_DELAY)
+static void throttle_connection(ConnectionData *condata) {
+    Shard *shard = condata->shard;
+    condata->paused = true;
+    condata->throttled = true;
+    atomic_fetch_add(&paused_connections, 1);
+    if (g_queue_is_empty(shard->throttled)) {
+        shard->throttle_deadline = monotonic_ms() + RATE_TICK_MS;
     }
+    g_queue_push_tail(shard->throttled, GINT_TO_POINTER(condata->fd));
+    arm_timer_at(shard, shard->throttle_deadline);
 }
 
-// called periodically to check if we have received a KEEP_ALIVE message recently
-static void iter_keep_alives(__attribute__((unused)) void *compulsory) {
-    // get lock on connections_table
-    // only doing trylock because it doesn't matter if we skip this every so often
-    if (0 != pthread_mutex_trylock(&connections_mux)) {
+// queues an item which a client sent, unless it is a repeat within ServerOptions.coalesce_window_ms
+// a repeat is folded into the item being held for its window: the first one to turn up is held, the rest are freed
+static void ingest_item(Shard *shard, BufferItem *item) {
+    if (0 == coalesce_window_ms) {
+        push_item(shard, item);
         return;
     }
 
-    // check each connection
-    g_hash_table_foreach(connections_table, check_keep_alive, NULL);
+    const GString *text = item_text(item);
+    CoalesceKey key = {
+        .address = item->address.s_addr,
+        .type = (int) item->msg.type,
+        .valve_no = (HARD_ERROR_VALVE == item->msg.type) ? item->msg.data.hardware_valve.valve_no : 0,
+        .text = (NULL == text) ? "" : text->str,
+        .text_len = (NULL == text) ? 0 : text->len,
+    };
+    BufferItem *held = coalesce_add(&(shard->coalescer), &key, item, monotonic_ms());
+    if (NULL == held) {
+        push_item(shard, item);
+        arm_timer_at(shard, coalesce_next_deadline(&(shard->coalescer)));
+        return;
+    }
 
-    pthread_mutex_unlock(&connections_mux);
+    atomic_fetch_add_explicit(&coalesced_items, 1, memory_order_relaxed);
+    if (held != item) {
+        held->repeats += 1;
+        held->recv_time = item->recv_time;
+        free_bufferitem(item);
+    }
 }
 
+// decode a json object of len bytes and add it to the shard's queue
+static ReadStatus queue_object(ConnectionData *condata, char *obj, size_t len, Arena **arena) {
+    if (SERVER_DECODE_COPY != decode_mode) {
+        BufferItem *item = decode_item(condata, obj, len, arena);
+        if (NULL != item) {
+            item->address = condata->addr.sin_addr;
+            item->recv_time = time(NULL);
+            item->first_time = item->recv_time;
+            ingest_item(condata->shard, item);
+        }
+        return SUCCESS;
+    }
 
-// starts a server listening on addr
-// returns success
-bool start_server(const struct sockaddr *addr, socklen_t addrlen) {
-    if (NULL == addr)
-        return false;
-
-    // create IPv4 TCP socket to communicate over
-    // non-blocking so we can use signal driven IO
-    // cloexec for security (closes fd on an exec() syscall)
-    listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
-    if (-1 == listen_socket) {
-        perror("start_server: create socket");
-        return false;
+    // decode JSON
+    Message msg;
+    if (decode_message(obj, &msg)) {
+        heard_from(condata);
+    } else {
+        log_decode_error(condata, obj, len);
+        // report this BufferItem as a software error
+        software_error(&msg, "Could not decode message");
     }
 
-    // bind to the specified address
-    if (-1 == bind(listen_socket, addr, addrlen)) {
-        close(listen_socket);
-        perror("start_server: binding");
-        listen_socket = -1;
-        return false;
+    if (KEEP_ALIVE == msg.type) {
+        free_message(&msg);
+    } else { // "real" messages
+        // the item we will add to the buffer for this read
+        BufferItem *item = alloc_item();
+        if (NULL == item) {
+            free_message(&msg);
+            return ERROR;
+        }
+        item->msg = msg;
+        item->address = condata->addr.sin_addr;
+        item->recv_time = time(NULL);
+        item->first_time = item->recv_time;
+
+        // add the item to the queue
+        ingest_item(condata->shard, item);
     }
 
-    // initialise the read buffer
-    read_buff = g_queue_new();
-    if (!read_buff) {
-        close(listen_socket);
-        listen_socket = -1;
-        return false;
+    return SUCCESS;
+}
+
+// tops up a connection's token buckets for the time since they were last topped up. Each holds at most a second's worth
+static void refill_buckets(ConnectionData *condata) {
+    uint64_t now = coarse_ns();
+    uint64_t elapsed = now - condata->refilled_ns;
+    if (elapsed > RATE_SCALE) {
+        elapsed = RATE_SCALE;
     }
+    condata->refilled_ns = now;
 
-    // initialise the connections table
-    connections_table = g_hash_table_new_full(g_int_hash, g_int_equal, (GDestroyNotify) free, (GDestroyNotify) free_connectiondata); 
-    if (!connections_table) {
-        close(listen_socket);
-        listen_socket = -1;
-        return false;
+    condata->msg_tokens += (int64_t) elapsed * msg_rate;
+    if (condata->msg_tokens > msg_rate * RATE_SCALE) {
+        condata->msg_tokens = msg_rate * RATE_SCALE;
+    }
+    condata->byte_tokens += (int64_t) elapsed * byte_rate;
+    if (condata->byte_tokens > byte_rate * RATE_SCALE) {
+        condata->byte_tokens = byte_rate * RATE_SCALE;
     }
+}
 
-    // set up realtime signal-driven IO on the listening socket
-    if (!setup_rt_signal_io(listen_socket, SIGRTMIN + CONNECT_SIG, connect_handler)) {
-        close(listen_socket);
-        listen_socket = -1;
-        g_queue_free(read_buff);
-        read_buff = NULL;
-        g_hash_table_destroy(connections_table);
-        connections_table = NULL;
+// takes what a message of len bytes costs from a connection's buckets
+// returns false (taking nothing) if either of them has run out
+static inline bool take_tokens(ConnectionData *condata, size_t len) {
+    if ((condata->msg_tokens < 0) || (condata->byte_tokens < 0)) {
         return false;
     }
+    condata->msg_tokens -= msg_cost;
+    condata->byte_tokens -= byte_cost * (int64_t) len;
+    return true;
+}
 
-    // set up keep_alive checker
-    if (false == create_timer((timer_handler_t) iter_keep_alives, &timer_id, (KEEP_ALIVE_INTERVAL) * (KEEP_ALIVE_CHECK_PERIOD))) {
-        close(listen_socket);
-        listen_socket = -1;
-        g_queue_free(read_buff);
-        read_buff = NULL;
-        g_hash_table_destroy(connections_table);
-        connections_table = NULL;
-        return false;
+// tells the reader how many messages from a connection have been dropped for being over the rate limits since it was last told
+static void report_dropped(ConnectionData *condata) {
+    char text[64];
+    snprintf(text, sizeof(text), "Rate limited: %zu messages dropped", condata->dropped);
+    condata->dropped = 0;
+    report_error(condata, text);
+}
+
+// counts a message dropped for being over the rate limits (SERVER_RATE_DROP). While this goes on it is reported once a second
+static void drop_message(ConnectionData *condata) {
+    atomic_fetch_add_explicit(&rate_dropped, 1, memory_order_relaxed);
+    if (0 == condata->dropped++) {
+        condata->dropped_since_ns = condata->refilled_ns;
+    } else if (condata->refilled_ns - condata->dropped_since_ns >= RATE_SCALE) {
+        report_dropped(condata);
     }
+}
 
-    // begin listening on the socket
-    if (-1 == listen(listen_socket, SOMAXCONN)) {
-        close(listen_socket);
-        listen_socket = -1;
-        g_queue_free(read_buff);
-        read_buff = NULL;
-        return false;
+// queue every complete message waiting in the connection's receive buffer
+// anything left over is the start of a message which hasn't all arrived yet: it stays in the buffer for next time
+// returns PAUSED (leaving the rest in the buffer) if the shard's queue fills up, or this node has too much queued (fair_by_address)
+// or THROTTLED if the connection is over the rate limits (SERVER_RATE_DELAY)
+static ReadStatus extract_frames(ConnectionData *condata, Arena **arena) {
+    RecvBuffer *buf = &(condata->recv);
+    if (rate_limited) {
+        refill_buckets(condata);
     }
 
-    return true;
-}
+    // the first bytes from a client say how it frames its messages
+    if (!condata->framing_known) {
+        size_t preamble_len;
+        FrameStatus detected = detect_framing(buf->data + buf->start, buf->end - buf->start, &(condata->framing), &preamble_len);
+        if (FRAME_INVALID == detected) {
+            return ERROR;
+        } else if (FRAME_PARTIAL == detected) {
+            return SUCCESS;
+        }
 
-// gets a message from the read queue
-BufferItem *read_message(void) {
-    if (0 != pthread_mutex_lock(&read_buff_mux)) {
-        perror("Can't lock read_buff_mux");
-        return NULL;
+        recv_buffer_consume(buf, preamble_len);
+        condata->framing_known = true;
     }
 
-    BufferItem *ret = (BufferItem *) g_queue_pop_head(read_buff);
-    // if this is NULL we should be returning NULL anyway
+    while (buf->start < buf->end) {
+        if (!queue_has_room(condata->shard)) {
+            atomic_store(&ingress_paused, true);
+            return PAUSED;
+        } else if (!node_has_room(condata)) {
+            return PAUSED; // only this node's connections stop
+        }
+
+        char *data = buf->data + buf->start;
+        size_t start, end;
+        FrameStatus frame = next_frame(condata->framing, &(condata->scanner), data, buf->end - buf->start, &start, &end);
 
-    pthread_mutex_unlock(&read_buff_mux);
+        if (FRAME_INVALID == frame) {
+            return ERROR;
+        } else if (FRAME_PARTIAL == frame) {
+            // don't keep newlines around
+            recv_buffer_consume(buf, start);
+            return SUCCESS;
+        }
 
-    return ret;
-}
+        if (rate_limited) {
+            if (!take_tokens(condata, end - start)) {
+                if (SERVER_RATE_DELAY == rate_action) {
+                    return THROTTLED; // the scanner starts again from the beginning of this frame next time
+                }
+                drop_message(condata);
+                recv_buffer_consume(buf, end);
+                continue;
+            } else if (0 != condata->dropped) {
+                report_dropped(condata); // it is back under the limits
+            }
+        }
 
-// free a BufferItem (wrapper function incase it contains anyting that needs freeing interneally)
-void free_bufferitem(BufferItem *item) {
-    free_message(&(item->msg));
-    free(item);
+        // temporarily terminate the object so that it can be decoded in place (there is always room for the '\0')
+        char after = data[end];
+        data[end] = '\0';
+        ReadStatus status = queue_object(condata, data + start, end - start, arena);
+        data[end] = after;
+        if (SUCCESS != status) {
+            return status;
+        }
+
+        recv_buffer_consume(buf, end);
+    }
+
+    return SUCCESS;
 }
 
-// free a ConnectionData
-static void free_connectiondata(ConnectionData *condata) {
-    condata->destroyed = true;
-    pthread_mutex_unlock(&(condata->mutex));
-    // if something jumps in here then it should check the destroyed flag
-    errno = pthread_mutex_destroy(&(condata->mutex));
-    if (0 != errno) {
-        //perror("destroy condata mux");
+// extract_frames with one arena for the batch (SERVER_DECODE_ARENA). Each item from it holds a reference; this drops ours
+static ReadStatus extract_objects(ConnectionData *condata) {
+    Arena *arena = NULL;
+    ReadStatus status = extract_frames(condata, &arena);
+    if (NULL != arena) {
+        arena_unref(arena);
     }
-    close(condata->fd);
-    free(condata);
+    return status;
 }
 
-static void do_nothing(__attribute__((unused)) int compulsory) {
-    // literally do nothing
+// how much we ask recv for at a time
+#define RECV_CHUNK 16384
+
+// what is waiting in a connection's receive buffer once every whole frame has been taken out is part of a frame. If that fills
+// the buffer the frame can never be finished
+static bool recv_full(const ConnectionData *condata) {
+    return RECV_BUFFER_MAX == condata->recv.end - condata->recv.start;
 }
 
-#define DISABLE_SIGNAL(_signal) \
-    memset(&sa, 0, sizeof(sa)); \
-    sa.sa_handler = do_nothing; \
-    if (-1 == sigaction(_signal, &sa, NULL)) { \
-        perror("Couldn't disable signal"); \
-    } 
+// receive everything waiting on a connection and queue every complete object
+// the reactor is edge-triggered so we won't be told about this data again: keep going until the socket is drained
+// returns END when the socket has been drained, CLOSED if the client hung up, PAUSED if too much is queued to carry on,
+// THROTTLED if the client is over the rate limits or ERROR
+static ReadStatus read_objects(ConnectionData *condata) {
+    // if the queue filled up last time there could be whole messages waiting in the buffer. They go first
+    ReadStatus status = extract_objects(condata);
+    if (SUCCESS != status) {
+        return status;
+    }
 
+    while (true) {
+        // leave what is left in the socket so that TCP pushes back on the client
+        if (atomic_load(&ingress_paused)) {
+            return PAUSED;
+        }
 
-void stop_server(void) {
-    // disable signal handlers
-    struct sigaction sa;
-    DISABLE_SIGNAL(SIGRTMIN + READ_SIG)
-    DISABLE_SIGNAL(SIGRTMIN + CONNECT_SIG)
+        if (recv_full(condata)) {
+            report_error(condata, "Message too large");
+            return ERROR;
+        }
 
-    // disable KEEP_ALIVE check
-    stop_timer(timer_id);
+        // ask for no more than the buffer can still take so that a frame of FRAME_MAX_LEN fits
+        size_t want = RECV_BUFFER_MAX - (condata->recv.end - condata->recv.start);
+        if (want > RECV_CHUNK) {
+            want = RECV_CHUNK;
+        }
 
-    // close the open socket
-    if (-1 != listen_socket) {
-        close(listen_socket);
-        listen_socket = -1;
-    }
+        size_t space;
+        char *dest = recv_buffer_reserve(&(condata->recv), want, &space);
+        if (NULL == dest) {
+            perror("Couldn't grow receive buffer");
+            return ERROR;
+        }
 
-    // free up the connection table and close all the active connections
-    if (connections_table) {
-        pthread_mutex_lock(&connections_mux);
-        g_hash_table_destroy(connections_table);
-        connections_table = NULL;
-        pthread_mutex_unlock(&connections_mux);
-    }
+        ssize_t num_read = recv(condata->fd, dest, space, 0);
+        if (0 == num_read) {
+            return CLOSED;
+        } else if (-1 == num_read) {
+            if (EINTR == errno) {
+                continue;
+            } else if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+                return END;
+            }
 
-    // free up the read buffer
-    if (read_buff) {
-        pthread_mutex_lock(&read_buff_mux);
-        g_queue_free_full(read_buff, (GDestroyNotify) free_bufferitem);
-        read_buff = NULL;
-        pthread_mutex_unlock(&read_buff_mux);
-    }
+            printf("Unknown error errno=%s\n", strerror(errno));
+            return ERROR;
+        }
+        recv_buffer_commit(&(condata->recv), (size_t) num_read);
 
+        status = extract_objects(condata);
+        if (SUCCESS != status) {
+            return status;
+        }
+
+        // a short read means that the socket has been drained
+        if ((size_t) num_read < space) {
+            return END;
+        }
+    }
+}
+
+// closes a connection and retires its slot. Only the shard's reactor may do this
+static void destroy_connection(ConnectionData *condata) {
+    Shard *shard = condata->shard;
+    connections_by_fd[condata->fd] = NULL;
+    wheel_cancel(&(shard->keep_alives), &(condata->keep_alive));
+
+    release_connection(condata);
+    atomic_fetch_sub(&(shard->num_connections), 1);
+    epoch_retire(&connections_epoch, &(shard->retired), &(condata->retired));
+}
+
+// gives a retired slot back to its shard once nobody can be looking at it
+static void reclaim_slot(EpochNode *node, Shard *shard) {
+    ConnectionData *condata = (ConnectionData *) (void *) node;
+    condata->next_free = shard->free_slots;
+    shard->free_slots = condata;
+}
+
+// for reporting a connection close
+static void *report_close(ConnectionData *condata) {
+    // allocate the item to go onto the queue
+    BufferItem *item = alloc_item();
+    if (!item) {
+        destroy_connection(condata);
+        return NULL;
+    }
+    
+    item->address = condata->addr.sin_addr;
+    item->recv_time = time(NULL);
+    item->first_time = item->recv_time;
+    
+    software_error(&(item->msg), "Connection closed");
+    if (0 != condata->dropped) {
+        report_dropped(condata); // before the close
+    }
+    
+    // the connection is gone (and counted as gone) by the time anyone reads this
+    Shard *shard = condata->shard;
+    destroy_connection(condata);
+    push_item(shard, item);
+    return NULL;
+}
+
+// handles a reactor event on a connection with a client
+static void connection_event(Shard *shard, int fd, uint32_t events) {
+    // only this shard's reactor touches the connection so there is nothing to lock
+    ConnectionData *condata = lookup_connection(fd);
+    if (NULL == condata) {
+        return;
+    }
+    assert((fd == condata->fd) && (shard == condata->shard));
+
+    // while reading is paused just remember what happened. Once it resumes the connection is drained
+    if (condata->throttled) {
+        condata->paused_events |= events;
+        return;
+    } else if (condata->paused) {
+        if (atomic_load(&ingress_paused)) {
+            condata->paused_events |= events;
+            return;
+        }
+
+        events |= condata->paused_events | EPOLLIN;
+        unpause_connection(condata);
+    }
+
+    // read in everything which was sent before looking at hang-ups so that no messages are lost
+    ReadStatus status = END;
+    if (events & EPOLLIN) {
+        status = read_objects(condata);
+        if (ERROR == status) {
+            puts("Read ERROR from remote host\n");
+            destroy_connection(condata);
+            return;
+        } else if (PAUSED == status) {
+            pause_connection(condata);
+            condata->paused_events = events & ~(uint32_t) EPOLLIN;
+            return;
+        } else if (THROTTLED == status) {
+            throttle_connection(condata);
+            condata->paused_events = events & ~(uint32_t) EPOLLIN;
+            return;
+        }
+    }
+
+    // the client hung up or the connection broke
+    if ((CLOSED == status) || (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        report_close(condata);
+    }
+}
+
+// turns a connection away without spending anything on it
+// a reset (rather than a normal close) means that we don't keep the socket around in TIME_WAIT either
+static void reject_connection(int fd) {
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+    atomic_fetch_add(&rejected_connections, 1);
+}
+
+// puts a newly accepted connection from addr into a free slot of the shard's connections table
+// the caller registers it with the shard's reactor
+// returns NULL (and closes fd) on failure or if the shard is full
+static ConnectionData *add_connection(Shard *shard, int fd, const struct sockaddr_in *addr) {
+    // slots of connections which have closed come back once no other thread can be looking at them
+    if (NULL == shard->free_slots) {
+        epoch_reclaim(&connections_epoch, &(shard->retired));
+    }
+
+    // no room
+    if ((NULL == shard->free_slots) || ((size_t) fd >= max_fds)) {
+        reject_connection(fd);
+        return NULL;
+    }
+
+    ConnectionData *condata = shard->free_slots;
+    shard->free_slots = condata->next_free;
+    atomic_fetch_add(&(shard->num_connections), 1);
+
+    condata->fd = fd;
+    condata->shard = shard;
+    condata->generation = shard->next_generation++;
+    if (SERVER_DECODE_ZERO_COPY == decode_mode) {
+        recv_buffer_init_shared(&(condata->recv));
+    } else {
+        recv_buffer_init(&(condata->recv));
+    }
+    frame_scanner_reset(&(condata->scanner));
+    condata->framing_known = false;
+    condata->framing = FRAMING_BRACES;
+    condata->paused = false;
+    condata->paused_events = 0;
+    condata->hung_up = false;
+    condata->recv_armed = false;
+    condata->msg_tokens = msg_rate * RATE_SCALE;
+    condata->byte_tokens = byte_rate * RATE_SCALE;
+    condata->refilled_ns = coarse_ns();
+    condata->throttled = false;
+    condata->dropped = 0;
+    memcpy(&(condata->addr), addr, sizeof(condata->addr));
+    wheel_timer_init(&(condata->keep_alive));
+    condata->heard = monotonic_ms() / 1000;
+    wheel_schedule(&(shard->keep_alives), &(condata->keep_alive), condata->heard + (KEEP_ALIVE_PROD));
+    arm_timer_at(shard, condata->keep_alive.expires * 1000);
+    atomic_store_explicit(&(condata->in_use), true, memory_order_release);
+
+    connections_by_fd[fd] = condata;
+
+    char addr_str[160] = {'\n'}; // buffer to hold string-ified ip4 address
+    inet_ntop(AF_INET, &(condata->addr.sin_addr.s_addr), addr_str, sizeof(addr_str));
+    printf("Connect from %s\n", addr_str);
+
+    return condata;
+}
+
+// accepts every connection waiting on the listening socket
+// the reactor is edge-triggered so we have to keep going until there are none left
+static void accept_connections(Shard *shard) {
+    while (true) {
+        // accept4 gives us the peer address and makes the socket non-blocking (so the reactor can drain it) and cloexec in one go
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        int fd = accept4(shard->listen_socket, (struct sockaddr *) &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (-1 == fd) {
+            // the client gave up before we got to it
+            if ((ECONNABORTED == errno) || (EINTR == errno)) {
+                continue;
+            }
+
+            // EAGAIN means that there is nobody left waiting
+            if ((EAGAIN != errno) && (EWOULDBLOCK != errno)) {
+                perror("accept4");
+            }
+            return;
+        }
+
+        ConnectionData *condata = add_connection(shard, fd, &addr);
+
+        // start getting told about IO and hang-ups on this connection
+        if ((NULL != condata) && !reactor_add(shard, fd, EPOLLIN | EPOLLRDHUP)) {
+            perror("Couldn't add connection to the reactor");
+            destroy_connection(condata);
+        }
+    }
+}
+
+// carry on reading from the connections which were paused, until they are all going again or things get too busy again
+static void resume_connections(Shard *shard, void (*resume)(Shard *shard, int fd)) {
+    if (NULL != handler) {
+        return; // with a handler nothing is queued so reading never pauses
+    }
+
+    // only the ones which were paused to start with: a node with too much queued (fair_by_address) goes straight back on the end
+    flush_overflow(shard);
+    for (guint n = g_queue_get_length(shard->paused); (n > 0) && !atomic_load(&ingress_paused); n--) {
+        resume(shard, GPOINTER_TO_INT(g_queue_pop_head(shard->paused)));
+    }
+}
+
+// resumes a paused connection with the epoll backend
+static void resume_connection(Shard *shard, int fd) {
+    connection_event(shard, fd, 0); // adds in the events which came while paused
+}
+
+// the epoll backend: waits for events and dispatches them until woken up by stop_server
+static void *reactor(Shard *shard) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        int count = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, -1);
+        if (-1 == count) {
+            if (EINTR == errno) {
+                continue;
+            }
+            perror("reactor: epoll_wait");
+            return NULL;
+        }
+
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+
+            if (shard->wakeup_fd == fd) { // stop_server wants us to exit or reading can resume
+                uint64_t value;
+                if (-1 == read(fd, &value, sizeof(value))) {
+                    // it is fine if someone beat us to it
+                }
+                if (atomic_load(&(shard->stopping))) {
+                    deliver_handled(shard);
+                    return NULL;
+                }
+                resume_connections(shard, resume_connection);
+            } else if (shard->timer_fd == fd) { // a coalesce window has ended, throttled connections are due another go or keep alive timers are due
+                uint64_t expirations;
+                if (-1 == read(fd, &expirations, sizeof(expirations))) {
+                    // it was set again since it went off
+                }
+                timer_event(shard, resume_connection);
+            } else if (shard->listen_socket == fd) { // new connections
+                accept_connections(shard);
+            } else { // IO on a connection
+                connection_event(shard, fd, events[i].events);
+            }
+        }
+
+        // one call to the handler, or one wake up, for everything this batch received
+        deliver_handled(shard);
+        if (shard->pushed) {
+            shard->pushed = false;
+            wake_readers();
+        }
+    }
+}
+
+// start receiving on a connection with the io_uring backend
+static bool uring_arm_recv(Shard *shard, ConnectionData *condata) {
+    condata->recv_armed = uring_recv_multishot(&(shard->ring), condata->fd, URING_DATA(URING_RECV, condata->generation, condata->fd));
+    return condata->recv_armed;
+}
+
+// cancels the recv running on a connection. It finishes with -ECANCELED
+static void uring_cancel_recv(Shard *shard, ConnectionData *condata) {
+    if (condata->recv_armed) {
+        uring_cancel(&(shard->ring), URING_DATA(URING_RECV, condata->generation, condata->fd), URING_DATA(URING_CANCEL, 0, 0));
+    }
+}
+
+// stop reading from a connection with the io_uring backend
+// anything which was already on its way is kept in the connection's receive buffer
+static void uring_pause(Shard *shard, ConnectionData *condata) {
+    pause_connection(condata);
+    uring_cancel_recv(shard, condata);
+}
+
+// handles a completed (multishot) accept with the io_uring backend
+static void uring_accept_event(Shard *shard, const UringCompletion *completion) {
+    if (completion->res >= 0) {
+        // multishot accept can't give us the peer address
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        ConnectionData *condata = NULL;
+        if (0 == getpeername(completion->res, (struct sockaddr *) &addr, &addrlen)) {
+            condata = add_connection(shard, completion->res, &addr);
+        } else {
+            close(completion->res);
+        }
+
+        // start receiving on this connection
+        if ((NULL != condata) && !uring_arm_recv(shard, condata)) {
+            puts("Couldn't add connection to the reactor");
+            destroy_connection(condata);
+        }
+    }
+
+    // the kernel stopped accepting for us (e.g. after an error) so start again
+    if (!completion->more) {
+        if (!uring_accept_multishot(&(shard->ring), shard->listen_socket, completion->user_data)) {
+            puts("uring_reactor: couldn't restart accept");
+        }
+    }
+}
+
+// queues what a connection has received and decides whether to carry on receiving
+static void uring_after_recv(Shard *shard, ConnectionData *condata, ReadStatus status) {
+    if (ERROR == status) {
+        puts("Read ERROR from remote host\n");
+        // the recv still holds a reference to the socket: shut it down so that the client sees it close
+        shutdown(condata->fd, SHUT_RDWR);
+        destroy_connection(condata);
+        return;
+    }
+
+    // the client hung up or the connection broke
+    if (CLOSED == status) {
+        if (condata->paused) { // reported once everything it sent has been queued
+            condata->hung_up = true;
+            return;
+        }
+
+        report_close(condata);
+        return;
+    }
+
+    // stop reading while too much is queued or the client is over the rate limits
+    if (!condata->paused && (THROTTLED == status)) {
+        throttle_connection(condata);
+        uring_cancel_recv(shard, condata);
+    } else if (!condata->paused && ((PAUSED == status) || atomic_load(&ingress_paused))) {
+        uring_pause(shard, condata);
+    }
+
+    // keep receiving
+    if (!condata->paused && !condata->recv_armed && !uring_arm_recv(shard, condata)) {
+        report_close(condata);
+    }
+}
+
+// handles a completed (multishot) recv with the io_uring backend
+static void uring_recv_event(Shard *shard, const UringCompletion *completion) {
+    Uring *ring = &(shard->ring);
+    int fd = URING_FD(completion->user_data);
+
+    ConnectionData *condata = lookup_connection(fd);
+
+    // the connection could already have been destroyed and its fd reused
+    if ((NULL == condata) || (URING_GENERATION(completion->user_data) != (condata->generation & 0x3FFFFFFF))) {
+        if (completion->has_buffer) {
+            uring_recycle_buffer(ring, completion->buffer);
+        }
+        return;
+    }
+
+    if (!completion->more) {
+        condata->recv_armed = false;
+    }
+
+    ReadStatus status = SUCCESS;
+    if (completion->res > 0) {
+        // while paused what was already on its way is only buffered
+        if (!recv_buffer_append(&(condata->recv), uring_buffer(ring, completion->buffer), (size_t) completion->res)) {
+            report_error(condata, "Message too large");
+            status = ERROR;
+        } else if (!condata->paused) {
+            status = extract_objects(condata);
+            if ((SUCCESS == status) && recv_full(condata)) {
+                report_error(condata, "Message too large");
+                status = ERROR;
+            }
+        }
+        uring_recycle_buffer(ring, completion->buffer);
+    } else {
+        if (completion->has_buffer) {
+            uring_recycle_buffer(ring, completion->buffer);
+        }
+
+        // -ENOBUFS: we ran out of provided buffers. They are given back to the kernel before the next wait so just try again
+        // -ECANCELED: we paused the connection
+        // otherwise the client hung up (res = 0) or the connection broke
+        if ((-ENOBUFS != completion->res) && (-ECANCELED != completion->res)) {
+            status = CLOSED;
+        }
+    }
+
+    uring_after_recv(shard, condata, status);
+}
+
+// resumes a paused connection with the io_uring backend: queues what was buffered while paused and starts receiving again
+static void uring_resume(Shard *shard, int fd) {
+    ConnectionData *condata = lookup_connection(fd);
+    if ((NULL == condata) || !condata->paused) {
+        return;
+    }
+
+    unpause_connection(condata);
+    ReadStatus status = extract_objects(condata);
+    if ((SUCCESS == status) && condata->hung_up) {
+        status = CLOSED;
+    }
+    uring_after_recv(shard, condata, status);
+}
+
+// a shard's reactor thread using the io_uring backend
+// each io_uring_enter both submits new requests and waits for a batch of completions. Receives land in kernel-provided buffers
+static void *uring_reactor(Shard *shard) {
+    Uring *ring = &(shard->ring);
+
+    if (!uring_read(ring, shard->wakeup_fd, &(shard->wakeup_value), sizeof(shard->wakeup_value), URING_DATA(URING_WAKEUP, 0, shard->wakeup_fd))
+            || !uring_read(ring, shard->timer_fd, &(shard->timer_expirations), sizeof(shard->timer_expirations), URING_DATA(URING_WAKEUP, 0, shard->timer_fd))
+            || !uring_accept_multishot(ring, shard->listen_socket, URING_DATA(URING_ACCEPT, 0, shard->listen_socket))) {
+        puts("uring_reactor: couldn't queue requests");
+        return NULL;
+    }
+
+    while (true) {
+        int ret = uring_wait(ring);
+        if (0 != ret) {
+            if (-EINTR == ret) {
+                continue;
+            }
+            errno = -ret;
+            perror("uring_reactor: io_uring_enter");
+            return NULL;
+        }
+
+        UringCompletion completion;
+        while (uring_next_completion(ring, &completion)) {
+            switch (URING_TYPE(completion.user_data)) {
+                case URING_WAKEUP: // stop_server wants us to exit or reading can resume. Or the shard's timer went off
+                    if (URING_FD(completion.user_data) == shard->timer_fd) {
+                        timer_event(shard, uring_resume);
+                        if (!uring_read(ring, shard->timer_fd, &(shard->timer_expirations), sizeof(shard->timer_expirations), completion.user_data)) {
+                            puts("uring_reactor: couldn't restart timer read");
+                        }
+                        break;
+                    }
+                    if (atomic_load(&(shard->stopping))) {
+                        deliver_handled(shard);
+                        return NULL;
+                    }
+                    resume_connections(shard, uring_resume);
+                    if (!uring_read(ring, shard->wakeup_fd, &(shard->wakeup_value), sizeof(shard->wakeup_value), completion.user_data)) {
+                        puts("uring_reactor: couldn't restart wakeup read");
+                    }
+                    break;
+                case URING_ACCEPT: // new connection
+                    uring_accept_event(shard, &completion);
+                    break;
+                case URING_RECV: // IO on a connection
+                    uring_recv_event(shard, &completion);
+                    break;
+                default: // URING_CANCEL: nothing to do
+                    break;
+            }
+        }
+
+        // one call to the handler, or one wake up, for everything this batch received
+        deliver_handled(shard);
+        if (shard->pushed) {
+            shard->pushed = false;
+            wake_readers();
+        }
+    }
+}
+
+// a shard's reactor thread: runs the shard's backend with a pool for the messages it receives
+static void *reactor_thread(Shard *shard) {
+    item_pool = pool_claim(&item_pools); // if this fails we make do with malloc
+    if (SERVER_DECODE_INLINE == decode_mode) {
+        inline_item_pool = pool_claim(&inline_item_pools);
+    }
+    void *ret = shard->use_uring ? uring_reactor(shard) : reactor(shard);
+    if (NULL != item_pool) {
+        pool_release(item_pool);
+        item_pool = NULL;
+    }
+    if (NULL != inline_item_pool) {
+        pool_release(inline_item_pool);
+        inline_item_pool = NULL;
+    }
+    return ret;
+}
+
+// starts a shard's reactor thread
+// the thread blocks every signal so that it never takes delivery of signals meant for the rest of the process
+static bool start_reactor(Shard *shard) {
+    sigset_t all_signals;
+    sigset_t old_mask;
+    sigfillset(&all_signals);
+    if (0 != pthread_sigmask(SIG_SETMASK, &all_signals, &old_mask)) {
+        return false;
+    }
+
+    // the new thread inherits our (temporary) signal mask
+    shard->reactor_running = (0 == pthread_create(&(shard->reactor_thread), NULL, (void *(*)(void *)) reactor_thread, shard));
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return shard->reactor_running;
+}
+
+// sets up a shard listening on addr. Nothing is started until start_reactor
+// reuseport should be set if more than one shard will listen on this address
+static bool init_shard(Shard *shard, const struct sockaddr *addr, socklen_t addrlen, bool reuseport, unsigned int num_slots, const ServerOptions *options) {
+    // mark everything as not set up yet so that stop_shard knows what to clean up
+    shard->listen_socket = -1;
+    shard->epoll_fd = -1;
+    shard->wakeup_fd = -1;
+    shard->reactor_running = false;
+    atomic_init(&(shard->stopping), false);
+    shard->use_uring = false;
+    for (unsigned int i = 0; i < SERVER_NUM_LANES; i++) {
+        shard->lanes[i].cells = NULL;
+        shard->fair_lanes[i].flows = NULL;
+    }
+    shard->pushed = false;
+    shard->coalescer.entries = NULL;
+    shard->throttled = NULL;
+    shard->throttle_deadline = 0;
+    wheel_init(&(shard->keep_alives), monotonic_ms() / 1000);
+    shard->timer_fd = -1;
+    shard->timer_deadline = 0;
+    shard->num_handled = 0;
+    decode_scratch_init(&(shard->scratch));
+    shard->overflow = NULL;
+    shard->paused = NULL;
+    shard->slots = NULL;
+    shard->num_slots = 0;
+    shard->free_slots = NULL;
+    epoch_limbo_init(&(shard->retired), (epoch_reclaim_t) reclaim_slot, shard);
+    atomic_init(&(shard->num_connections), 0);
+
+    // create IPv4 TCP socket to communicate over
+    // non-blocking so that the reactor can drain it
+    // cloexec for security (closes fd on an exec() syscall)
+    shard->listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == shard->listen_socket) {
+        perror("start_server: create socket");
+        return false;
+    }
+
+    // a server which closed connections itself (when a client sent something too large) can be started again straight away
+    int one = 1;
+    if (-1 == setsockopt(shard->listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+        perror("start_server: SO_REUSEADDR");
+        return false;
+    }
+
+    // let the other shards bind to the same address
+    if (reuseport && (-1 == setsockopt(shard->listen_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))) {
+        perror("start_server: SO_REUSEPORT");
+        return false;
+    }
+
+    // only wake up for a new connection once it has sent something
+    int defer = (int) options->defer_accept;
+    if ((0 != defer) && (-1 == setsockopt(shard->listen_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)))) {
+        perror("start_server: TCP_DEFER_ACCEPT");
+        return false;
+    }
+
+    // bind to the specified address
+    if (-1 == bind(shard->listen_socket, addr, addrlen)) {
+        perror("start_server: binding");
+        return false;
+    }
+
+    // initialise the queue with room for a close report from every connection on top of queue_capacity messages
+    // each lane gets all of that, as nothing says how the messages will be split between them
+    for (unsigned int i = 0; i < num_lanes; i++) {
+        if (fair_by_address) {
+            if (!fair_init(&(shard->fair_lanes[i]), queue_capacity + num_slots, fair_quantum, node_queue_limit / 2)) {
+                return false;
+            }
+        } else if (!ring_init(&(shard->lanes[i]), queue_capacity + num_slots, options->multiple_readers)) {
+            return false;
+        }
+    }
+
+    shard->overflow = g_queue_new();
+    if (!shard->overflow) {
+        return false;
+    }
+
+    shard->paused = g_queue_new();
+    if (!shard->paused) {
+        return false;
+    }
+
+    shard->throttled = g_queue_new();
+    if (!shard->throttled) {
+        return false;
+    }
+
+    // initialise the connections table: every slot starts off free
+    shard->slots = calloc(num_slots, sizeof(ConnectionData));
+    if (!shard->slots) {
+        return false;
+    }
+    shard->num_slots = num_slots;
+    for (unsigned int i = 0; i < num_slots; i++) {
+        shard->slots[i].next_free = shard->free_slots;
+        shard->free_slots = &(shard->slots[i]);
+    }
+
+    shard->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == shard->wakeup_fd) {
+        perror("start_server: eventfd");
+        return false;
+    }
+
+    if ((0 != coalesce_window_ms) && !coalesce_init(&(shard->coalescer), coalesce_window_ms)) {
+        return false;
+    }
+    shard->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == shard->timer_fd) {
+        perror("start_server: timerfd_create");
+        return false;
+    }
+
+    // set up the reactor: io_uring if we were asked to and the kernel can do it
+    if (SERVER_BACKEND_IO_URING == options->backend) {
+        shard->use_uring = uring_init(&(shard->ring), URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE);
+        if (shard->use_uring) {
+            return true;
+        }
+        puts("start_server: io_uring is not available. Using epoll");
+    }
+
+    // otherwise epoll
+    shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == shard->epoll_fd) {
+        perror("start_server: epoll_create1");
+        return false;
+    }
+
+    if (!reactor_add(shard, shard->wakeup_fd, EPOLLIN) || !reactor_add(shard, shard->listen_socket, EPOLLIN)
+            || !reactor_add(shard, shard->timer_fd, EPOLLIN)) {
+        perror("start_server: epoll_ctl");
+        return false;
+    }
+
+    return true;
+}
+
+// attach a classic BPF program to the reuseport group which picks the shard from a hash of the client's IPv4 address
+// the kernel numbers the sockets in the group in the order that they started listening
+static bool steer_by_address(int listen_socket, unsigned int count) {
+    struct sock_filter code[] = {
+        // A = source address from the IPv4 header
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) (SKF_NET_OFF + 12)),
+        // multiplicative hash so that neighbouring addresses are spread over the shards
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9E3779B1),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+        // return the index of the socket to use
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    return 0 == setsockopt(listen_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+// fills in the default server options
+void server_default_options(ServerOptions *options) {
+    if (NULL == options)
+        return;
+
+    memset(options, 0, sizeof(*options));
+    options->shards = 1;
+    options->steer_by_address = false;
+    options->backend = SERVER_BACKEND_EPOLL;
+    options->defer_accept = 0;
+    options->ingress_high_items = 0;
+    options->ingress_low_items = 0;
+    options->ingress_high_bytes = 0;
+    options->ingress_low_bytes = 0;
+    options->max_connections = 0;
+    options->queue_capacity = 65536;
+    options->multiple_readers = true;
+    options->wait_spin_us = 0;
+    options->handler = NULL;
+    options->handler_data = NULL;
+    options->decode = SERVER_DECODE_COPY;
+    options->priority = SERVER_PRIORITY_FIFO;
+    options->lane_weights[HARD_ERROR_VALVE] = 16;
+    options->lane_weights[HARD_ERROR_OTHER] = 4;
+    options->lane_weights[SOFT_ERROR] = 1;
+    options->fair_by_address = false;
+    options->fair_quantum = 1024;
+    options->node_queue_limit = 1024;
+    options->coalesce_window_ms = 0;
+    options->rate_limit_msgs = 0;
+    options->rate_limit_bytes = 0;
+    options->rate_limit_action = SERVER_RATE_DELAY;
+}
+
+// how much is waiting to be read
+void server_ingress_stats(IngressStats *stats) {
+    stats->queued_items = atomic_load(&queued_items);
+    stats->queued_bytes = atomic_load(&queued_bytes);
+    stats->paused_connections = atomic_load(&paused_connections);
+    stats->paused = atomic_load(&ingress_paused);
+    stats->reader_wakeups = atomic_load(&reader_wakeups);
+    stats->coalesced = atomic_load(&coalesced_items);
+    stats->rate_dropped = atomic_load(&rate_dropped);
+}
+
+// how many connections there are and how many were turned away
+void server_connection_stats(ConnectionStats *stats) {
+    stats->connections = 0;
+    stats->max_connections = 0;
+    for (unsigned int i = 0; i < num_shards; i++) {
+        stats->connections += atomic_load(&(shards[i].num_connections));
+        stats->max_connections += shards[i].num_slots;
+    }
+    stats->rejected = atomic_load(&rejected_connections);
+}
+
+// what the pools and tables are holding on to
+void server_memory_stats(MemoryStats *stats) {
+    PoolStats pool_stats = {0, 0, 0, 0};
+    PoolStats inline_stats = {0, 0, 0, 0};
+    if (item_pools_ready) {
+        pool_set_stats(&item_pools, &pool_stats);
+        pool_set_stats(&inline_item_pools, &inline_stats);
+    }
+    stats->item_allocations = pool_stats.allocations + inline_stats.allocations;
+    stats->item_pool_hits = pool_stats.hits + inline_stats.hits;
+    stats->item_pool_bytes = pool_stats.resident_bytes + inline_stats.resident_bytes;
+
+    stats->connection_bytes = max_fds * sizeof(ConnectionData *);
+    for (unsigned int i = 0; i < num_shards; i++) {
+        stats->connection_bytes += shards[i].num_slots * sizeof(ConnectionData);
+    }
+}
+
+// starts a server listening on addr
+// returns success
+bool start_server(const struct sockaddr *addr, socklen_t addrlen) {
+    return start_server_with_options(addr, addrlen, NULL);
+}
+
+// starts a server listening on addr
+// returns success
+bool start_server_with_options(const struct sockaddr *addr, socklen_t addrlen, const ServerOptions *options) {
+    if (NULL == addr)
+        return false;
+
+    ServerOptions defaults;
+    if (NULL == options) {
+        server_default_options(&defaults);
+        options = &defaults;
+    }
+
+    ingress_high_items = options->ingress_high_items;
+    ingress_low_items = options->ingress_low_items;
+    ingress_high_bytes = options->ingress_high_bytes;
+    ingress_low_bytes = options->ingress_low_bytes;
+    atomic_store(&queued_items, 0);
+    atomic_store(&queued_bytes, 0);
+    atomic_store(&ingress_paused, false);
+    atomic_store(&paused_connections, 0);
+    atomic_store(&rejected_connections, 0);
+    queue_capacity = (0 == options->queue_capacity) ? 65536 : options->queue_capacity;
+    wait_spin_us = options->wait_spin_us;
+    if (!item_pools_ready) {
+        pool_set_init(&item_pools, sizeof(BufferItem), ITEMS_PER_SLAB);
+        pool_set_init(&inline_item_pools, INLINE_ITEM_SIZE, ITEMS_PER_SLAB);
+        item_pools_ready = true;
+    }
+    handler = options->handler;
+    handler_data = options->handler_data;
+    decode_mode = options->decode;
+    priority = options->priority;
+    num_lanes = (SERVER_PRIORITY_FIFO == priority) ? 1 : SERVER_NUM_LANES;
+    for (unsigned int i = 0; i < SERVER_NUM_LANES; i++) {
+        lane_weights[i] = (0 == options->lane_weights[i]) ? 1 : options->lane_weights[i];
+    }
+    atomic_store(&weighted_lane, 0);
+    atomic_store(&weighted_used, 0);
+    fair_by_address = options->fair_by_address;
+    fair_quantum = options->fair_quantum;
+    node_queue_limit = options->node_queue_limit;
+    coalesce_window_ms = options->coalesce_window_ms;
+    atomic_store(&coalesced_items, 0);
+    msg_rate = (int64_t) ((options->rate_limit_msgs > RATE_SCALE) ? RATE_SCALE : options->rate_limit_msgs);
+    byte_rate = (int64_t) ((options->rate_limit_bytes > RATE_SCALE) ? RATE_SCALE : options->rate_limit_bytes);
+    msg_cost = (0 == msg_rate) ? 0 : RATE_SCALE;
+    byte_cost = (0 == byte_rate) ? 0 : RATE_SCALE;
+    rate_limited = (0 != msg_rate) || (0 != byte_rate);
+    rate_action = options->rate_limit_action;
+    atomic_store(&rate_dropped, 0);
+    atomic_store(&spin_budget_us, wait_spin_us);
+    atomic_store(&reader_wakeups, 0);
+    atomic_store(&readers_stopped, false);
+
+    // lets a main loop sleep until there are messages (server_ready_fd)
+    atomic_store(&ready_signalled, false);
+    ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == ready_fd) {
+        return false;
+    }
+
+    epoch_domain_init(&connections_epoch);
+
+    // every fd we could be given gets an entry in the lookup table
+    struct rlimit nofile;
+    if (-1 == getrlimit(RLIMIT_NOFILE, &nofile)) {
+        stop_server();
+        return false;
+    }
+    max_fds = ((RLIM_INFINITY == nofile.rlim_cur) || (nofile.rlim_cur > MAX_FDS)) ? MAX_FDS : (size_t) nofile.rlim_cur;
+    connections_by_fd = calloc(max_fds, sizeof(ConnectionData *));
+    if (NULL == connections_by_fd) {
+        stop_server();
+        return false;
+    }
+
+    // work out how many shards to run
+    num_shards = options->shards;
+    if (0 == num_shards) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_shards = (cpus > 0) ? (unsigned int) cpus : 1;
+    }
+
+    unsigned int wanted_shards = num_shards;
+    shards = calloc(wanted_shards, sizeof(Shard));
+    num_shards = 0; // counts the shards which need cleaning up
+    if (NULL == shards) {
+        stop_server();
+        return false;
+    }
+
+    // split the connection slots between the shards
+    size_t max_connections = options->max_connections;
+    if (0 == max_connections) {
+        max_connections = (max_fds < DEFAULT_MAX_CONNECTIONS) ? max_fds : DEFAULT_MAX_CONNECTIONS;
+    }
+    unsigned int slots_per_shard = (unsigned int) ((max_connections + wanted_shards - 1) / wanted_shards);
+
+    // the shards must all bind to the same port. If we were asked for any port (0) then use the one the first shard got
+    struct sockaddr_in bind_addr;
+    if (addrlen < sizeof(bind_addr)) {
+        stop_server();
+        return false;
+    }
+    memcpy(&bind_addr, addr, sizeof(bind_addr));
+
+    for (unsigned int i = 0; i < wanted_shards; i++) {
+        num_shards = i + 1;
+        if (!init_shard(&shards[i], (struct sockaddr *) &bind_addr, sizeof(bind_addr), wanted_shards > 1, slots_per_shard, options)) {
+            stop_server();
+            return false;
+        }
+
+        socklen_t bound_len = sizeof(bind_addr);
+        if (-1 == getsockname(shards[i].listen_socket, (struct sockaddr *) &bind_addr, &bound_len)) {
+            stop_server();
+            return false;
+        }
+    }
+
+    // begin listening on the sockets. This has to be in shard order for steer_by_address
+    for (unsigned int i = 0; i < num_shards; i++) {
+        if (-1 == listen(shards[i].listen_socket, SOMAXCONN)) {
+            stop_server();
+            return false;
+        }
+    }
+
+    if (options->steer_by_address && (num_shards > 1) && !steer_by_address(shards[0].listen_socket, num_shards)) {
+        perror("start_server: SO_ATTACH_REUSEPORT_CBPF");
+        stop_server();
+        return false;
+    }
+
+    for (unsigned int i = 0; i < num_shards; i++) {
+        if (!start_reactor(&shards[i])) {
+            perror("start_server: reactor thread");
+            stop_server();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// takes up to max messages from one of a shard's lanes with a single claim on its ring
+static size_t read_shard_messages(Shard *shard, unsigned int lane, BufferItem **out, size_t max) {
+    size_t count;
+    if (fair_by_address) {
+        bool drained;
+        count = fair_pop_batch(&(shard->fair_lanes[lane]), (void **) out, max, &drained);
+        if (drained) {
+            wake_reactor(shard); // a node which had too much queued can be read from again
+        }
+    } else {
+        count = ring_pop_batch(&(shard->lanes[lane]), (void **) out, max);
+    }
+    if (0 == count) {
+        return 0;
+    }
+
+    // taken off the counts all at once rather than per item
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes += item_size(out[i]);
+    }
+    atomic_fetch_sub(&queued_items, count);
+    atomic_fetch_sub(&queued_bytes, bytes);
+
+    return count;
+}
+
+// takes up to max messages from one lane of every shard, starting with shard first
+static size_t read_lane(unsigned int lane, unsigned int first, BufferItem **out, size_t max) {
+    size_t count = 0;
+    for (unsigned int i = 0; (i < num_shards) && (count < max); i++) {
+        count += read_shard_messages(&shards[(first + i) % num_shards], lane, out + count, max - count);
+    }
+    return count;
+}
+
+// SERVER_PRIORITY_WEIGHTED: takes from the lane whose turn it is until it has had lane_weights of them, then moves on to the next
+// a lane which runs out passes its turn on straight away, so nobody waits while there is something to read
+static size_t read_weighted(unsigned int first, BufferItem **out, size_t max) {
+    size_t count = 0;
+    unsigned int empty = 0; // lanes in a row which had nothing
+    while ((count < max) && (empty < num_lanes)) {
+        unsigned int lane = atomic_load_explicit(&weighted_lane, memory_order_relaxed) % num_lanes;
+        unsigned int used = atomic_load_explicit(&weighted_used, memory_order_relaxed);
+        size_t allowed = (used < lane_weights[lane]) ? lane_weights[lane] - used : 0;
+        size_t wanted = (allowed < max - count) ? allowed : max - count;
+        size_t got = (0 == wanted) ? 0 : read_lane(lane, first, out + count, wanted);
+        count += got;
+        empty = (0 == got) ? empty + 1 : 0;
+
+        if ((got == wanted) && (got < allowed)) {
+            // out is full but the lane has some of its turn left for next time
+            atomic_store_explicit(&weighted_used, used + (unsigned int) got, memory_order_relaxed);
+        } else {
+            atomic_store_explicit(&weighted_used, 0, memory_order_relaxed);
+            atomic_store_explicit(&weighted_lane, (lane + 1) % num_lanes, memory_order_relaxed);
+        }
+    }
+    return count;
+}
+
+// gets up to max messages from the read queues
+// the shards are taken in turn so that a busy shard cannot starve the others. With priority lanes the lanes are chosen first
+size_t read_messages(BufferItem **out, size_t max) {
+    if ((0 == num_shards) || (0 == max) || (NULL != handler)) {
+        return 0;
+    }
+
+    unsigned int first = atomic_fetch_add_explicit(&next_read_shard, 1, memory_order_relaxed);
+    size_t count = 0;
+    if (SERVER_PRIORITY_WEIGHTED == priority) {
+        count = read_weighted(first, out, max);
+    } else {
+        // highest lane first (there is only the one lane without priority)
+        for (unsigned int lane = 0; (lane < num_lanes) && (count < max); lane++) {
+            count += read_lane(lane, first, out + count, max - count);
+        }
+    }
+
+    // checked even when there was nothing so that we can't get stuck paused
+    resume_if_drained();
+
+    // we ran out so the queues were empty
+    if ((count < max) && atomic_load_explicit(&ready_signalled, memory_order_relaxed)) {
+        clear_ready();
+    }
+    return count;
+}
+
+// gets a message from the read queues
+BufferItem *read_message(void) {
+    BufferItem *ret = NULL;
+    read_messages(&ret, 1);
+    return ret;
+}
+
+// seconds since some point, for timeouts
+static double monotonic_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// lets the CPU know that we are spinning
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// read_message until something turns up or until (a monotonic_now time)
+static BufferItem *spin_for_message(double until) {
+    do {
+        for (unsigned int i = 0; i < 64; i++) {
+            cpu_relax();
+        }
+
+        BufferItem *item = read_message();
+        if (NULL != item) {
+            return item;
+        }
+    } while (monotonic_now() < until);
+
+    return NULL;
+}
+
+// sleeps until a producer calls wake_readers or until (a monotonic_now time, or forever if negative)
+// returns a message if one turned up while we were getting ready to sleep
+static BufferItem *park_reader(double until) {
+    unsigned int seq = atomic_load(&reader_seq);
+
+    // announce that we are going to sleep and then look again, so that anything pushed from now on either is seen here or wakes us up
+    atomic_store(&readers_parked, true);
+    atomic_thread_fence(memory_order_seq_cst);
+    BufferItem *item = read_message();
+    if ((NULL != item) || atomic_load(&readers_stopped)) {
+        return item;
+    }
+
+    struct timespec timeout;
+    if (until >= 0) {
+        double remaining = until - monotonic_now();
+        if (remaining <= 0) {
+            return NULL;
+        }
+        timeout.tv_sec = (time_t) remaining;
+        timeout.tv_nsec = (long) ((remaining - (double) timeout.tv_sec) * 1E9);
+    }
+
+    // returns straight away if reader_seq has already moved on
+    syscall(SYS_futex, (void *) &reader_seq, FUTEX_WAIT_PRIVATE, seq, (until >= 0) ? &timeout : NULL, NULL, 0);
+    return NULL;
+}
+
+// read_message_wait once we are counted in waiting_readers
+static BufferItem *wait_for_message(int timeout_ms) {
+    double start = monotonic_now();
+    double until = (timeout_ms < 0) ? -1 : start + timeout_ms / 1E3;
+
+    BufferItem *item = read_message();
+    if ((NULL != item) || (0 == timeout_ms)) {
+        return item;
+    }
+
+    // spin for a bit first if that has been working out
+    unsigned int budget = atomic_load_explicit(&spin_budget_us, memory_order_relaxed);
+    if (0 != budget) {
+        double spin_until = start + budget / 1E6;
+        item = spin_for_message(((until >= 0) && (until < spin_until)) ? until : spin_until);
+        if (NULL != item) {
+            atomic_store_explicit(&spin_budget_us, (2 * budget > wait_spin_us) ? wait_spin_us : 2 * budget, memory_order_relaxed);
+            return item;
+        }
+        atomic_store_explicit(&spin_budget_us, budget / 2, memory_order_relaxed);
+    }
+
+    while (!atomic_load(&readers_stopped)) {
+        if (NULL == item) {
+            item = park_reader(until);
+        }
+        if (NULL == item) {
+            item = read_message();
+        }
+
+        if (NULL != item) {
+            // had we spun for a little longer we would have got this without sleeping
+            if ((0 != wait_spin_us) && (monotonic_now() - start < wait_spin_us / 1E6)) {
+                budget = atomic_load_explicit(&spin_budget_us, memory_order_relaxed);
+                atomic_store_explicit(&spin_budget_us, (2 * budget + 1 > wait_spin_us) ? wait_spin_us : 2 * budget + 1, memory_order_relaxed);
+            }
+            return item;
+        }
+
+        if ((until >= 0) && (monotonic_now() >= until)) {
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+// like read_message but waits up to timeout_ms milliseconds (forever if negative) for a message
+BufferItem *read_message_wait(int timeout_ms) {
+    // either stop_server sees us here and waits, or we see that it has been called
+    atomic_fetch_add(&waiting_readers, 1);
+    BufferItem *item = atomic_load(&readers_stopped) ? NULL : wait_for_message(timeout_ms);
+    atomic_fetch_sub(&waiting_readers, 1);
+    return item;
+}
+
+// an fd which polls readable while there are messages for read_message
+int server_ready_fd(void) {
+    return ready_fd;
+}
+
+// free a BufferItem (wrapper function incase it contains anyting that needs freeing interneally)
+void free_bufferitem(BufferItem *item) {
+    if (is_inline_item(item)) {
+        pool_free(item, inline_item_pool); // the text goes with it
+        return;
+    }
+
+    if (NULL != item->arena) {
+        arena_unref(item->arena); // the text is in there
+    } else {
+        free_message(&(item->msg));
+    }
+    pool_free(item, item_pool);
+}
+
+// frees what read_messages returned
+void free_bufferitems(BufferItem **items, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free_bufferitem(items[i]);
+    }
+}
+
+// closes a connection and frees what it holds so that its slot can be reused
+static void release_connection(ConnectionData *condata) {
+    atomic_store_explicit(&(condata->in_use), false, memory_order_release);
+    close(condata->fd);
+    recv_buffer_free(&(condata->recv));
+    if (condata->paused) {
+        atomic_fetch_sub(&paused_connections, 1);
+    }
+}
+
+// wakes up a shard's reactor thread and waits for it to exit
+static void stop_reactor(Shard *shard) {
+    if (!shard->reactor_running) {
+        return;
+    }
+
+    atomic_store(&(shard->stopping), true);
+    uint64_t one = 1;
+    if (sizeof(one) != write(shard->wakeup_fd, &one, sizeof(one))) {
+        perror("Couldn't wake up the reactor");
+        pthread_cancel(shard->reactor_thread);
+    }
+
+    pthread_join(shard->reactor_thread, NULL);
+    shard->reactor_running = false;
+}
+
+// frees everything belonging to a shard. The reactor must already be stopped
+static void stop_shard(Shard *shard) {
+    // this cancels any outstanding requests
+    if (shard->use_uring) {
+        uring_free(&(shard->ring));
+        shard->use_uring = false;
+    }
+
+    if (-1 != shard->epoll_fd) {
+        close(shard->epoll_fd);
+        shard->epoll_fd = -1;
+    }
+
+    if (-1 != shard->wakeup_fd) {
+        close(shard->wakeup_fd);
+        shard->wakeup_fd = -1;
+    }
+
+    // close the open socket
+    if (-1 != shard->listen_socket) {
+        close(shard->listen_socket);
+        shard->listen_socket = -1;
+    }
+
+    // free up the connection table and close all the active connections
+    if (shard->slots) {
+        for (unsigned int i = 0; i < shard->num_slots; i++) {
+            ConnectionData *condata = &(shard->slots[i]);
+            if (atomic_load(&(condata->in_use))) {
+                connections_by_fd[condata->fd] = NULL;
+                close(condata->fd);
+                recv_buffer_free(&(condata->recv));
+            }
+        }
+        epoch_limbo_drain(&(shard->retired)); // nothing else looks at them by now
+        free(shard->slots);
+        shard->slots = NULL;
+        shard->num_slots = 0;
+        shard->free_slots = NULL;
+        atomic_store(&(shard->num_connections), 0);
+    }
+
+    if (shard->paused) {
+        g_queue_free(shard->paused);
+        shard->paused = NULL;
+    }
+    if (shard->throttled) {
+        g_queue_free(shard->throttled);
+        shard->throttled = NULL;
+    }
+
+    // free up the queue and anything still in it
+    for (unsigned int i = 0; i < SERVER_NUM_LANES; i++) {
+        if (shard->lanes[i].cells) {
+            BufferItem *item;
+            while (NULL != (item = ring_pop(&(shard->lanes[i])))) {
+                free_bufferitem(item);
+            }
+            ring_free(&(shard->lanes[i]));
+        }
+        if (shard->fair_lanes[i].flows) {
+            BufferItem *item;
+            while (NULL != (item = fair_pop(&(shard->fair_lanes[i])))) {
+                free_bufferitem(item);
+            }
+            fair_free(&(shard->fair_lanes[i]));
+        }
+    }
+
+    if (shard->overflow) {
+        g_queue_free_full(shard->overflow, (GDestroyNotify) free_bufferitem);
+        shard->overflow = NULL;
+    }
+
+    // repeats which were waiting for their window to end
+    if (shard->coalescer.entries) {
+        coalesce_free(&(shard->coalescer), (void (*)(void *)) free_bufferitem);
+    }
+    if (-1 != shard->timer_fd) {
+        close(shard->timer_fd);
+        shard->timer_fd = -1;
+    }
+
+    decode_scratch_free(&(shard->scratch));
+
+    // the reactor didn't get to hand these over
+    free_bufferitems(shard->handled, shard->num_handled);
+    shard->num_handled = 0;
+}
+
+// stops the server (also used to clean up after start_server fails part of the way through)
+void stop_server(void) {
+    // anyone in read_message_wait gives up
+    atomic_store(&readers_stopped, true);
+    atomic_fetch_add(&reader_seq, 1);
+    syscall(SYS_futex, (void *) &reader_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    while (0 != atomic_load(&waiting_readers)) {
+        sched_yield(); // they could still be looking at the queues
+    }
+
+    // stop handling IO: after this nothing else touches the connections or read buffers
+    for (unsigned int i = 0; i < num_shards; i++) {
+        stop_reactor(&shards[i]);
+    }
+
+    for (unsigned int i = 0; i < num_shards; i++) {
+        stop_shard(&shards[i]);
+    }
+
+    free(shards);
+    shards = NULL;
+    num_shards = 0;
+
+    free(connections_by_fd);
+    connections_by_fd = NULL;
+    max_fds = 0;
+
+    if (-1 != ready_fd) {
+        close(ready_fd);
+        ready_fd = -1;
+    }
 }
\ No newline at end of file
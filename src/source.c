@@ -0,0 +1,91 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * source.c
+ * A GSource which hands received messages to a GLib main loop (see edsac_source.h)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_source.h"
+#include <stdlib.h>
+
+// a GSource with what we need tacked on the end
+typedef struct {
+    GSource source;
+    GPollFD poll;
+    size_t batch;
+    BufferItem **items; // room for batch messages
+} ServerSource;
+
+// wait for server_ready_fd. It is looked up every time round so that the source carries on after the server is restarted
+// (while the server is stopped it is -1, which poll ignores)
+static gboolean source_prepare(GSource *source, gint *timeout) {
+    ServerSource *server_source = (ServerSource *) source;
+    server_source->poll.fd = server_ready_fd();
+    *timeout = -1;
+    return FALSE;
+}
+
+static gboolean source_check(GSource *source) {
+    ServerSource *server_source = (ServerSource *) source;
+    return 0 != (server_source->poll.revents & G_IO_IN);
+}
+
+// reads up to a batch of messages and hands them to the callback
+// if there are more than that then server_ready_fd is still readable so we will be back next time round the main loop
+static gboolean source_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
+    ServerSource *server_source = (ServerSource *) source;
+
+    size_t count = read_messages(server_source->items, server_source->batch);
+    if (0 == count) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    if (NULL == callback) {
+        free_bufferitems(server_source->items, count);
+        return G_SOURCE_CONTINUE;
+    }
+
+    // cast through a generic function pointer like G_SOURCE_FUNC does
+    return ((ServerSourceFunc) (void (*)(void)) callback)(server_source->items, count, user_data);
+}
+
+static void source_finalize(GSource *source) {
+    ServerSource *server_source = (ServerSource *) source;
+    free(server_source->items);
+}
+
+static GSourceFuncs source_funcs = {
+    .prepare = source_prepare,
+    .check = source_check,
+    .dispatch = source_dispatch,
+    .finalize = source_finalize,
+};
+
+GSource *server_source_new(size_t batch) {
+    int fd = server_ready_fd();
+    if (-1 == fd) {
+        return NULL;
+    }
+    if (0 == batch) {
+        batch = SERVER_SOURCE_DEFAULT_BATCH;
+    }
+
+    BufferItem **items = malloc(batch * sizeof(BufferItem *));
+    if (NULL == items) {
+        return NULL;
+    }
+
+    GSource *source = g_source_new(&source_funcs, sizeof(ServerSource));
+    ServerSource *server_source = (ServerSource *) source;
+    server_source->batch = batch;
+    server_source->items = items;
+    server_source->poll.fd = fd;
+    server_source->poll.events = G_IO_IN;
+    server_source->poll.revents = 0;
+    g_source_add_poll(source, &(server_source->poll));
+    g_source_set_name(source, "edsac server");
+
+    return source;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/arena.c
+ * system test for SERVER_DECODE_ARENA and SERVER_DECODE_ZERO_COPY: the text of messages from one read shares an arena which outlives the server if it has to
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "edsac_arena.h"
+#include "common.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+
+#define NUM_MESSAGES 300 // of each kind
+
+static void test_arena(ServerDecode decode, ServerBackend backend, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.backend = backend;
+    options.decode = decode;
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    // every kind of message, a keep alive and something which isn't a message, all in one go
+    char *burst = malloc(NUM_MESSAGES * 3 * MAX_ENCODED_LEN + 1000);
+    assert(NULL != burst);
+    size_t len = 0;
+    Message msg;
+    for (int i = 0; i < NUM_MESSAGES; i++) {
+        hardware_error_valve(&msg, i, "valve \"broke\"");
+        len += append(burst + len, &msg);
+        hardware_error_other(&msg, "hardware broke");
+        len += append(burst + len, &msg);
+        software_error(&msg, "software broke");
+        len += append(burst + len, &msg);
+    }
+    keep_alive(&msg);
+    len += append(burst + len, &msg);
+    const char *junk = "{\"version\":1}";
+    memcpy(burst + len, junk, strlen(junk));
+    len += strlen(junk);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    assert((ssize_t) len == write(fd, burst, len));
+
+    // 3 messages of each, the decode error and the close
+    size_t expected = NUM_MESSAGES * 3 + 2;
+    BufferItem **items = malloc(expected * sizeof(BufferItem *));
+    assert(NULL != items);
+    close(fd);
+    size_t received = 0;
+    for (unsigned int i = 0; (i < 5000) && (received < expected); i++) {
+        size_t count = read_messages(items + received, expected - received);
+        if (0 == count) {
+            usleep(1000);
+        }
+        received += count;
+    }
+    assert(expected == received);
+
+    for (size_t i = 0; i < NUM_MESSAGES * 3; i++) {
+        Message *m = &(items[i]->msg);
+        switch (i % 3) {
+            case 0:
+                assert(HARD_ERROR_VALVE == m->type);
+                assert((int) i / 3 == m->data.hardware_valve.valve_no);
+                assert(0 == strcmp("valve \"broke\"", m->data.hardware_valve.message->str));
+                break;
+            case 1:
+                assert(HARD_ERROR_OTHER == m->type);
+                assert(0 == strcmp("hardware broke", m->data.hardware_other.message->str));
+                break;
+            default:
+                assert(SOFT_ERROR == m->type);
+                assert(0 == strcmp("software broke", m->data.software.message->str));
+                break;
+        }
+        assert(NULL != items[i]->arena);
+    }
+    assert(0 == strcmp("Could not decode message", items[expected - 2]->msg.data.software.message->str));
+    assert(0 == strcmp("Connection closed", items[expected - 1]->msg.data.software.message->str));
+    assert(NULL == items[expected - 1]->arena); // not decoded from anything
+
+    // free them out of order, some after the server has gone
+    for (size_t i = 0; i < expected; i += 2) {
+        free_bufferitem(items[i]);
+    }
+    stop_server();
+    for (size_t i = 1; i < expected; i += 2) {
+        free_bufferitem(items[i]);
+    }
+
+    free(items);
+    free(burst);
+    free(addr);
+}
+
+int main(void) {
+    test_arena(SERVER_DECODE_ARENA, SERVER_BACKEND_EPOLL, 2014);
+    test_arena(SERVER_DECODE_ARENA, SERVER_BACKEND_IO_URING, 2015);
+    test_arena(SERVER_DECODE_ZERO_COPY, SERVER_BACKEND_EPOLL, 2017);
+    test_arena(SERVER_DECODE_ZERO_COPY, SERVER_BACKEND_IO_URING, 2018);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/coalesce.c
+ * Testsuite for coalesce.c
+ */
+
+#include "config.h"
+#include "edsac_coalesce.h"
+#include <stdlib.h> // EXIT_*
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+// values are small integers (+ 1 so that none are NULL)
+#define VALUE(_i) ((void *) (uintptr_t) ((_i) + 1))
+
+static CoalesceKey key(uint32_t address, int type, int valve_no, const char *text) {
+    CoalesceKey ret = {address, type, valve_no, text, strlen(text)};
+    return ret;
+}
+
+static void test_window(void) {
+    Coalescer coalescer;
+    assert(coalesce_init(&coalescer, 100));
+    assert(0 == coalesce_next_deadline(&coalescer));
+
+    // the first is passed on. The key's text doesn't have to stay around
+    char text[] = "valve 3 broke";
+    CoalesceKey first = key(1, 0, 3, text);
+    assert(NULL == coalesce_add(&coalescer, &first, VALUE(0), 1000));
+    memset(text, 'x', strlen(text));
+    assert(1100 == coalesce_next_deadline(&coalescer));
+
+    // the copies are folded into the first of them
+    CoalesceKey valve = key(1, 0, 3, "valve 3 broke");
+    assert(VALUE(1) == coalesce_add(&coalescer, &valve, VALUE(1), 1010));
+    assert(VALUE(1) == coalesce_add(&coalescer, &valve, VALUE(2), 1020));
+    assert(VALUE(1) == coalesce_add(&coalescer, &valve, VALUE(3), 1030));
+
+    // anything different is a different message
+    CoalesceKey others[] = {key(2, 0, 3, "valve 3 broke"), key(1, 1, 3, "valve 3 broke"), key(1, 0, 4, "valve 3 broke"), key(1, 0, 3, "valve 3 broke!")};
+    for (unsigned int i = 0; i < 4; i++) {
+        assert(NULL == coalesce_add(&coalescer, &others[i], VALUE(10 + i), 1050));
+    }
+    assert(5 == coalesce_size(&coalescer));
+
+    // nothing comes out before the window ends
+    void *values[8];
+    assert(0 == coalesce_expire(&coalescer, 1099, values, 8));
+    assert(1 == coalesce_expire(&coalescer, 1100, values, 8));
+    assert(VALUE(1) == values[0]);
+    assert(1150 == coalesce_next_deadline(&coalescer)); // the others
+
+    // the storm carries on in another window
+    assert(VALUE(4) == coalesce_add(&coalescer, &valve, VALUE(4), 1120));
+    // the others didn't repeat so they are forgotten
+    assert(0 == coalesce_expire(&coalescer, 1150, values, 8));
+    assert(1 == coalesce_size(&coalescer));
+    assert(1 == coalesce_expire(&coalescer, 1200, values, 8));
+    assert(VALUE(4) == values[0]);
+
+    // and then stops
+    assert(0 == coalesce_expire(&coalescer, 1300, values, 8));
+    assert(0 == coalesce_size(&coalescer));
+    assert(0 == coalesce_next_deadline(&coalescer));
+    assert(NULL == coalesce_add(&coalescer, &valve, VALUE(5), 1400));
+
+    coalesce_free(&coalescer, NULL);
+}
+
+static unsigned int released = 0;
+
+static void release(void *value) {
+    assert(NULL != value);
+    released += 1;
+}
+
+// a storm from lots of nodes at once
+static void test_many(void) {
+    Coalescer coalescer;
+    assert(coalesce_init(&coalescer, 10));
+
+    for (unsigned int round = 0; round < 100; round++) {
+        for (uint32_t node = 0; node < 1000; node++) {
+            CoalesceKey storm = key(node, 2, 0, "Could not decode message");
+            void *held = coalesce_add(&coalescer, &storm, VALUE(node), round);
+            assert((0 == round) ? (NULL == held) : (VALUE(node) == held));
+        }
+    }
+    assert(1000 == coalesce_size(&coalescer));
+
+    // what hasn't come out yet is released
+    void *values[600];
+    assert(600 == coalesce_expire(&coalescer, 100, values, 600));
+    for (unsigned int i = 0; i < 600; i++) {
+        assert(VALUE(i) == values[i]);
+    }
+    coalesce_free(&coalescer, release);
+    assert(400 == released);
+}
+
+int main(void) {
+    test_window();
+    test_many();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/common.h
+ * Helpers shared by the system tests
+ */
+
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+// includes
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// declarations
+
+// seconds since some point
+__attribute__((unused)) static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1E9;
+}
+
+// appends an encoded message to buf, freeing the message
+__attribute__((unused)) static size_t append(char *buf, Message *msg) {
+    char *encoded = NULL;
+    ssize_t len = encode_message(msg, &encoded);
+    assert(len > 0);
+    memcpy(buf, encoded, (size_t) len);
+    free(encoded);
+    free_message(msg);
+    return (size_t) len;
+}
+
+// waits until the server has queued count messages
+__attribute__((unused)) static void wait_for_queued(size_t count) {
+    IngressStats stats;
+    for (unsigned int i = 0; i < 5000; i++) {
+        server_ingress_stats(&stats);
+        if (stats.queued_items >= count) {
+            return;
+        }
+        usleep(1000);
+    }
+    assert(false);
+}
+
+// connects to the server from the loopback address ip, so that each client can look like a different node
+__attribute__((unused)) static int connect_from(const char *ip, const struct sockaddr *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    assert(1 == inet_pton(AF_INET, ip, &(local.sin_addr)));
+    assert(0 == bind(fd, (struct sockaddr *) &local, sizeof(local)));
+
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    return fd;
+}
+
+#endif // TEST_COMMON_H
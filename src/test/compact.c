@@ -0,0 +1,92 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/compact.c
+ * system test for CompactMessages and SERVER_DECODE_INLINE: the text goes in the same block of memory as the BufferItem
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_sending.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+
+#define NUM_MESSAGES 1000
+
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2016);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.decode = SERVER_DECODE_INLINE;
+    assert(start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+    assert(start_sending(addr, sizeof(struct sockaddr_in)));
+
+    // compact messages are sent without allocating. The server doesn't mind which kind it gets
+    CompactMessage compact;
+    for (int i = 0; i < NUM_MESSAGES; i++) {
+        compact_hardware_error_valve(&compact, i, "valve \"broke\"");
+        assert(send_compact_message(&compact));
+    }
+    stop_sending();
+
+    // send_message can't send anything that long (it stops at MAX_ENCODED_LEN), so write it ourselves
+    char long_text[2 * MAX_MSG_LEN];
+    memset(long_text, 'a', sizeof(long_text) - 1);
+    long_text[sizeof(long_text) - 1] = '\0';
+    Message msg;
+    software_error(&msg, long_text);
+    char *encoded = NULL;
+    assert(-1 != encode_message(&msg, &encoded));
+    size_t len = strlen(encoded); // encode_message's length stops at MAX_ENCODED_LEN
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    assert((ssize_t) len == write(fd, encoded, len));
+    close(fd);
+    free(encoded);
+    free_message(&msg);
+
+    for (int i = 0; i < NUM_MESSAGES; i++) {
+        BufferItem *item = read_message_wait(1000);
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        assert(i == item->msg.data.hardware_valve.valve_no);
+        GString *text = item->msg.data.hardware_valve.message;
+        assert(0 == strcmp("valve \"broke\"", text->str));
+        // right after the item
+        assert((text->str > (char *) item) && (text->str < (char *) item + sizeof(BufferItem) + MAX_MSG_LEN));
+        free_bufferitem(item);
+    }
+
+    // the long one is cut short, even though it was sent in full. The connections closing could come first
+    unsigned int closed = 0;
+    unsigned int cut_short = 0;
+    for (unsigned int i = 0; i < 3; i++) {
+        BufferItem *item = read_message_wait(1000);
+        assert(NULL != item);
+        GString *text = item->msg.data.software.message;
+        if (0 == strcmp("Connection closed", text->str)) {
+            closed += 1;
+        } else {
+            assert(MAX_MSG_LEN == text->len);
+            assert(MAX_MSG_LEN == strlen(text->str));
+            cut_short += 1;
+        }
+        free_bufferitem(item);
+    }
+    assert((2 == closed) && (1 == cut_short));
+
+    stop_server();
+    free(addr);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
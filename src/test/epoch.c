@@ -0,0 +1,155 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/epoch.c
+ * Testsuite for epoch.c
+ */
+
+#include "config.h"
+#include "edsac_epoch.h"
+#include <stdlib.h> // EXIT_*
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+// something like a connection slot
+typedef struct Slot {
+    EpochNode retired; // first so that the node can be turned back into its slot
+    atomic_bool in_use;
+    atomic_uint value; // changes each time the slot is reused
+    struct Slot *next_free;
+} Slot;
+
+static EpochDomain domain;
+static Slot *free_slots = NULL;
+
+static void reclaim_slot(EpochNode *node, __attribute__((unused)) void *arg) {
+    Slot *slot = (Slot *) (void *) node;
+    slot->next_free = free_slots;
+    free_slots = slot;
+}
+
+static void test_single_thread(void) {
+    epoch_domain_init(&domain);
+    EpochLimbo limbo;
+    epoch_limbo_init(&limbo, reclaim_slot, NULL);
+    Slot slot;
+    free_slots = NULL;
+
+    // nothing is reclaimed while someone who could have seen it is reading
+    EpochRecord *reader = epoch_enter(&domain);
+    epoch_retire(&domain, &limbo, &(slot.retired));
+    assert(0 == epoch_reclaim(&domain, &limbo));
+    assert(0 == epoch_reclaim(&domain, &limbo));
+    assert(NULL == free_slots);
+    epoch_exit(reader);
+
+    assert(1 == epoch_reclaim(&domain, &limbo));
+    assert(&slot == free_slots);
+    assert(0 == limbo.count);
+
+    // a reader who starts after the retire doesn't hold it up for long: they can't see it
+    free_slots = NULL;
+    epoch_retire(&domain, &limbo, &(slot.retired));
+    reader = epoch_enter(&domain);
+    epoch_reclaim(&domain, &limbo);
+    epoch_exit(reader);
+    epoch_reclaim(&domain, &limbo);
+    assert(&slot == free_slots);
+
+    // draining doesn't wait
+    free_slots = NULL;
+    reader = epoch_enter(&domain);
+    epoch_retire(&domain, &limbo, &(slot.retired));
+    epoch_limbo_drain(&limbo);
+    assert(&slot == free_slots);
+    epoch_exit(reader);
+}
+
+#define NUM_SLOTS 16
+#define NUM_READERS 4
+#define NUM_ROUNDS 200000
+
+static Slot slots[NUM_SLOTS];
+static atomic_bool done = false;
+
+// keeps looking at the slots. Whatever was in a slot when we first saw it mustn't change until we finish reading
+static void *reader_thread(__attribute__((unused)) void *arg) {
+    while (!atomic_load(&done)) {
+        EpochRecord *record = epoch_enter(&domain);
+
+        unsigned int seen[NUM_SLOTS];
+        for (unsigned int i = 0; i < NUM_SLOTS; i++) {
+            seen[i] = atomic_load_explicit(&(slots[i].in_use), memory_order_acquire) ? atomic_load_explicit(&(slots[i].value), memory_order_relaxed) : 0;
+        }
+        for (unsigned int i = 0; i < NUM_SLOTS; i++) {
+            assert((0 == seen[i]) || (seen[i] == atomic_load_explicit(&(slots[i].value), memory_order_relaxed)));
+        }
+
+        epoch_exit(record);
+    }
+
+    return NULL;
+}
+
+// one writer keeps reusing the slots while the readers look at them
+static void test_threads(void) {
+    epoch_domain_init(&domain);
+    EpochLimbo limbo;
+    epoch_limbo_init(&limbo, reclaim_slot, NULL);
+
+    free_slots = NULL;
+    for (unsigned int i = 0; i < NUM_SLOTS; i++) {
+        atomic_init(&(slots[i].in_use), false);
+        atomic_init(&(slots[i].value), 0);
+        slots[i].next_free = free_slots;
+        free_slots = &slots[i];
+    }
+
+    pthread_t readers[NUM_READERS];
+    for (unsigned int i = 0; i < NUM_READERS; i++) {
+        assert(0 == pthread_create(&readers[i], NULL, reader_thread, NULL));
+    }
+
+    Slot *used[NUM_SLOTS];
+    unsigned int num_used = 0;
+    unsigned int value = 1;
+    for (unsigned int round = 0; round < NUM_ROUNDS; round++) {
+        // let the readers catch up if they are holding everything up
+        if ((NULL == free_slots) && (0 == epoch_reclaim(&domain, &limbo))) {
+            sched_yield();
+        }
+
+        // take a slot if we can, otherwise give one back
+        if ((NULL != free_slots) && (num_used < NUM_SLOTS / 2)) {
+            Slot *slot = free_slots;
+            free_slots = slot->next_free;
+            atomic_store_explicit(&(slot->value), value++, memory_order_relaxed);
+            atomic_store_explicit(&(slot->in_use), true, memory_order_release);
+            used[num_used++] = slot;
+        } else if (num_used > 0) {
+            Slot *slot = used[--num_used];
+            atomic_store_explicit(&(slot->in_use), false, memory_order_release);
+            epoch_retire(&domain, &limbo, &(slot->retired));
+        }
+    }
+
+    atomic_store(&done, true);
+    for (unsigned int i = 0; i < NUM_READERS; i++) {
+        assert(0 == pthread_join(readers[i], NULL));
+    }
+
+    // with no readers left everything comes back
+    epoch_reclaim(&domain, &limbo);
+    assert(0 == limbo.count);
+    printf("%u slots used\n", value - 1);
+}
+
+int main(void) {
+    test_single_thread();
+    test_threads();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
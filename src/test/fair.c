@@ -0,0 +1,168 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/fair.c
+ * Testsuite for fair.c
+ */
+
+#include "config.h"
+#include "edsac_fair.h"
+#include <stdlib.h> // EXIT_*
+#include <stdio.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+// values are small integers: flow * 1000 + position in the flow (+ 1 so that none are NULL)
+#define VALUE(_flow, _i) ((void *) (uintptr_t) ((_flow) * 1000 + (_i) + 1))
+#define FLOW_OF(_value) (((uintptr_t) (_value) - 1) / 1000)
+#define POSITION_OF(_value) (((uintptr_t) (_value) - 1) % 1000)
+
+static void test_turns(void) {
+    FairQueue queue;
+    assert(fair_init(&queue, 100, 1, 0));
+    assert(NULL == fair_pop(&queue));
+
+    // flow 1 gets there first with the most, but with equal costs the flows just take turns
+    for (unsigned int i = 0; i < 5; i++) {
+        assert(fair_push(&queue, 1, VALUE(1, i), 1));
+    }
+    assert(fair_push(&queue, 2, VALUE(2, 0), 1));
+    assert(fair_push(&queue, 2, VALUE(2, 1), 1));
+    assert(fair_push(&queue, 3, VALUE(3, 0), 1));
+    assert(8 == fair_size(&queue));
+    assert(5 == fair_flow_size(&queue, 1));
+
+    const void *expected[] = {VALUE(1, 0), VALUE(2, 0), VALUE(3, 0), VALUE(1, 1), VALUE(2, 1), VALUE(1, 2), VALUE(1, 3), VALUE(1, 4)};
+    for (unsigned int i = 0; i < 8; i++) {
+        assert(expected[i] == fair_pop(&queue));
+    }
+    assert(NULL == fair_pop(&queue));
+    assert(0 == fair_size(&queue));
+    assert(0 == fair_flow_size(&queue, 1));
+
+    fair_free(&queue);
+}
+
+static void test_costs(void) {
+    FairQueue queue;
+    assert(fair_init(&queue, 100, 100, 0));
+
+    // flow 1's values cost twice as much so it gets half as many per turn
+    for (unsigned int i = 0; i < 10; i++) {
+        assert(fair_push(&queue, 1, VALUE(1, i), 100));
+        assert(fair_push(&queue, 2, VALUE(2, i), 50));
+    }
+    void *values[20];
+    assert(9 == fair_pop_batch(&queue, values, 9, NULL));
+    unsigned int counts[3] = {0, 0, 0};
+    for (unsigned int i = 0; i < 9; i++) {
+        counts[FLOW_OF(values[i])] += 1;
+    }
+    assert((3 == counts[1]) && (6 == counts[2]));
+
+    // a value which costs more than a turn's credit waits until the flow has saved up enough
+    assert(11 == fair_pop_batch(&queue, values, 20, NULL));
+    assert(fair_push(&queue, 1, VALUE(1, 0), 250));
+    assert(fair_push(&queue, 2, VALUE(2, 0), 100));
+    assert(fair_push(&queue, 2, VALUE(2, 1), 100));
+    assert(fair_push(&queue, 2, VALUE(2, 2), 100));
+    assert(4 == fair_pop_batch(&queue, values, 20, NULL));
+    assert((VALUE(2, 0) == values[0]) && (VALUE(2, 1) == values[1]) && (VALUE(1, 0) == values[2]) && (VALUE(2, 2) == values[3]));
+
+    fair_free(&queue);
+}
+
+static void test_limits(void) {
+    FairQueue queue;
+    assert(fair_init(&queue, 40, 1, 4));
+
+    // full
+    for (unsigned int i = 0; i < 40; i++) {
+        assert(fair_push(&queue, i % 2, VALUE(i % 2, i / 2), 1));
+    }
+    assert(!fair_push(&queue, 5, VALUE(5, 0), 1));
+
+    // watching
+    assert(!fair_watch(&queue, 0, 21));
+    assert(!fair_watch(&queue, 7, 1));
+    assert(fair_watch(&queue, 0, 20));
+    bool drained = true;
+    void *values[40];
+    assert(30 == fair_pop_batch(&queue, values, 30, &drained));
+    assert(!drained); // 5 are left
+    assert(2 == fair_pop_batch(&queue, values, 2, &drained));
+    assert(drained);
+    assert(2 == fair_pop_batch(&queue, values, 2, &drained));
+    assert(!drained); // only reported once
+
+    // flows come and go
+    assert(6 == fair_pop_batch(&queue, values, 40, NULL));
+    for (unsigned int round = 0; round < 1000; round++) {
+        assert(fair_push(&queue, round, VALUE(round % 10, 0), 1));
+        assert(VALUE(round % 10, 0) == fair_pop(&queue));
+    }
+
+    fair_free(&queue);
+}
+
+#define NUM_PRODUCERS 4
+#define NUM_PER_PRODUCER 200000
+#define FLOWS_PER_PRODUCER 4
+
+static FairQueue shared;
+
+// pushes NUM_PER_PRODUCER values over its own flows, each flow in order
+static void *producer(void *arg) {
+    uintptr_t id = (uintptr_t) arg;
+    unsigned int next[FLOWS_PER_PRODUCER] = {0};
+    for (unsigned int i = 0; i < NUM_PER_PRODUCER; i++) {
+        unsigned int flow = i % FLOWS_PER_PRODUCER;
+        uint32_t key = (uint32_t) (id * FLOWS_PER_PRODUCER + flow);
+        void *value = VALUE(key, next[flow] % 1000);
+        while (!fair_push(&shared, key, value, 1 + next[flow] % 3)) {
+            sched_yield();
+        }
+        next[flow] += 1;
+    }
+    return NULL;
+}
+
+// one consumer sees every flow in order while producers push at the same time
+static void test_threads(void) {
+    assert(fair_init(&shared, 1000, 2, 0));
+
+    pthread_t producers[NUM_PRODUCERS];
+    for (uintptr_t i = 0; i < NUM_PRODUCERS; i++) {
+        assert(0 == pthread_create(&producers[i], NULL, producer, (void *) i));
+    }
+
+    unsigned int next[NUM_PRODUCERS * FLOWS_PER_PRODUCER] = {0};
+    size_t received = 0;
+    void *values[64];
+    while (received < NUM_PRODUCERS * NUM_PER_PRODUCER) {
+        size_t count = fair_pop_batch(&shared, values, 64, NULL);
+        for (size_t i = 0; i < count; i++) {
+            uintptr_t flow = FLOW_OF(values[i]);
+            assert(next[flow] % 1000 == POSITION_OF(values[i]));
+            next[flow] += 1;
+        }
+        received += count;
+    }
+
+    for (unsigned int i = 0; i < NUM_PRODUCERS; i++) {
+        assert(0 == pthread_join(producers[i], NULL));
+    }
+    assert(0 == fair_size(&shared));
+    fair_free(&shared);
+}
+
+int main(void) {
+    test_turns();
+    test_costs();
+    test_limits();
+    test_threads();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
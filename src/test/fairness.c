@@ -0,0 +1,134 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/fairness.c
+ * system test for ServerOptions.fair_by_address: nodes take turns and a busy node is held back on its own
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "common.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define HOT_VALVES 100 // valve numbers from here on come from the quiet node
+
+static size_t queued(void) {
+    IngressStats stats;
+    server_ingress_stats(&stats);
+    return stats.queued_items;
+}
+
+// sends valve alarms first to first + count - 1, all the same size
+static void send_valves(int fd, int first, int count) {
+    for (int i = first; i < first + count; i++) {
+        Message msg;
+        hardware_error_valve(&msg, i, "valve broke");
+        char *encoded = NULL;
+        ssize_t len = encode_message(&msg, &encoded);
+        assert(len > 0);
+        assert(len == write(fd, encoded, (size_t) len));
+        free(encoded);
+        free_message(&msg);
+    }
+}
+
+static struct sockaddr *start(uint16_t port, size_t quantum, size_t limit) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.fair_by_address = true;
+    options.fair_quantum = quantum;
+    options.node_queue_limit = limit;
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+    return addr;
+}
+
+// the quiet node's messages don't wait behind everything the hot node sent first
+static void test_turns(void) {
+    struct sockaddr *addr = start(2022, 1, 0); // a quantum smaller than any message: one message per turn
+
+    int hot = connect_from("127.0.0.2", addr);
+    send_valves(hot, 0, 20);
+    wait_for_queued(20);
+    int quiet = connect_from("127.0.0.3", addr);
+    send_valves(quiet, HOT_VALVES, 5);
+    wait_for_queued(25);
+
+    for (int i = 0; i < 25; i++) {
+        BufferItem *item = read_message();
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        int valve = item->msg.data.hardware_valve.valve_no;
+        if (i < 10) {
+            // turn about while both have something queued
+            assert(valve == ((i % 2) ? HOT_VALVES + i / 2 : i / 2));
+            assert(inet_addr((i % 2) ? "127.0.0.3" : "127.0.0.2") == item->address.s_addr);
+        } else {
+            assert(valve == i - 5);
+        }
+        free_bufferitem(item);
+    }
+    assert(NULL == read_message());
+
+    close(hot);
+    close(quiet);
+    stop_server();
+    free(addr);
+}
+
+// a node with node_queue_limit messages queued isn't read from until read_message takes it down. Other nodes carry on
+static void test_limit(void) {
+    struct sockaddr *addr = start(2023, 1024, 8);
+
+    int hot = connect_from("127.0.0.2", addr);
+    send_valves(hot, 0, 40);
+    wait_for_queued(8);
+    usleep(50000);
+    assert(8 == queued());
+
+    int quiet = connect_from("127.0.0.3", addr);
+    send_valves(quiet, HOT_VALVES, 3);
+    wait_for_queued(11);
+    usleep(50000);
+    assert(11 == queued());
+
+    // everything comes through in the end, still in order
+    int next_hot = 0;
+    int next_quiet = HOT_VALVES;
+    for (int i = 0; i < 43; i++) {
+        BufferItem *item = read_message_wait(5000);
+        assert(NULL != item);
+        assert(HARD_ERROR_VALVE == item->msg.type);
+        if (inet_addr("127.0.0.2") == item->address.s_addr) {
+            assert(next_hot++ == item->msg.data.hardware_valve.valve_no);
+        } else {
+            assert(next_quiet++ == item->msg.data.hardware_valve.valve_no);
+        }
+        free_bufferitem(item);
+    }
+    assert(40 == next_hot);
+    assert(HOT_VALVES + 3 == next_quiet);
+
+    close(hot);
+    close(quiet);
+    stop_server();
+    free(addr);
+}
+
+int main(void) {
+    test_turns();
+    test_limit();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
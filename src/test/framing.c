@@ -0,0 +1,242 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/framing.c
+ * Testsuite for framing.c
+ */
+
+#include "config.h"
+#include "edsac_framing.h"
+#include "edsac_arena.h"
+#include <stdlib.h> // EXIT_*
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+// finds a frame in a string in one go
+static FrameStatus find_frame_str(const char *str, size_t *start, size_t *end) {
+    FrameScanner scanner;
+    frame_scanner_reset(&scanner);
+    return find_frame(&scanner, str, strlen(str), start, end);
+}
+
+// checks that the frame in str ends after expected_len bytes
+#define EXPECT_FRAME(_str, _expected_len) \
+    assert(FRAME_FOUND == find_frame_str(_str, &start, &end)); \
+    assert(0 == start); \
+    assert(_expected_len == end);
+
+static void test_find_frame(void) {
+    size_t start, end;
+
+    // nesting
+    EXPECT_FRAME("{}", 2)
+    EXPECT_FRAME("{\"a\":{\"b\":{}}}{}", 14)
+
+    // braces in strings don't count
+    EXPECT_FRAME("{\"a\":\"}\"}", 9)
+    EXPECT_FRAME("{\"a\":\"{{\"}}", 10)
+
+    // escaped quotes don't end strings but escaped backslashes do
+    EXPECT_FRAME("{\"a\":\"\\\"}\"}", 11)
+    EXPECT_FRAME("{\"a\":\"\\\\\"}}", 10)
+    EXPECT_FRAME("{\"a\":\"\\\\\\\"}\"}", 13)
+
+    // newlines before a frame are skipped
+    assert(FRAME_FOUND == find_frame_str("\r\n\n{}", &start, &end));
+    assert(3 == start);
+    assert(5 == end);
+
+    // not finished yet
+    assert(FRAME_PARTIAL == find_frame_str("", &start, &end));
+    assert(FRAME_PARTIAL == find_frame_str("\n", &start, &end));
+    assert(FRAME_PARTIAL == find_frame_str("{\"a\":\"}", &start, &end));
+
+    // not a frame
+    assert(FRAME_INVALID == find_frame_str("[]", &start, &end));
+}
+
+// finds the end of the first frame in data after giving it to find_frame in chunks of chunk bytes
+// returns 0 if it isn't there
+static size_t find_in_chunks(const char *data, size_t len, size_t chunk) {
+    FrameScanner scanner;
+    frame_scanner_reset(&scanner);
+
+    for (size_t available = chunk; ; available += chunk) {
+        if (available > len) {
+            available = len;
+        }
+
+        size_t start, end;
+        FrameStatus status = find_frame(&scanner, data, available, &start, &end);
+        assert(FRAME_INVALID != status);
+        if (FRAME_FOUND == status) {
+            return end;
+        } else if (available == len) {
+            return 0;
+        }
+    }
+}
+
+// every scanner has to agree with the scalar one on random frames, however they arrive
+static void test_scanners_agree(void) {
+    const char alphabet[] = "{}\"\\a";
+    const FrameScanImpl impls[] = {FRAME_SCAN_SCALAR, FRAME_SCAN_SSE2, FRAME_SCAN_AVX2};
+    const size_t chunks[] = {1, 7, 64, 100, 1000};
+    char data[1000];
+
+    srand(1);
+    for (unsigned int round = 0; round < 2000; round++) {
+        size_t len = 1 + (size_t) rand() % sizeof(data);
+        data[0] = '{';
+        for (size_t i = 1; i < len; i++) {
+            // mostly letters so that frames don't end straight away
+            int r = rand() % 16;
+            data[i] = (r < 4) ? alphabet[r] : 'a';
+        }
+
+        assert(frame_scan_use(FRAME_SCAN_SCALAR));
+        size_t expected = find_in_chunks(data, len, len);
+
+        for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+            if (!frame_scan_use(impls[i])) { // not supported on this CPU
+                continue;
+            }
+            for (size_t j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+                assert(expected == find_in_chunks(data, len, chunks[j]));
+            }
+        }
+    }
+
+    assert(frame_scan_use(frame_scan_best()));
+}
+
+static void test_framing_modes(void) {
+    FrameScanner scanner;
+    frame_scanner_reset(&scanner);
+    FramingMode mode;
+    size_t start, end, preamble_len;
+
+    // working out the framing from the preamble
+    char preamble[FRAMING_PREAMBLE_LEN];
+    assert(0 == framing_preamble(FRAMING_BRACES, preamble));
+    assert(FRAME_FOUND == detect_framing("{}", 2, &mode, &preamble_len));
+    assert((FRAMING_BRACES == mode) && (0 == preamble_len));
+    assert(FRAME_FOUND == detect_framing("\n{}", 3, &mode, &preamble_len));
+    assert((FRAMING_BRACES == mode) && (0 == preamble_len));
+
+    assert(FRAMING_PREAMBLE_LEN == framing_preamble(FRAMING_NDJSON, preamble));
+    assert(FRAME_PARTIAL == detect_framing(preamble, 2, &mode, &preamble_len));
+    assert(FRAME_FOUND == detect_framing(preamble, FRAMING_PREAMBLE_LEN, &mode, &preamble_len));
+    assert((FRAMING_NDJSON == mode) && (FRAMING_PREAMBLE_LEN == preamble_len));
+
+    assert(FRAMING_PREAMBLE_LEN == framing_preamble(FRAMING_LENGTH_PREFIXED, preamble));
+    assert(FRAME_FOUND == detect_framing(preamble, FRAMING_PREAMBLE_LEN, &mode, &preamble_len));
+    assert((FRAMING_LENGTH_PREFIXED == mode) && (FRAMING_PREAMBLE_LEN == preamble_len));
+
+    assert(FRAME_INVALID == detect_framing("\0EDX", 4, &mode, &preamble_len));
+    assert(FRAME_INVALID == detect_framing("\0abc", 4, &mode, &preamble_len));
+
+    // NDJSON: blank lines are skipped and the newline (and carriage return) isn't part of the message
+    const char *ndjson = "\r\n{\"a\":\"{\"}\r\n{}";
+    assert(FRAME_FOUND == find_ndjson_frame(&scanner, ndjson, strlen(ndjson), &start, &end));
+    assert((2 == start) && (11 == end));
+    assert(FRAME_PARTIAL == find_ndjson_frame(&scanner, ndjson + 13, 2, &start, &end));
+    assert(0 == start);
+    assert(FRAME_FOUND == find_ndjson_frame(&scanner, "{}\n", 3, &start, &end));
+    assert((0 == start) && (2 == end));
+
+    // length prefixed
+    const char prefixed[] = {0, 0, 0, 2, '{', '}', 0, 0};
+    assert(FRAME_FOUND == find_length_prefixed_frame(prefixed, 6, &start, &end));
+    assert((4 == start) && (6 == end));
+    assert(FRAME_PARTIAL == find_length_prefixed_frame(prefixed, 5, &start, &end));
+    assert(FRAME_PARTIAL == find_length_prefixed_frame(prefixed, 3, &start, &end));
+    assert(FRAME_INVALID == find_length_prefixed_frame(prefixed + 4, 4, &start, &end)); // a length of 0x7B7D0000 is too big
+    assert(FRAME_INVALID == find_length_prefixed_frame("\0\0\0\0", 4, &start, &end));
+}
+
+static void test_recv_buffer(void) {
+    RecvBuffer buf;
+    recv_buffer_init(&buf);
+
+    // grows as needed
+    char block[RECV_BUFFER_INITIAL];
+    memset(block, 'a', sizeof(block));
+    assert(recv_buffer_append(&buf, block, sizeof(block)));
+    assert(recv_buffer_append(&buf, "bc", 2));
+    assert(sizeof(block) + 2 == buf.end - buf.start);
+    assert(buf.capacity >= sizeof(block) + 2);
+
+    // what is left is moved to the front to make room
+    recv_buffer_consume(&buf, sizeof(block));
+    size_t capacity = buf.capacity;
+    size_t space;
+    char *dest = recv_buffer_reserve(&buf, capacity - 2, &space);
+    assert(NULL != dest);
+    assert(capacity == buf.capacity);
+    assert(0 == strncmp(buf.data, "bc", 2));
+
+    // won't grow forever
+    assert(NULL == recv_buffer_reserve(&buf, RECV_BUFFER_MAX, &space));
+
+    // empty buffers start again at the front
+    recv_buffer_consume(&buf, 2);
+    assert(0 == buf.start);
+    assert(0 == buf.end);
+
+    recv_buffer_free(&buf);
+    assert(NULL == buf.data);
+}
+
+// bytes which someone has a reference to stay where they are
+static void test_recv_buffer_shared(void) {
+    RecvBuffer buf;
+    recv_buffer_init_shared(&buf);
+    assert(NULL == recv_buffer_share(&buf));
+
+    assert(recv_buffer_append(&buf, "abc", 3));
+    Arena *held = recv_buffer_share(&buf);
+    assert(NULL != held);
+    char *abc = buf.data;
+    recv_buffer_consume(&buf, 3);
+    assert(3 == buf.start); // not back to the front while it is held
+
+    // filling the rest of the buffer moves to a new arena, taking only what is waiting
+    char block[RECV_BUFFER_INITIAL];
+    memset(block, 'x', sizeof(block));
+    assert(recv_buffer_append(&buf, block, sizeof(block) - 10));
+    assert(recv_buffer_append(&buf, "yz", 2));
+    recv_buffer_consume(&buf, sizeof(block) - 10);
+    assert(recv_buffer_append(&buf, block, 20));
+    assert(buf.data != abc);
+    assert(0 == strncmp(buf.data, "yz", 2));
+    assert(0 == strncmp(abc, "abc", 3));
+    assert(RECV_BUFFER_INITIAL == buf.capacity);
+
+    // once nobody else holds it the buffer is reused as before
+    arena_unref(held);
+    recv_buffer_consume(&buf, 22);
+    assert(0 == buf.start);
+
+    // the arena outlives the buffer
+    assert(recv_buffer_append(&buf, "def", 3));
+    held = recv_buffer_share(&buf);
+    char *def = buf.data;
+    recv_buffer_free(&buf);
+    assert(NULL == buf.data);
+    assert(buf.shared);
+    assert(0 == strncmp(def, "def", 3));
+    arena_unref(held);
+}
+
+int main(void) {
+    test_find_frame();
+    test_scanners_agree();
+    test_framing_modes();
+    test_recv_buffer();
+    test_recv_buffer_shared();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
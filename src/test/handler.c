@@ -0,0 +1,108 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/handler.c
+ * system test for ServerOptions.handler: messages go straight to the handler on the reactor threads and nothing is queued
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define NUM_CLIENTS 4
+#define NUM_MESSAGES 1000 // per client
+
+typedef struct {
+    atomic_uint messages;
+    atomic_uint disconnects;
+    atomic_uint calls;
+    pthread_t main_thread;
+} Handled;
+
+static void on_messages(BufferItem **items, size_t count, void *user_data) {
+    Handled *handled = user_data;
+    assert(!pthread_equal(handled->main_thread, pthread_self()));
+    assert((count > 0) && (count <= SERVER_HANDLER_BATCH));
+    atomic_fetch_add(&(handled->calls), 1);
+
+    for (size_t i = 0; i < count; i++) {
+        assert(SOFT_ERROR == items[i]->msg.type);
+        if (0 == strcmp("Connection closed", items[i]->msg.data.software.message->str)) {
+            atomic_fetch_add(&(handled->disconnects), 1);
+        } else {
+            assert(0 == strcmp("hello world!", items[i]->msg.data.software.message->str));
+            atomic_fetch_add(&(handled->messages), 1);
+        }
+    }
+    free_bufferitems(items, count);
+}
+
+static void test_handler(ServerBackend backend, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    Handled handled;
+    atomic_init(&(handled.messages), 0);
+    atomic_init(&(handled.disconnects), 0);
+    atomic_init(&(handled.calls), 0);
+    handled.main_thread = pthread_self();
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.backend = backend;
+    options.shards = 2; // the handler is called from both reactors
+    options.handler = on_messages;
+    options.handler_data = &handled;
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    Message msg;
+    software_error(&msg, "hello world!");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+
+    for (unsigned int i = 0; i < NUM_CLIENTS; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(-1 != fd);
+        assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+        for (unsigned int j = 0; j < NUM_MESSAGES; j++) {
+            assert(len == write(fd, encoded, (size_t) len));
+        }
+        close(fd);
+    }
+
+    for (unsigned int i = 0; (i < 5000) && (NUM_CLIENTS != atomic_load(&(handled.disconnects))); i++) {
+        usleep(1000);
+    }
+    printf("%u messages in %u calls\n", atomic_load(&(handled.messages)), atomic_load(&(handled.calls)));
+    assert(NUM_CLIENTS == atomic_load(&(handled.disconnects)));
+    assert(NUM_CLIENTS * NUM_MESSAGES == atomic_load(&(handled.messages)));
+
+    // nothing was queued
+    assert(NULL == read_message());
+    IngressStats stats;
+    server_ingress_stats(&stats);
+    assert(0 == stats.queued_items);
+
+    free(encoded);
+    free_message(&msg);
+    free(addr);
+    stop_server();
+}
+
+int main(void) {
+    test_handler(SERVER_BACKEND_EPOLL, 2012);
+    test_handler(SERVER_BACKEND_IO_URING, 2013);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/ingress.c
+ * system test for bounded ingress: reading pauses when too much is queued (or the queue is full) and nothing is lost
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+
+#define NUM_CLIENTS 4
+#define NUM_MESSAGES 5000 // per client
+#define HIGH_ITEMS 100
+#define LOW_ITEMS 10
+#define OVERSHOOT 1000 // how far over the high watermark one batch of reads may take us
+
+// a client sending as fast as it can. The server stops reading so its writes back up
+typedef struct {
+    int fd;
+    const char *encoded;
+    size_t len;
+    pthread_t thread;
+} Client;
+
+static void *send_all(Client *client) {
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        assert((ssize_t) client->len == write(client->fd, client->encoded, client->len));
+    }
+    return NULL;
+}
+
+// with watermarks unset the queue's capacity does the same job
+static void test_ingress(ServerBackend backend, uint16_t port, bool watermarks) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.backend = backend;
+    if (watermarks) {
+        options.ingress_high_items = HIGH_ITEMS;
+        options.ingress_low_items = LOW_ITEMS;
+    } else {
+        options.queue_capacity = HIGH_ITEMS;
+    }
+
+    puts("starting server");
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    Message msg;
+    software_error(&msg, "hello world!");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+
+    puts("sending messages");
+    Client clients[NUM_CLIENTS];
+    for (unsigned int i = 0; i < NUM_CLIENTS; i++) {
+        clients[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+        assert(-1 != clients[i].fd);
+        assert(0 == connect(clients[i].fd, addr, sizeof(struct sockaddr_in)));
+        clients[i].encoded = encoded;
+        clients[i].len = (size_t) len;
+        assert(0 == pthread_create(&(clients[i].thread), NULL, (void *(*)(void *)) send_all, &clients[i]));
+    }
+
+    // nobody is reading so the server should pause and stay near the high watermark
+    IngressStats stats;
+    for (unsigned int tries = 0; tries < 1E4; tries++) {
+        server_ingress_stats(&stats);
+        if (stats.paused && (stats.paused_connections > 0)) {
+            break;
+        }
+        usleep(100);
+    }
+    usleep(100000);
+    server_ingress_stats(&stats);
+    printf("queued %zu items (%zu bytes), %zu connections paused\n", stats.queued_items, stats.queued_bytes, stats.paused_connections);
+    assert(stats.paused);
+    assert(stats.paused_connections > 0);
+    assert(stats.queued_items >= HIGH_ITEMS);
+    assert(stats.queued_items < HIGH_ITEMS + OVERSHOOT);
+
+    // reading lets everything through
+    puts("reading messages");
+    unsigned int messages = 0;
+    unsigned int disconnects = 0;
+    bool closed = false;
+    for (unsigned int tries = 0; (tries < 1E6) && (disconnects < NUM_CLIENTS); tries++) {
+        // hang up once everything has been written
+        if (!closed && (messages > NUM_CLIENTS * NUM_MESSAGES - HIGH_ITEMS)) {
+            for (unsigned int i = 0; i < NUM_CLIENTS; i++) {
+                pthread_join(clients[i].thread, NULL);
+                close(clients[i].fd);
+            }
+            closed = true;
+        }
+
+        BufferItem *item = read_message();
+        if (NULL == item) {
+            usleep(10);
+            continue;
+        }
+
+        assert(SOFT_ERROR == item->msg.type);
+        if (0 == strcmp("Connection closed", item->msg.data.software.message->str)) {
+            disconnects += 1;
+        } else {
+            assert(0 == strcmp("hello world!", item->msg.data.software.message->str));
+            messages += 1;
+        }
+        free_bufferitem(item);
+    }
+    assert(NUM_CLIENTS == disconnects);
+    assert(NUM_CLIENTS * NUM_MESSAGES == messages);
+    assert(NULL == read_message());
+
+    server_ingress_stats(&stats);
+    assert(0 == stats.queued_items);
+    assert(0 == stats.queued_bytes);
+    assert(0 == stats.paused_connections);
+    assert(!stats.paused);
+
+    // the items came from the reactor's pool, and went back to it
+    MemoryStats memory;
+    server_memory_stats(&memory);
+    assert(memory.item_allocations >= NUM_CLIENTS * NUM_MESSAGES);
+    assert(memory.item_pool_hits > memory.item_allocations / 2);
+    assert(memory.item_pool_bytes > 0);
+
+    free(encoded);
+    free_message(&msg);
+    free(addr);
+
+    puts("stopping server");
+    stop_server();
+}
+
+int main(void) {
+    test_ingress(SERVER_BACKEND_EPOLL, 2003, true);
+    test_ingress(SERVER_BACKEND_IO_URING, 2004, true);
+    test_ingress(SERVER_BACKEND_EPOLL, 2007, false);
+    test_ingress(SERVER_BACKEND_IO_URING, 2008, false);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
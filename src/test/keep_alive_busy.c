@@ -0,0 +1,71 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * keep_alive_busy.c
+ * Unit test for keep alives: a client which only sends ordinary messages is not timed out
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// functions
+
+#define TEST_PAUSE ((KEEP_ALIVE_PROD) * 2)
+#define SEND_EVERY 5 // seconds
+
+// looping because it always seems to wake up early
+static void strict_sleep(unsigned int left_to_sleep) {
+    while (0 != left_to_sleep) {
+        left_to_sleep = sleep(left_to_sleep);
+    }
+}
+
+// sends a message every SEND_EVERY seconds, and never a KEEP_ALIVE, for long enough that the connection would have timed out
+int main(void) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 3004);
+    assert(NULL != addr);
+    assert(true == start_server(addr, sizeof(*addr)));
+
+    int sending_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != sending_fd);
+    assert(-1 != connect(sending_fd, addr, sizeof(*addr)));
+
+    Message msg;
+    software_error(&msg, "hello world!");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+
+    unsigned int sent = 0;
+    for (unsigned int waited = 0; waited < TEST_PAUSE; waited += SEND_EVERY) {
+        assert(len == write(sending_fd, encoded, (size_t) len));
+        sent += 1;
+        strict_sleep(SEND_EVERY);
+    }
+
+    // everything arrived and none of it is a timeout
+    unsigned int received = 0;
+    for (BufferItem *item = read_message(); NULL != item; item = read_message()) {
+        assert(SOFT_ERROR == item->msg.type);
+        assert(0 == strcmp("hello world!", item->msg.data.software.message->str));
+        received += 1;
+        free_bufferitem(item);
+    }
+    assert(sent == received);
+
+    free(encoded);
+    free_message(&msg);
+    free(addr);
+    close(sending_fd);
+    stop_server();
+    puts("keep_alive_busy passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * keep_alive_skip.c
+ * Unit test for SendingOptions.skip_keep_alives: which KEEP_ALIVEs the sender leaves out, as seen on the wire
+ */
+
+// includes
+#include "config.h"
+#include "edsac_sending.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "common.h"
+#include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// functions
+
+// how many times needle turns up in len bytes of data
+static unsigned int count(const char *data, size_t len, const char *needle) {
+    unsigned int found = 0;
+    size_t needle_len = strlen(needle);
+    for (size_t i = 0; i + needle_len <= len; i++) {
+        if (0 == memcmp(data + i, needle, needle_len)) {
+            found += 1;
+        }
+    }
+    return found;
+}
+
+// reads what the sender sends until deadline (on now()) and counts the KEEP_ALIVEs and other messages in it
+static void receive_until(int fd, double deadline, unsigned int *keep_alives, unsigned int *messages) {
+    static char buf[65536];
+    size_t len = 0;
+    for (double left = deadline - now(); left > 0; left = deadline - now()) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+        if (1 != poll(&pfd, 1, (int) (left * 1000) + 1)) {
+            continue;
+        }
+        ssize_t got = read(fd, buf + len, sizeof(buf) - len);
+        assert(got > 0);
+        len += (size_t) got;
+    }
+
+    *keep_alives = count(buf, len, "KEEP_ALIVE");
+    *messages = count(buf, len, "hello world!");
+}
+
+// sends one message just after connecting and checks which of the next two KEEP_ALIVEs follow it
+static void test_sender(bool skip, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != listen_fd);
+    int one = 1;
+    assert(0 == setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)));
+    assert(0 == bind(listen_fd, addr, sizeof(struct sockaddr_in)));
+    assert(0 == listen(listen_fd, 1));
+
+    SendingOptions options;
+    sending_default_options(&options);
+    assert(!options.skip_keep_alives);
+    options.skip_keep_alives = skip;
+    assert(true == start_sending_with_options(addr, sizeof(struct sockaddr_in), &options));
+    double start = now(); // the KEEP_ALIVE timer goes off every KEEP_ALIVE_INTERVAL seconds from about now
+    int fd = accept(listen_fd, NULL, NULL);
+    assert(-1 != fd);
+
+    Message msg;
+    software_error(&msg, "hello world!");
+    sleep(1);
+    assert(send_message(&msg));
+
+    // the first KEEP_ALIVE comes just after a message
+    unsigned int keep_alives;
+    unsigned int messages;
+    receive_until(fd, start + (KEEP_ALIVE_INTERVAL) * 1.5, &keep_alives, &messages);
+    printf("skip=%i: %u KEEP_ALIVEs and %u messages in the first interval\n", skip, keep_alives, messages);
+    assert(1 == messages);
+    assert((skip ? 0 : 1) == keep_alives);
+
+    // nothing else was sent so the second one goes whatever the options
+    receive_until(fd, start + (KEEP_ALIVE_INTERVAL) * 2.5, &keep_alives, &messages);
+    printf("skip=%i: %u KEEP_ALIVEs and %u messages in the second interval\n", skip, keep_alives, messages);
+    assert(0 == messages);
+    assert(1 == keep_alives);
+
+    free_message(&msg);
+    free(addr);
+    close(fd);
+    close(listen_fd);
+}
+
+// the sender only has one connection, so each case gets a process of its own. They run side by side
+int main(void) {
+    pid_t children[2];
+    for (unsigned int i = 0; i < 2; i++) {
+        children[i] = fork();
+        assert(-1 != children[i]);
+        if (0 == children[i]) {
+            test_sender(1 == i, (uint16_t) (3005 + i));
+            return EXIT_SUCCESS;
+        }
+    }
+
+    for (unsigned int i = 0; i < 2; i++) {
+        int status;
+        assert(children[i] == waitpid(children[i], &status, 0));
+        assert(WIFEXITED(status) && (EXIT_SUCCESS == WEXITSTATUS(status)));
+    }
+
+    puts("keep_alive_skip passed");
+    return EXIT_SUCCESS;
+}
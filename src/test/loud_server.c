@@ -27,7 +27,7 @@ int main(int argc, char** argv) {
     puts("Listening");
 
     while(true) {
-        BufferItem *item = read_message();
+        BufferItem *item = read_message_wait(-1);
         if (NULL != item) {
             switch (item->msg.type) {
                 case HARD_ERROR_OTHER:
@@ -44,7 +44,6 @@ int main(int argc, char** argv) {
             }
             free_bufferitem(item);
         }
-        usleep(10);
     }
 
     puts("stopping server");
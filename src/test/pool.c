@@ -0,0 +1,139 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/pool.c
+ * Testsuite for pool.c
+ */
+
+#include "config.h"
+#include "edsac_pool.h"
+#include <stdlib.h> // EXIT_*
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#define SLAB_OBJECTS 8
+
+static void test_one_thread(void) {
+    PoolSet set;
+    pool_set_init(&set, 24, SLAB_OBJECTS);
+    Pool *pool = pool_claim(&set);
+    assert(NULL != pool);
+
+    // a slab's worth then another slab
+    void *objects[SLAB_OBJECTS + 1];
+    for (unsigned int i = 0; i <= SLAB_OBJECTS; i++) {
+        objects[i] = pool_alloc(pool);
+        assert(NULL != objects[i]);
+        assert(0 == (uintptr_t) objects[i] % _Alignof(max_align_t));
+        memset(objects[i], 0xFF, 24);
+    }
+    PoolStats stats;
+    pool_set_stats(&set, &stats);
+    assert((SLAB_OBJECTS + 1 == stats.allocations) && (SLAB_OBJECTS - 1 == stats.hits) && (2 == stats.slabs));
+    assert(stats.resident_bytes >= 2 * SLAB_OBJECTS * 24);
+
+    // freed objects come straight back
+    pool_free(objects[3], pool);
+    assert(objects[3] == pool_alloc(pool));
+    pool_set_stats(&set, &stats);
+    assert(SLAB_OBJECTS == stats.hits);
+
+    // a pool which has been given up is reused, with what is in it
+    for (unsigned int i = 0; i <= SLAB_OBJECTS; i++) {
+        pool_free(objects[i], pool);
+    }
+    pool_release(pool);
+    assert(pool == pool_claim(&set));
+    void *obj = pool_alloc(pool);
+    pool_set_stats(&set, &stats);
+    assert((SLAB_OBJECTS + 1 == stats.hits) && (2 == stats.slabs));
+    pool_free(obj, pool);
+
+    // two owners at once need two pools
+    Pool *other = pool_claim(&set);
+    assert((NULL != other) && (pool != other));
+    pool_release(other);
+    pool_release(pool);
+
+    // no pool at all
+    obj = pool_alloc_unpooled(100);
+    assert(NULL != obj);
+    pool_free(obj, NULL);
+
+    pool_set_free(&set);
+}
+
+#define NUM_ROUNDS 100000
+#define IN_FLIGHT 64
+
+// passes objects from the owner of the pool to a thread which frees them
+static PoolSet set;
+static _Atomic(void *) mailbox[IN_FLIGHT];
+static atomic_bool done = false;
+
+static void *freer(__attribute__((unused)) void *arg) {
+    while (true) {
+        bool finished = atomic_load(&done);
+        bool empty = true;
+        for (unsigned int i = 0; i < IN_FLIGHT; i++) {
+            uintptr_t *obj = atomic_exchange(&mailbox[i], NULL);
+            if (NULL != obj) {
+                assert(*obj == (uintptr_t) obj); // nobody else has it
+                pool_free(obj, NULL);
+                empty = false;
+            }
+        }
+        if (finished && empty) {
+            return NULL;
+        }
+    }
+}
+
+// everything freed by another thread comes back to the pool
+static void test_remote_free(void) {
+    pool_set_init(&set, sizeof(uintptr_t), SLAB_OBJECTS);
+    Pool *pool = pool_claim(&set);
+    assert(NULL != pool);
+    atomic_store(&done, false);
+    for (unsigned int i = 0; i < IN_FLIGHT; i++) {
+        atomic_init(&mailbox[i], NULL);
+    }
+
+    pthread_t thread;
+    assert(0 == pthread_create(&thread, NULL, freer, NULL));
+
+    for (unsigned int round = 0; round < NUM_ROUNDS; round++) {
+        uintptr_t *obj = pool_alloc(pool);
+        assert(NULL != obj);
+        *obj = (uintptr_t) obj;
+
+        void *expected = NULL;
+        while (!atomic_compare_exchange_weak(&mailbox[round % IN_FLIGHT], &expected, obj)) {
+            expected = NULL;
+        }
+    }
+    atomic_store(&done, true);
+    assert(0 == pthread_join(thread, NULL));
+
+    // only as many slabs as there were objects in flight at once, give or take those which hadn't come back yet
+    PoolStats stats;
+    pool_set_stats(&set, &stats);
+    printf("%zu allocations, %zu hits, %zu slabs\n", stats.allocations, stats.hits, stats.slabs);
+    assert(NUM_ROUNDS == stats.allocations);
+    assert(NUM_ROUNDS == stats.hits + stats.slabs);
+    assert(stats.slabs * SLAB_OBJECTS < NUM_ROUNDS / 10);
+
+    pool_release(pool);
+    pool_set_free(&set);
+}
+
+int main(void) {
+    test_one_thread();
+    test_remote_free();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
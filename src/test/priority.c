@@ -0,0 +1,140 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/priority.c
+ * system test for the priority lanes: the order read_message takes messages in with each ServerPriority
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "common.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+
+#define NUM_EACH 10 // messages of each type in the burst
+
+// sends NUM_EACH software errors, then NUM_EACH of each hardware error, all at once and reads them back one at a time into types
+// the connection is still open afterwards so that its close report doesn't get mixed in
+static int send_burst(ServerPriority priority, const unsigned int weights[SERVER_NUM_LANES], uint16_t port, MessageType types[3 * NUM_EACH]) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.priority = priority;
+    if (NULL != weights) {
+        memcpy(options.lane_weights, weights, sizeof(options.lane_weights));
+    }
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    char burst[3 * NUM_EACH * MAX_ENCODED_LEN];
+    size_t len = 0;
+    Message msg;
+    for (int i = 0; i < NUM_EACH; i++) {
+        software_error(&msg, "software broke");
+        len += append(burst + len, &msg);
+    }
+    for (int i = 0; i < NUM_EACH; i++) {
+        hardware_error_other(&msg, "hardware broke");
+        len += append(burst + len, &msg);
+        hardware_error_valve(&msg, i, "valve broke");
+        len += append(burst + len, &msg);
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    assert((ssize_t) len == write(fd, burst, len));
+    wait_for_queued(3 * NUM_EACH);
+
+    int next_valve = 0;
+    for (unsigned int i = 0; i < 3 * NUM_EACH; i++) {
+        BufferItem *item = read_message();
+        assert(NULL != item);
+        types[i] = item->msg.type;
+        if (HARD_ERROR_VALVE == item->msg.type) {
+            assert(next_valve++ == item->msg.data.hardware_valve.valve_no); // each lane is still in order
+        }
+        free_bufferitem(item);
+    }
+    assert(NULL == read_message());
+
+    free(addr);
+    return fd;
+}
+
+static void finish(int fd) {
+    close(fd);
+    stop_server();
+}
+
+static void test_fifo(void) {
+    MessageType types[3 * NUM_EACH];
+    int fd = send_burst(SERVER_PRIORITY_FIFO, NULL, 2019, types);
+    for (unsigned int i = 0; i < NUM_EACH; i++) {
+        assert(SOFT_ERROR == types[i]);
+        assert(HARD_ERROR_OTHER == types[NUM_EACH + 2 * i]);
+        assert(HARD_ERROR_VALVE == types[NUM_EACH + 2 * i + 1]);
+    }
+    finish(fd);
+}
+
+static void test_strict(void) {
+    MessageType types[3 * NUM_EACH];
+    int fd = send_burst(SERVER_PRIORITY_STRICT, NULL, 2020, types);
+    for (unsigned int i = 0; i < NUM_EACH; i++) {
+        assert(HARD_ERROR_VALVE == types[i]);
+        assert(HARD_ERROR_OTHER == types[NUM_EACH + i]);
+        assert(SOFT_ERROR == types[2 * NUM_EACH + i]);
+    }
+    finish(fd);
+}
+
+static void test_weighted(void) {
+    MessageType types[3 * NUM_EACH];
+    const unsigned int weights[SERVER_NUM_LANES] = {2, 1, 0}; // 0 counts as 1
+    int fd = send_burst(SERVER_PRIORITY_WEIGHTED, weights, 2021, types);
+
+    // two valves, an other and a software error each round until the valves run out
+    const MessageType round[] = {HARD_ERROR_VALVE, HARD_ERROR_VALVE, HARD_ERROR_OTHER, SOFT_ERROR};
+    for (unsigned int i = 0; i < 4 * NUM_EACH / 2; i++) {
+        assert(round[i % 4] == types[i]);
+    }
+    // then the others take turns
+    for (unsigned int i = 4 * NUM_EACH / 2; i < 3 * NUM_EACH; i++) {
+        assert(((i % 2) ? SOFT_ERROR : HARD_ERROR_OTHER) == types[i]);
+    }
+
+    // read_messages follows the same turns
+    Message msg;
+    char burst[2 * MAX_ENCODED_LEN];
+    size_t len = 0;
+    software_error(&msg, "software broke");
+    len += append(burst + len, &msg);
+    hardware_error_valve(&msg, 0, "valve broke");
+    len += append(burst + len, &msg);
+    assert((ssize_t) len == write(fd, burst, len));
+    wait_for_queued(2);
+    BufferItem *items[2];
+    assert(2 == read_messages(items, 2));
+    assert(HARD_ERROR_VALVE == items[0]->msg.type);
+    assert(SOFT_ERROR == items[1]->msg.type);
+    free_bufferitems(items, 2);
+
+    finish(fd);
+}
+
+int main(void) {
+    test_fifo();
+    test_strict();
+    test_weighted();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
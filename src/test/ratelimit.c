@@ -0,0 +1,174 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/ratelimit.c
+ * system test for ServerOptions.rate_limit_*: a connection sending faster than its limits is slowed down or has the excess dropped
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "common.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define RATE 100   // messages per second
+#define FLOOD 300
+
+// sends count copies of a message all at once
+// returns how long each is
+static size_t send_flood(int fd, int count) {
+    Message msg;
+    software_error(&msg, "flood");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+    free_message(&msg);
+
+    char *flood = malloc((size_t) (len * count));
+    assert(NULL != flood);
+    for (int i = 0; i < count; i++) {
+        memcpy(flood + len * i, encoded, (size_t) len);
+    }
+    assert(len * count == write(fd, flood, (size_t) (len * count)));
+    free(flood);
+    free(encoded);
+    return (size_t) len;
+}
+
+static int connect_to(const struct sockaddr *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    return fd;
+}
+
+// reads the next message, which must be a software error saying text (or starting with it)
+static void expect_report(const char *text) {
+    BufferItem *item = read_message_wait(1000);
+    assert(NULL != item);
+    assert(SOFT_ERROR == item->msg.type);
+    assert(0 == strncmp(text, item->msg.data.software.message->str, strlen(text)));
+    free_bufferitem(item);
+}
+
+// SERVER_RATE_DELAY: everything arrives, but no faster than the limit
+static void test_delay(ServerBackend backend, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.backend = backend;
+    options.rate_limit_msgs = RATE;
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    // the client hangs up straight away. That is reported once everything it sent has been read
+    int fd = connect_to(addr);
+    double start = now();
+    send_flood(fd, FLOOD);
+    close(fd);
+
+    // a second's worth comes through at once and then the rest at the limit
+    unsigned int received = 0;
+    bool checked = false;
+    while (received < FLOOD) {
+        BufferItem *item = read_message_wait(1000);
+        assert(NULL != item);
+        assert(0 == strcmp("flood", item->msg.data.software.message->str));
+        free_bufferitem(item);
+        received += 1;
+
+        if (!checked && (now() - start > 0.5)) {
+            assert(received < RATE + RATE / 2 + 20);
+            IngressStats stats;
+            server_ingress_stats(&stats);
+            assert(1 == stats.paused_connections);
+            checked = true;
+        }
+    }
+    double elapsed = now() - start;
+    assert(elapsed > 1.5);
+    assert(elapsed < 5);
+    expect_report("Connection closed");
+
+    IngressStats stats;
+    server_ingress_stats(&stats);
+    assert(0 == stats.rate_dropped);
+    assert(0 == stats.paused_connections);
+
+    stop_server();
+    free(addr);
+}
+
+// SERVER_RATE_DROP: a second's worth (and one more) comes through and the rest is dropped and reported
+static void test_drop(ServerBackend backend, uint16_t port, bool by_bytes) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    // find out how long each message is
+    Message msg;
+    software_error(&msg, "flood");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+    free(encoded);
+    free_message(&msg);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.backend = backend;
+    if (by_bytes) {
+        options.rate_limit_bytes = (size_t) len * RATE;
+    } else {
+        options.rate_limit_msgs = RATE;
+    }
+    options.rate_limit_action = SERVER_RATE_DROP;
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    int fd = connect_to(addr);
+    send_flood(fd, FLOOD);
+
+    // the buckets could have refilled a little while the flood was being read
+    unsigned int received = 0;
+    BufferItem *item;
+    while (NULL != (item = read_message_wait(200))) {
+        assert(0 == strcmp("flood", item->msg.data.software.message->str));
+        free_bufferitem(item);
+        received += 1;
+    }
+    assert(received >= RATE + 1);
+    assert(received <= RATE + 5);
+
+    IngressStats stats;
+    server_ingress_stats(&stats);
+    assert(FLOOD - received == stats.rate_dropped);
+    assert(0 == stats.paused_connections);
+
+    // how many were dropped is reported when it closes, before the close
+    close(fd);
+    char text[64];
+    snprintf(text, sizeof(text), "Rate limited: %zu messages dropped", stats.rate_dropped);
+    expect_report(text);
+    expect_report("Connection closed");
+
+    stop_server();
+    free(addr);
+}
+
+int main(void) {
+    test_delay(SERVER_BACKEND_EPOLL, 2027);
+    test_delay(SERVER_BACKEND_IO_URING, 2028);
+    test_drop(SERVER_BACKEND_EPOLL, 2029, false);
+    test_drop(SERVER_BACKEND_IO_URING, 2030, true);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
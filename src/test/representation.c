@@ -7,6 +7,7 @@
 
 #include "config.h"
 #include "edsac_representation.h"
+#include "contrib/cJSON.h"
 #include <stdlib.h> // EXIT_*
 #include <stdio.h>
 #include <assert.h>
@@ -109,9 +110,234 @@ static void test_decoding(void) {
     free_message(&msg);
 }
 
+// counts cJSON's allocations
+static size_t cjson_allocations = 0;
+static void *counting_malloc(size_t size) {
+    cjson_allocations += 1;
+    return malloc(size);
+}
+
+static void test_decode_fields(void) {
+    // decoding goes nowhere near cJSON: it neither allocates through it nor changes its hooks
+    cJSON_Hooks hooks = {.malloc_fn = counting_malloc, .free_fn = free};
+    cJSON_InitHooks(&hooks);
+
+    DecodeScratch scratch;
+    decode_scratch_init(&scratch);
+    DecodedFields fields;
+
+    // the text is left in the scratch, unescaped
+    const char *hardware_valve = "{\"version\":2,\"data\":{\"valve_no\":2,\"message\":\"my \\\"string\\\"\"},\"type\":\"HARD_ERROR_VALVE\"}";
+    assert(decode_message_fields(hardware_valve, &scratch, &fields));
+    assert((HARD_ERROR_VALVE == fields.type) && (2 == fields.valve_no));
+    assert((11 == fields.text_len) && (0 == strcmp("my \"string\"", fields.text)));
+    assert((fields.text >= scratch.buf) && (fields.text < scratch.buf + DECODE_SCRATCH_SIZE));
+
+    // the scratch is reused
+    assert(decode_message_fields("{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}", &scratch, &fields));
+    assert((KEEP_ALIVE == fields.type) && (NULL == fields.text));
+    assert(!decode_message_fields("{\"version\":2,\"data\":{},\"type\":\"SOFT_ERROR\"}", &scratch, &fields));
+    assert(!decode_message_fields("{blah", &scratch, &fields));
+
+    // too big for the scratch
+    char big[2 * DECODE_SCRATCH_SIZE];
+    const char *prefix = "{\"version\":2,\"data\":{\"message\":\"";
+    const char *suffix = "\"},\"type\":\"SOFT_ERROR\"}";
+    size_t text_len = sizeof(big) - strlen(prefix) - strlen(suffix) - 1;
+    strcpy(big, prefix);
+    memset(big + strlen(prefix), 'a', text_len);
+    strcpy(big + strlen(prefix) + text_len, suffix);
+    assert(decode_message_fields(big, &scratch, &fields));
+    assert((SOFT_ERROR == fields.type) && (text_len == fields.text_len));
+
+    decode_scratch_free(&scratch);
+    assert(0 == cjson_allocations);
+
+    Message msg;
+    software_error(&msg, "after");
+    char *encoded = NULL;
+    assert(-1 != encode_message(&msg, &encoded));
+    assert(0 != cjson_allocations);
+    free(encoded);
+    free_message(&msg);
+    cJSON_InitHooks(NULL);
+}
+
+// what decode_message_fields found when it built a cJSON tree: the reference for decoding in place
+// the text is copied to text, which has room for size bytes
+static bool cjson_fields(const char *encoded, DecodedFields *fields, char *text, size_t size) {
+    cJSON *root = cJSON_Parse(encoded);
+    cJSON *version = cJSON_GetObjectItem(root, "version");
+    cJSON *data = cJSON_GetObjectItem(root, "data");
+    cJSON *type = cJSON_GetObjectItem(root, "type");
+    bool ok = cJSON_IsNumber(version) && (DATA_FORMAT_VERSION == version->valuedouble) && (NULL != data) && cJSON_IsString(type);
+
+    fields->valve_no = 0;
+    fields->text = NULL;
+    fields->text_len = 0;
+    if (!ok) {
+        // nothing more to find
+    } else if (0 == strcmp("KEEP_ALIVE", type->valuestring)) {
+        fields->type = KEEP_ALIVE;
+    } else {
+        if (0 == strncmp("SOFT_ERR", type->valuestring, 8)) {
+            fields->type = SOFT_ERROR;
+        } else if (0 == strncmp("HARD_ERROR_OTHER", type->valuestring, 16)) {
+            fields->type = HARD_ERROR_OTHER;
+        } else if (0 == strncmp("HARD_ERROR_VALVE", type->valuestring, 16)) {
+            fields->type = HARD_ERROR_VALVE;
+            cJSON *valve_no = cJSON_GetObjectItem(data, "valve_no");
+            ok = cJSON_IsNumber(valve_no);
+            fields->valve_no = ok ? valve_no->valueint : 0;
+        } else {
+            ok = false;
+        }
+
+        cJSON *description = cJSON_GetObjectItem(data, "message");
+        ok = ok && cJSON_IsString(description);
+        if (ok) {
+            fields->text_len = strlen(description->valuestring);
+            assert(fields->text_len < size);
+            memcpy(text, description->valuestring, fields->text_len + 1);
+            fields->text = text;
+        }
+    }
+
+    cJSON_Delete(root);
+    return ok;
+}
+
+// decoding in place finds the same as cJSON and, if it worked, leaves the text in the message itself
+static void check_in_place(const char *encoded) {
+    char text[1024];
+    DecodedFields expected;
+    bool expected_ok = cjson_fields(encoded, &expected, text, sizeof(text));
+
+    char copy[1024];
+    size_t len = strlen(encoded);
+    assert(len < sizeof(copy));
+    memcpy(copy, encoded, len + 1);
+    DecodedFields fields;
+    assert(expected_ok == decode_message_in_place(copy, len, &fields));
+    if (expected_ok) {
+        assert((expected.type == fields.type) && (expected.valve_no == fields.valve_no));
+        if (KEEP_ALIVE == fields.type) {
+            assert(NULL == fields.text);
+        } else {
+            assert((fields.text > copy) && (fields.text < copy + len));
+            assert((expected.text_len == fields.text_len) && (0 == strcmp(expected.text, fields.text)));
+        }
+    } else {
+        assert(0 == strcmp(encoded, copy)); // untouched
+    }
+}
+
+static void test_decode_in_place(void) {
+    const char *encoded[] = {
+        "{\"version\":2,\"data\":{\"valve_no\":2,\"message\":\"my \\\"string\\\"\"},\"type\":\"HARD_ERROR_VALVE\"}",
+        "{\"version\":2,\"data\":{\"message\":\"other\"},\"type\":\"HARD_ERROR_OTHER\"}",
+        "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\"}",
+        // whitespace, other keys (of every kind) and keys in a different case
+        " { \"Version\" : 2.0 , \"extra\" : [1, {\"a\": [true, false, null]}, \"}\"], \"DATA\" : { \"x\": {}, \"message\" : \"a\\/b\" } , \"type\" : \"SOFT_ERROR\" } ",
+        // the first of each key counts
+        "{\"version\":2,\"data\":{\"message\":\"first\",\"message\":\"second\"},\"type\":\"SOFT_ERROR\",\"type\":\"KEEP_ALIVE\"}",
+        "{\"version\":2,\"data\":{\"message\":1,\"message\":\"second\"},\"type\":\"SOFT_ERROR\"}",
+        // escapes
+        "{\"version\":2,\"data\":{\"message\":\"\\b\\f\\n\\r\\t\\\\ \\u0041\\u00e9\\u20ac\\ud83d\\ude00\"},\"type\":\"SOFT_ERROR\"}",
+        "{\"version\":2,\"data\":{\"message\":\"nul\\u0000after\"},\"type\":\"SOFT_ERROR\"}",
+        "{\"version\":2,\"data\":{\"message\":\"x\"},\"type\":\"SOFT_\\u0045RROR\"}",
+        "{\"version\":2,\"data\":{\"message\":\"bad \\ud83d\"},\"type\":\"SOFT_ERROR\"}",
+        "{\"version\":2,\"data\":{\"message\":\"bad \\q\"},\"type\":\"SOFT_ERROR\"}",
+        // valve numbers
+        "{\"version\":2,\"data\":{\"valve_no\":-7.9,\"message\":\"m\"},\"type\":\"HARD_ERROR_VALVE\"}",
+        "{\"version\":2,\"data\":{\"valve_no\":1e20,\"message\":\"m\"},\"type\":\"HARD_ERROR_VALVE\"}",
+        "{\"version\":2,\"data\":{\"valve_no\":\"1\",\"message\":\"m\"},\"type\":\"HARD_ERROR_VALVE\"}",
+        "{\"version\":2,\"data\":{\"message\":\"m\"},\"type\":\"HARD_ERROR_VALVE\"}",
+        // not messages
+        "{\"version\":1,\"data\":{},\"type\":\"KEEP_ALIVE\"}",
+        "{\"version\":\"2\",\"data\":{},\"type\":\"KEEP_ALIVE\"}",
+        "{\"version\":2,\"type\":\"KEEP_ALIVE\"}",
+        "{\"version\":2,\"data\":{\"message\":\"m\"},\"type\":\"UNKNOWN\"}",
+        "{\"version\":2,\"data\":{\"message\":\"m\"},\"type\":\"SOFT_ERROR\"",
+        "{\"version\":2,\"data\":{\"message\":\"m},\"type\":\"SOFT_ERROR\"}",
+        "{\"version\":2,,\"data\":{},\"type\":\"KEEP_ALIVE\"}",
+        "{\"version\":2,\"data\":{},\"type\":\"KEEP_ALIVE\",}",
+        "{\"version\":2,\"data\":{\"message\":\"m\"},\"type\":\"SOFT_ERROR\",\"x\":tru}",
+        "[]",
+        "",
+    };
+
+    for (size_t i = 0; i < sizeof(encoded) / sizeof(encoded[0]); i++) {
+        check_in_place(encoded[i]);
+    }
+
+    // and the same for whatever encode_message makes
+    Message msg;
+    hardware_error_valve(&msg, 12, "\"quoted\"\ttab\x01");
+    char *buf = NULL;
+    assert(-1 != encode_message(&msg, &buf));
+    check_in_place(buf);
+    free(buf);
+    free_message(&msg);
+}
+
+// compact messages encode just like the GString ones
+#define COMPACT_MATCHES(_compact, _message) \
+    assert(-1 != encode_message(&_message, &encoded)); \
+    assert((ssize_t) strlen(encoded) == encode_compact_message(&_compact, buf, sizeof(buf))); \
+    assert(0 == strcmp(encoded, buf)); \
+    free(encoded); \
+    free_message(&_message);
+
+static void test_compact(void) {
+    char buf[MAX_COMPACT_ENCODED_LEN + 1];
+    char *encoded = NULL;
+    CompactMessage compact;
+    Message msg;
+
+    const char *text = "quotes \" and \\ and \t\n\r\b\f and \x01";
+    compact_hardware_error_valve(&compact, -3, text);
+    hardware_error_valve(&msg, -3, text);
+    COMPACT_MATCHES(compact, msg)
+
+    compact_hardware_error_other(&compact, "foo bar");
+    hardware_error_other(&msg, "foo bar");
+    COMPACT_MATCHES(compact, msg)
+
+    compact_software_error(&compact, "");
+    software_error(&msg, "");
+    COMPACT_MATCHES(compact, msg)
+
+    compact_keep_alive(&compact);
+    keep_alive(&msg);
+    COMPACT_MATCHES(compact, msg)
+
+    // and decode
+    assert(decode_compact_message("{\"version\":2,\"data\":{\"valve_no\":2,\"message\":\"my \\\"string\\\"\"},\"type\":\"HARD_ERROR_VALVE\"}", &compact));
+    assert((HARD_ERROR_VALVE == compact.type) && (2 == compact.valve_no));
+    assert((11 == compact.len) && (0 == strcmp("my \"string\"", compact.text)));
+    assert(!decode_compact_message("{blah", &compact));
+    free_compact_message(&compact);
+
+    // long texts are cut short, every character escaped still fits and too small a buffer is an error
+    char long_text[MAX_MSG_LEN * 2];
+    memset(long_text, '\x01', sizeof(long_text) - 1);
+    long_text[sizeof(long_text) - 1] = '\0';
+    compact_software_error(&compact, long_text);
+    assert((MAX_MSG_LEN == compact.len) && ('\0' == compact.text[MAX_MSG_LEN]));
+    assert(encode_compact_message(&compact, buf, sizeof(buf)) > 6 * MAX_MSG_LEN);
+    assert(-1 == encode_compact_message(&compact, buf, 100));
+
+    compact.type = INVALID;
+    assert(-1 == encode_compact_message(&compact, buf, sizeof(buf)));
+}
+
 int main(void) {
     test_encoding();
     test_decoding();
+    test_decode_fields();
+    test_decode_in_place();
+    test_compact();
 
     return EXIT_SUCCESS;
 }
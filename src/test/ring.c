@@ -0,0 +1,155 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/ring.c
+ * Testsuite for ring.c
+ */
+
+#include "config.h"
+#include "edsac_ring.h"
+#include <stdlib.h> // EXIT_*
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+static void test_one_thread(void) {
+    Ring ring;
+    assert(ring_init(&ring, 5, false));
+    assert(8 == ring_capacity(&ring));
+    assert(NULL == ring_pop(&ring));
+
+    // fills up and empties in order, more than once round
+    for (uintptr_t round = 0; round < 3; round++) {
+        for (uintptr_t i = 1; i <= 8; i++) {
+            assert(ring_push(&ring, (void *) i));
+        }
+        assert(!ring_push(&ring, (void *) 9));
+        assert(8 == ring_size(&ring));
+
+        for (uintptr_t i = 1; i <= 8; i++) {
+            assert((void *) i == ring_pop(&ring));
+        }
+        assert(NULL == ring_pop(&ring));
+        assert(0 == ring_size(&ring));
+    }
+
+    // batches stop at the end of what is there, including across the wrap
+    void *values[8];
+    assert(0 == ring_pop_batch(&ring, values, 8));
+    for (uintptr_t i = 1; i <= 6; i++) {
+        assert(ring_push(&ring, (void *) i));
+    }
+    assert(4 == ring_pop_batch(&ring, values, 4));
+    assert(((void *) 1 == values[0]) && ((void *) 4 == values[3]));
+    for (uintptr_t i = 7; i <= 12; i++) {
+        assert(ring_push(&ring, (void *) i));
+    }
+    assert(8 == ring_pop_batch(&ring, values, 8));
+    for (uintptr_t i = 0; i < 8; i++) {
+        assert((void *) (i + 5) == values[i]);
+    }
+    assert(0 == ring_pop_batch(&ring, values, 0));
+    assert(0 == ring_size(&ring));
+
+    ring_free(&ring);
+    assert(NULL == ring.cells);
+}
+
+#define NUM_PRODUCERS 4
+#define NUM_CONSUMERS 3
+#define PER_PRODUCER 100000
+
+static Ring ring;
+static atomic_uint producers_done = 0;
+static atomic_uint popped[NUM_PRODUCERS];
+static size_t batch; // consumers pop this many at once (1 means ring_pop)
+
+// pushes (producer << 24) | n for n = 1 .. PER_PRODUCER, waiting whenever the ring is full
+static void *producer(void *arg) {
+    uintptr_t id = (uintptr_t) arg;
+    for (uintptr_t n = 1; n <= PER_PRODUCER; n++) {
+        while (!ring_push(&ring, (void *) ((id << 24) | n))) {
+            sched_yield();
+        }
+    }
+
+    atomic_fetch_add(&producers_done, 1);
+    return NULL;
+}
+
+// pops until the producers are finished and the ring is empty
+// with one consumer everything from a producer has to come out in order
+static void *consumer(void *arg) {
+    bool ordered = (NULL != arg);
+    uintptr_t last[NUM_PRODUCERS] = {0};
+
+    void *values[16];
+    while (true) {
+        size_t count = 0;
+        if (1 == batch) {
+            values[0] = ring_pop(&ring);
+            count = (NULL == values[0]) ? 0 : 1;
+        } else {
+            count = ring_pop_batch(&ring, values, batch);
+        }
+        if (0 == count) {
+            if (NUM_PRODUCERS == atomic_load(&producers_done) && (0 == ring_size(&ring))) {
+                return NULL;
+            }
+            sched_yield();
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            uintptr_t id = (uintptr_t) values[i] >> 24;
+            uintptr_t n = (uintptr_t) values[i] & 0xFFFFFF;
+            assert(id < NUM_PRODUCERS);
+            if (ordered) {
+                assert(n == last[id] + 1);
+            }
+            last[id] = n;
+            atomic_fetch_add(&popped[id], 1);
+        }
+    }
+}
+
+// nothing is lost or taken twice however many threads push and pop
+static void test_threads(bool multi_consumer, size_t pop_batch) {
+    batch = pop_batch;
+    unsigned int consumers = multi_consumer ? NUM_CONSUMERS : 1;
+    assert(ring_init(&ring, 64, multi_consumer));
+    atomic_store(&producers_done, 0);
+    for (unsigned int i = 0; i < NUM_PRODUCERS; i++) {
+        atomic_store(&popped[i], 0);
+    }
+
+    pthread_t threads[NUM_PRODUCERS + NUM_CONSUMERS];
+    for (uintptr_t i = 0; i < consumers; i++) {
+        assert(0 == pthread_create(&threads[i], NULL, consumer, multi_consumer ? NULL : (void *) 1));
+    }
+    for (uintptr_t i = 0; i < NUM_PRODUCERS; i++) {
+        assert(0 == pthread_create(&threads[consumers + i], NULL, producer, (void *) i));
+    }
+    for (unsigned int i = 0; i < consumers + NUM_PRODUCERS; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+
+    for (unsigned int i = 0; i < NUM_PRODUCERS; i++) {
+        assert(PER_PRODUCER == atomic_load(&popped[i]));
+    }
+    assert(NULL == ring_pop(&ring));
+    ring_free(&ring);
+}
+
+int main(void) {
+    test_one_thread();
+    test_threads(false, 1);
+    test_threads(true, 1);
+    test_threads(false, 16);
+    test_threads(true, 16);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
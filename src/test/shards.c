@@ -0,0 +1,299 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/shards.c
+ * system test for a server split over several shards, with each backend and framing mode
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "edsac_framing.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define NUM_CLIENTS 16
+#define NUM_MESSAGES 500 // per client
+
+// connects to the server from a different loopback address for each client so that steering has something to do
+static int connect_client(const struct sockaddr *server, unsigned int client) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+
+    char source[16];
+    snprintf(source, sizeof(source), "127.0.0.%u", client + 2);
+    struct sockaddr *source_addr = alloc_addr(source, 0);
+    assert(NULL != source_addr);
+    assert(0 == bind(fd, source_addr, sizeof(struct sockaddr_in)));
+    free(source_addr);
+
+    assert(0 == connect(fd, server, sizeof(struct sockaddr_in)));
+    return fd;
+}
+
+// frames an encoded message for mode
+// returns the length of the frame written to out
+static size_t frame_message(FramingMode mode, const char *encoded, size_t len, char *out) {
+    size_t used = 0;
+    if (FRAMING_LENGTH_PREFIXED == mode) {
+        out[used++] = (char) (len >> 24);
+        out[used++] = (char) (len >> 16);
+        out[used++] = (char) (len >> 8);
+        out[used++] = (char) len;
+    }
+    memcpy(out + used, encoded, len);
+    used += len;
+    if (FRAMING_NDJSON == mode) {
+        out[used++] = '\n';
+    }
+    return used;
+}
+
+// sends every message over a connection
+// the first one is split over two writes so that the server sees it arrive in pieces
+static void send_all(int fd, const char *encoded, size_t len) {
+    size_t half = len / 2;
+    assert((ssize_t) half == write(fd, encoded, half));
+    usleep(1000);
+    assert((ssize_t) (len - half) == write(fd, encoded + half, len - half));
+
+    for (unsigned int i = 1; i < NUM_MESSAGES; i++) {
+        assert((ssize_t) len == write(fd, encoded, len));
+    }
+}
+
+// runs a sharded server with the given backend and checks that everything sent to it arrives
+static void test_shards(ServerBackend backend, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.shards = 4;
+    options.steer_by_address = true;
+    options.backend = backend;
+
+    puts("starting sharded server");
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    Message msg;
+    software_error(&msg, "hello world!");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+
+    puts("sending messages");
+    int clients[NUM_CLIENTS];
+    for (unsigned int i = 0; i < NUM_CLIENTS; i++) {
+        clients[i] = connect_client(addr, i);
+
+        // a mix of framing modes, each announced by its preamble
+        FramingMode mode = (FramingMode) (i % 3);
+        char preamble[FRAMING_PREAMBLE_LEN];
+        size_t preamble_len = framing_preamble(mode, preamble);
+        assert((ssize_t) preamble_len == write(clients[i], preamble, preamble_len));
+
+        char frame[MAX_ENCODED_LEN + 5];
+        send_all(clients[i], frame, frame_message(mode, encoded, (size_t) len, frame));
+    }
+
+    puts("disconnecting");
+    for (unsigned int i = 0; i < NUM_CLIENTS; i++) {
+        close(clients[i]);
+    }
+
+    // every message and every disconnect should turn up eventually
+    unsigned int messages = 0;
+    unsigned int disconnects = 0;
+    for (unsigned int tries = 0; (tries < 1E6) && (disconnects < NUM_CLIENTS); tries++) {
+        BufferItem *item = read_message();
+        if (NULL == item) {
+            usleep(10);
+            continue;
+        }
+
+        assert(SOFT_ERROR == item->msg.type);
+        if (0 == strcmp("Connection closed", item->msg.data.software.message->str)) {
+            disconnects += 1;
+        } else {
+            assert(0 == strcmp("hello world!", item->msg.data.software.message->str));
+            messages += 1;
+        }
+        free_bufferitem(item);
+    }
+    assert(NUM_CLIENTS == disconnects);
+    assert(NUM_CLIENTS * NUM_MESSAGES == messages);
+    assert(NULL == read_message());
+
+    free(encoded);
+    free_message(&msg);
+    free(addr);
+
+    puts("stopping server");
+    stop_server();
+}
+
+// writes everything in buf, however many goes it takes
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = send(fd, buf, len, MSG_NOSIGNAL);
+        assert(written > 0);
+        buf += written;
+        len -= (size_t) written;
+    }
+}
+
+// waits for the next message from the server
+static BufferItem *next_message(void) {
+    for (unsigned int tries = 0; tries < 1E6; tries++) {
+        BufferItem *item = read_message();
+        if (NULL != item) {
+            return item;
+        }
+        usleep(10);
+    }
+    return NULL;
+}
+
+// a frame of FRAME_MAX_LEN gets through, but a brace framed message which fills the whole receive buffer is reported as too large
+static void test_largest_frame(ServerBackend backend, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.backend = backend;
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    Message msg;
+    software_error(&msg, "hello world!");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+
+    // the message is padded out with whitespace after its opening brace
+    char *frame = malloc(4 + FRAME_MAX_LEN);
+    assert(NULL != frame);
+    size_t pad = FRAME_MAX_LEN - (size_t) len;
+    frame[0] = (char) (FRAME_MAX_LEN >> 24);
+    frame[1] = (char) (FRAME_MAX_LEN >> 16);
+    frame[2] = (char) (FRAME_MAX_LEN >> 8);
+    frame[3] = (char) FRAME_MAX_LEN;
+    frame[4] = '{';
+    memset(frame + 5, ' ', pad);
+    memcpy(frame + 5 + pad, encoded + 1, (size_t) len - 1);
+
+    int fd = connect_client(addr, 0);
+    char preamble[FRAMING_PREAMBLE_LEN];
+    write_all(fd, preamble, framing_preamble(FRAMING_LENGTH_PREFIXED, preamble));
+    write_all(fd, frame, 4 + FRAME_MAX_LEN);
+    close(fd);
+
+    BufferItem *item = next_message();
+    assert((NULL != item) && (SOFT_ERROR == item->msg.type));
+    assert(0 == strcmp("hello world!", item->msg.data.software.message->str));
+    free_bufferitem(item);
+    item = next_message();
+    assert((NULL != item) && (0 == strcmp("Connection closed", item->msg.data.software.message->str)));
+    free_bufferitem(item);
+
+    // an unfinished object as big as the receive buffer
+    fd = connect_client(addr, 1);
+    memset(frame + 1, ' ', RECV_BUFFER_MAX - 1);
+    frame[0] = '{';
+    write_all(fd, frame, RECV_BUFFER_MAX);
+
+    item = next_message();
+    assert((NULL != item) && (SOFT_ERROR == item->msg.type));
+    assert(0 == strcmp("Message too large", item->msg.data.software.message->str));
+    free_bufferitem(item);
+    close(fd);
+
+    free(frame);
+    free(encoded);
+    free_message(&msg);
+    free(addr);
+    stop_server();
+}
+
+// connections beyond max_connections are turned away and their slots are reused once they close
+static void test_max_connections(ServerBackend backend, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.backend = backend;
+    options.max_connections = 2;
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    int clients[4];
+    for (unsigned int i = 0; i < 4; i++) {
+        clients[i] = connect_client(addr, i);
+    }
+
+    ConnectionStats stats;
+    for (unsigned int tries = 0; tries < 1E5; tries++) {
+        server_connection_stats(&stats);
+        if (2 == stats.rejected) {
+            break;
+        }
+        usleep(10);
+    }
+    assert(2 == stats.connections);
+    assert(2 == stats.max_connections);
+    assert(2 == stats.rejected);
+
+    for (unsigned int i = 0; i < 4; i++) {
+        close(clients[i]);
+    }
+
+    // only the two which got in are reported as closing
+    unsigned int disconnects = 0;
+    for (unsigned int tries = 0; (tries < 1E5) && (disconnects < 2); tries++) {
+        BufferItem *item = read_message();
+        if (NULL == item) {
+            usleep(10);
+            continue;
+        }
+        disconnects += 1;
+        free_bufferitem(item);
+    }
+    assert(2 == disconnects);
+    server_connection_stats(&stats);
+    assert(0 == stats.connections);
+
+    // the freed slots can be used again
+    clients[0] = connect_client(addr, 0);
+    for (unsigned int tries = 0; tries < 1E5; tries++) {
+        server_connection_stats(&stats);
+        if (1 == stats.connections) {
+            break;
+        }
+        usleep(10);
+    }
+    assert(1 == stats.connections);
+    assert(2 == stats.rejected);
+    close(clients[0]);
+
+    free(addr);
+    stop_server();
+}
+
+int main(void) {
+    test_shards(SERVER_BACKEND_EPOLL, 2001);
+    test_shards(SERVER_BACKEND_IO_URING, 2002);
+    test_max_connections(SERVER_BACKEND_EPOLL, 2005);
+    test_max_connections(SERVER_BACKEND_IO_URING, 2006);
+    test_largest_frame(SERVER_BACKEND_EPOLL, 2031);
+    test_largest_frame(SERVER_BACKEND_IO_URING, 2032);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/source.c
+ * system test for server_ready_fd and the GSource built on it
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_source.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+
+#define NUM_MESSAGES 1000
+#define BATCH 100
+
+// the ready fd is readable
+static bool ready(void) {
+    struct pollfd fd = {.fd = server_ready_fd(), .events = POLLIN, .revents = 0};
+    return 1 == poll(&fd, 1, 0);
+}
+
+typedef struct {
+    unsigned int messages;
+    unsigned int calls;
+    bool closed;
+} Received;
+
+static gboolean on_messages(BufferItem **items, size_t count, Received *received) {
+    assert((count > 0) && (count <= BATCH));
+    received->calls += 1;
+
+    for (size_t i = 0; i < count; i++) {
+        assert(SOFT_ERROR == items[i]->msg.type);
+        if (0 == strcmp("Connection closed", items[i]->msg.data.software.message->str)) {
+            received->closed = true;
+        } else {
+            assert(0 == strcmp("hello world!", items[i]->msg.data.software.message->str));
+            received->messages += 1;
+        }
+        free_bufferitem(items[i]);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+// sends NUM_MESSAGES in one go, then hangs up
+static void send_burst(const struct sockaddr *addr) {
+    Message msg;
+    software_error(&msg, "hello world!");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+    char *burst = malloc((size_t) len * NUM_MESSAGES);
+    assert(NULL != burst);
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        memcpy(burst + (size_t) len * i, encoded, (size_t) len);
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    assert((ssize_t) len * NUM_MESSAGES == write(fd, burst, (size_t) len * NUM_MESSAGES));
+    close(fd);
+
+    free(burst);
+    free(encoded);
+    free_message(&msg);
+}
+
+int main(void) {
+    assert(-1 == server_ready_fd());
+    assert(NULL == server_source_new(0));
+
+    struct sockaddr *addr = alloc_addr("127.0.0.1", 2011);
+    assert(NULL != addr);
+    assert(true == start_server(addr, sizeof(struct sockaddr_in)));
+    assert(-1 != server_ready_fd());
+    assert(!ready());
+
+    GMainContext *context = g_main_context_new();
+    GSource *source = server_source_new(BATCH);
+    assert(NULL != source);
+    Received received = {0, 0, false};
+    g_source_set_callback(source, G_SOURCE_FUNC(on_messages), &received, NULL);
+    g_source_attach(source, context);
+    g_source_unref(source);
+
+    send_burst(addr);
+
+    // the main loop sleeps until there is something to do
+    for (unsigned int i = 0; (i < 1E4) && !received.closed; i++) {
+        g_main_context_iteration(context, TRUE);
+    }
+    printf("%u messages in %u calls\n", received.messages, received.calls);
+    assert(received.closed);
+    assert(NUM_MESSAGES == received.messages);
+    assert(received.calls >= NUM_MESSAGES / BATCH);
+
+    // everything has been read so there is nothing to wake up for
+    assert(!ready());
+
+    // after a restart the same source follows the new ready fd. Something else is given the old one's number
+    int old_fd = server_ready_fd();
+    stop_server();
+    assert(-1 == server_ready_fd());
+    int pipe_fds[2];
+    assert(0 == pipe(pipe_fds));
+    assert(old_fd == dup2(pipe_fds[0], old_fd));
+    free(addr);
+    addr = alloc_addr("127.0.0.1", 2034);
+    assert(NULL != addr);
+    assert(true == start_server(addr, sizeof(struct sockaddr_in)));
+    assert(old_fd != server_ready_fd());
+
+    received = (Received) {0, 0, false};
+    send_burst(addr);
+    for (unsigned int i = 0; (i < 1E4) && !received.closed; i++) {
+        g_main_context_iteration(context, FALSE);
+        usleep(1000);
+    }
+    assert(received.closed);
+    assert(NUM_MESSAGES == received.messages);
+
+    g_main_context_unref(context);
+    close(old_fd);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    free(addr);
+    stop_server();
+    assert(-1 == server_ready_fd());
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
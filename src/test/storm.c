@@ -0,0 +1,117 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/storm.c
+ * system test for ServerOptions.coalesce_window_ms: a storm of identical messages comes out as a few BufferItems with repeat counts
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "common.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define WINDOW_MS 200
+#define STORM 100
+
+// sends count valve alarms all at once
+static void send_valves(int fd, int valve_no, const char *text, int count) {
+    Message msg;
+    hardware_error_valve(&msg, valve_no, text);
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+    free_message(&msg);
+
+    char *burst = malloc((size_t) (len * count));
+    assert(NULL != burst);
+    for (int i = 0; i < count; i++) {
+        memcpy(burst + len * i, encoded, (size_t) len);
+    }
+    assert(len * count == write(fd, burst, (size_t) (len * count)));
+    free(burst);
+    free(encoded);
+}
+
+// reads the next message, which must be the valve alarm given
+static BufferItem *expect(int timeout_ms, int valve_no, const char *text, const char *from) {
+    BufferItem *item = read_message_wait(timeout_ms);
+    assert(NULL != item);
+    assert(HARD_ERROR_VALVE == item->msg.type);
+    assert(valve_no == item->msg.data.hardware_valve.valve_no);
+    assert(0 == strcmp(text, item->msg.data.hardware_valve.message->str));
+    assert(inet_addr(from) == item->address.s_addr);
+    assert(item->first_time <= item->recv_time);
+    return item;
+}
+
+static void test_storm(ServerBackend backend, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.backend = backend;
+    options.coalesce_window_ms = WINDOW_MS;
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    int fd = connect_from("127.0.0.2", addr);
+    int other_fd = connect_from("127.0.0.3", addr);
+
+    // the first of each is through straight away. The same message from another node, or about another valve, is a different message
+    send_valves(fd, 3, "valve 3 broke", STORM);
+    send_valves(fd, 4, "valve 3 broke", 1);
+    send_valves(other_fd, 3, "valve 3 broke", 1);
+    BufferItem *items[3];
+    for (unsigned int i = 0; i < 3; i++) {
+        items[i] = read_message_wait(WINDOW_MS / 2);
+        assert(NULL != items[i]);
+        assert(1 == items[i]->repeats);
+        assert(items[i]->first_time == items[i]->recv_time);
+    }
+    free_bufferitems(items, 3);
+
+    // the rest of the storm arrives as one item once the window is over
+    BufferItem *item = expect(5 * WINDOW_MS, 3, "valve 3 broke", "127.0.0.2");
+    assert(STORM - 1 == item->repeats);
+    free_bufferitem(item);
+    IngressStats stats;
+    server_ingress_stats(&stats);
+    assert(STORM - 1 == stats.coalesced);
+
+    // it carries on: one item per window
+    send_valves(fd, 3, "valve 3 broke", 10);
+    item = expect(5 * WINDOW_MS, 3, "valve 3 broke", "127.0.0.2");
+    assert(10 == item->repeats);
+    free_bufferitem(item);
+
+    // then it stops. A window later it has been forgotten and the next one comes straight through
+    usleep(3 * WINDOW_MS * 1000);
+    assert(NULL == read_message());
+    send_valves(fd, 3, "valve 3 broke", 1);
+    item = expect(WINDOW_MS / 2, 3, "valve 3 broke", "127.0.0.2");
+    assert(1 == item->repeats);
+    free_bufferitem(item);
+
+    // anything still held when the server stops is freed
+    send_valves(fd, 3, "valve 3 broke", 5);
+    close(fd);
+    close(other_fd);
+    stop_server();
+    free(addr);
+}
+
+int main(void) {
+    test_storm(SERVER_BACKEND_EPOLL, 2025);
+    test_storm(SERVER_BACKEND_IO_URING, 2026);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -17,6 +17,11 @@
 #include <unistd.h>
 #include <string.h>
 
+// the server reads messages in on its own thread so they might not be in the queue yet
+static BufferItem *wait_for_message(void) {
+    return read_message_wait(1000);
+}
+
 // creates a server and client and tests that messages can be sent successfully between them
 int main(void) {
     // sent as the body of a software error
@@ -63,7 +68,7 @@ int main(void) {
     
     // get messages from the queue
     for (unsigned int i = 0; i < num_messages; i++) {
-        BufferItem *soft_err = read_message(); // if this is failing then first try increasing TIMING_DELAY
+        BufferItem *soft_err = wait_for_message();
         assert(NULL != soft_err);
         // same type
         assert(soft_err->msg.type == msg.type);
@@ -74,7 +79,7 @@ int main(void) {
     }
     
     // get the disconnect message from the queue
-    BufferItem *disconnect = read_message();
+    BufferItem *disconnect = wait_for_message();
     assert(NULL != disconnect);
     
     // same type
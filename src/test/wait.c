@@ -0,0 +1,154 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/wait.c
+ * system test for read_message_wait: timeouts, being woken up by the reactor and by stop_server, and several readers at once
+ */
+
+// includes
+#include "config.h"
+#include "edsac_server.h"
+#include "edsac_representation.h"
+#include "edsac_arguments.h"
+#include "common.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define NUM_MESSAGES 1000
+
+// sends NUM_MESSAGES in one go after a little while, so that the reader is asleep when they arrive
+static void *send_burst(int *fd) {
+    Message msg;
+    software_error(&msg, "hello world!");
+    char *encoded = NULL;
+    ssize_t len = encode_message(&msg, &encoded);
+    assert(len > 0);
+
+    char *burst = malloc((size_t) len * NUM_MESSAGES);
+    assert(NULL != burst);
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        memcpy(burst + (size_t) len * i, encoded, (size_t) len);
+    }
+
+    usleep(50000);
+    assert((ssize_t) len * NUM_MESSAGES == write(*fd, burst, (size_t) len * NUM_MESSAGES));
+
+    free(burst);
+    free(encoded);
+    free_message(&msg);
+    return NULL;
+}
+
+static void *stop_later(__attribute__((unused)) void *arg) {
+    usleep(50000);
+    stop_server();
+    return NULL;
+}
+
+static void test_wait(unsigned int wait_spin_us, uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+
+    ServerOptions options;
+    server_default_options(&options);
+    options.wait_spin_us = wait_spin_us;
+    assert(true == start_server_with_options(addr, sizeof(struct sockaddr_in), &options));
+
+    // nothing to read
+    double start = now();
+    assert(NULL == read_message_wait(20));
+    double waited = now() - start;
+    assert(waited >= 0.02);
+    assert(waited < 1);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    pthread_t sender;
+    assert(0 == pthread_create(&sender, NULL, (void *(*)(void *)) send_burst, &fd));
+
+    // everything arrives without polling and the burst doesn't cost a wake up per message
+    IngressStats stats;
+    server_ingress_stats(&stats);
+    size_t wakeups = stats.reader_wakeups;
+    for (unsigned int i = 0; i < NUM_MESSAGES; i++) {
+        BufferItem *item = read_message_wait(5000);
+        assert(NULL != item);
+        assert(0 == strcmp("hello world!", item->msg.data.software.message->str));
+        free_bufferitem(item);
+    }
+    server_ingress_stats(&stats);
+    printf("%zu wake ups for %u messages\n", stats.reader_wakeups - wakeups, NUM_MESSAGES);
+    assert(stats.reader_wakeups - wakeups < NUM_MESSAGES / 10);
+
+    assert(0 == pthread_join(sender, NULL));
+    close(fd);
+    BufferItem *item = read_message_wait(5000);
+    assert(NULL != item);
+    assert(0 == strcmp("Connection closed", item->msg.data.software.message->str));
+    free_bufferitem(item);
+
+    // stop_server wakes up a reader who would otherwise wait forever
+    pthread_t stopper;
+    assert(0 == pthread_create(&stopper, NULL, stop_later, NULL));
+    assert(NULL == read_message_wait(-1));
+    assert(0 == pthread_join(stopper, NULL));
+
+    free(addr);
+}
+
+#define NUM_READERS 4
+
+// reads until nothing turns up for a second
+static void *read_until_quiet(size_t *count) {
+    for (BufferItem *item = read_message_wait(1000); NULL != item; item = read_message_wait(1000)) {
+        assert(0 == strcmp("hello world!", item->msg.data.software.message->str));
+        free_bufferitem(item);
+        *count += 1;
+    }
+    return NULL;
+}
+
+// with the plain start_server several threads can read at once and every message goes to exactly one of them
+static void test_several_readers(uint16_t port) {
+    struct sockaddr *addr = alloc_addr("127.0.0.1", port);
+    assert(NULL != addr);
+    assert(true == start_server(addr, sizeof(struct sockaddr_in)));
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(-1 != fd);
+    assert(0 == connect(fd, addr, sizeof(struct sockaddr_in)));
+    pthread_t sender;
+    assert(0 == pthread_create(&sender, NULL, (void *(*)(void *)) send_burst, &fd));
+
+    pthread_t readers[NUM_READERS];
+    size_t counts[NUM_READERS] = {0};
+    for (unsigned int i = 0; i < NUM_READERS; i++) {
+        assert(0 == pthread_create(&readers[i], NULL, (void *(*)(void *)) read_until_quiet, &counts[i]));
+    }
+    size_t total = 0;
+    for (unsigned int i = 0; i < NUM_READERS; i++) {
+        assert(0 == pthread_join(readers[i], NULL));
+        total += counts[i];
+    }
+    assert(0 == pthread_join(sender, NULL));
+    assert(NUM_MESSAGES == total);
+
+    close(fd);
+    free(addr);
+    stop_server();
+}
+
+int main(void) {
+    test_wait(0, 2009);
+    test_wait(50, 2010);
+    test_several_readers(2033);
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
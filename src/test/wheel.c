@@ -0,0 +1,142 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * test/wheel.c
+ * Testsuite for wheel.c
+ */
+
+#include "config.h"
+#include "edsac_wheel.h"
+#include <stdlib.h> // EXIT_*
+#include <stdio.h>
+#include <assert.h>
+
+static void test_basic(void) {
+    TimerWheel wheel;
+    wheel_init(&wheel, 1000);
+    assert(0 == wheel_next_expiry(&wheel));
+
+    WheelTimer timers[4];
+    for (unsigned int i = 0; i < 4; i++) {
+        wheel_timer_init(&timers[i]);
+        assert(!wheel_pending(&timers[i]));
+    }
+
+    // one on each level
+    wheel_schedule(&wheel, &timers[0], 1010);
+    wheel_schedule(&wheel, &timers[1], 1100);
+    wheel_schedule(&wheel, &timers[2], 6000);
+    wheel_schedule(&wheel, &timers[3], 300000);
+    assert(wheel_pending(&timers[0]));
+    assert(1010 == wheel_next_expiry(&wheel));
+
+    // moving a timer later
+    wheel_schedule(&wheel, &timers[0], 1020);
+    assert(4 == wheel.count);
+    assert(NULL == wheel_advance(&wheel, 1019));
+    assert(1020 == wheel_next_expiry(&wheel));
+    WheelTimer *expired = wheel_advance(&wheel, 1020);
+    assert((&timers[0] == expired) && (NULL == expired->next));
+    assert(!wheel_pending(&timers[0]));
+
+    // nothing goes off early or late even after being moved down a level or two
+    assert(NULL == wheel_advance(&wheel, 1099));
+    assert(&timers[1] == wheel_advance(&wheel, 1100));
+    assert(NULL == wheel_advance(&wheel, 5999));
+    assert(&timers[2] == wheel_advance(&wheel, 6000));
+
+    // cancelling
+    wheel_cancel(&wheel, &timers[3]);
+    assert(!wheel_pending(&timers[3]));
+    assert(0 == wheel.count);
+    assert(NULL == wheel_advance(&wheel, 400000));
+
+    // something which is already due goes off on the next tick
+    wheel_schedule(&wheel, &timers[3], 5);
+    assert(&timers[3] == wheel_advance(&wheel, 400001));
+
+    // several at once come out in the order they were due
+    wheel_schedule(&wheel, &timers[0], 400100);
+    wheel_schedule(&wheel, &timers[1], 400010);
+    wheel_schedule(&wheel, &timers[2], 400050);
+    expired = wheel_advance(&wheel, 500000);
+    assert(&timers[1] == expired);
+    assert(&timers[2] == expired->next);
+    assert(&timers[0] == expired->next->next);
+    assert(NULL == expired->next->next->next);
+}
+
+#define NUM_TIMERS 2000
+
+// lots of timers being moved and cancelled, checked against the obvious way of doing it
+static void test_random(void) {
+    TimerWheel wheel;
+    uint64_t now = 12345;
+    wheel_init(&wheel, now);
+
+    static WheelTimer timers[NUM_TIMERS];
+    static bool scheduled[NUM_TIMERS];
+    static uint64_t expires[NUM_TIMERS];
+    for (unsigned int i = 0; i < NUM_TIMERS; i++) {
+        wheel_timer_init(&timers[i]);
+        scheduled[i] = false;
+    }
+
+    srand(42);
+    for (unsigned int round = 0; round < 20000; round++) {
+        // change some timers: anything from the next tick to beyond the top level
+        for (unsigned int n = 0; n < 10; n++) {
+            unsigned int i = (unsigned int) rand() % NUM_TIMERS;
+            int choice = rand() % 10;
+            if (0 == choice) {
+                wheel_cancel(&wheel, &timers[i]);
+                scheduled[i] = false;
+                continue;
+            }
+
+            uint64_t ahead = 1 + (uint64_t) rand() % ((choice < 5) ? 100 : (choice < 9) ? 300000 : 20000000);
+            wheel_schedule(&wheel, &timers[i], now + ahead);
+            scheduled[i] = true;
+            expires[i] = now + ahead;
+        }
+
+        // nothing goes off before wheel_next_expiry
+        uint64_t next = wheel_next_expiry(&wheel);
+        uint64_t first = 0;
+        size_t count = 0;
+        for (unsigned int i = 0; i < NUM_TIMERS; i++) {
+            if (scheduled[i]) {
+                count += 1;
+                first = ((0 == first) || (expires[i] < first)) ? expires[i] : first;
+            }
+        }
+        assert(count == wheel.count);
+        assert((0 == count) ? (0 == next) : ((next > now) && (next <= first)));
+
+        // what goes off is exactly what is due, in order
+        uint64_t later = now + 1 + (uint64_t) rand() % 2000;
+        uint64_t last = 0;
+        for (WheelTimer *timer = wheel_advance(&wheel, later); NULL != timer; timer = timer->next) {
+            unsigned int i = (unsigned int) (timer - timers);
+            assert(scheduled[i]);
+            assert((expires[i] > now) && (expires[i] <= later));
+            assert(expires[i] >= last);
+            assert(!wheel_pending(timer));
+            last = expires[i];
+            scheduled[i] = false;
+        }
+        now = later;
+        for (unsigned int i = 0; i < NUM_TIMERS; i++) {
+            assert(!scheduled[i] || (expires[i] > now));
+            assert(scheduled[i] == wheel_pending(&timers[i]));
+        }
+    }
+}
+
+int main(void) {
+    test_basic();
+    test_random();
+
+    puts("passed");
+    return EXIT_SUCCESS;
+}
@@ -19,7 +19,7 @@ bool create_timer(timer_handler_t handler, timer_t *timer_id, time_t seconds) {
 
     // notify a therad
     sig_event.sigev_notify = SIGEV_THREAD;
-    sig_event.sigev_notify_function = (void (*) (union sigval)) handler;
+    sig_event.sigev_notify_function = (void (*) (union sigval)) (void (*) (void)) handler; // through a generic function pointer for -Wcast-function-type
 
     // create timer
     if (0 != timer_create(CLOCK_MONOTONIC, &sig_event, timer_id)) {
@@ -0,0 +1,395 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * uring.c
+ * Thin wrapper around the io_uring system calls used by the server's io_uring backend
+ */
+
+/* We talk to the kernel directly instead of using liburing so that there are no new dependencies.
+Only what the server needs is here: multishot accept, multishot recv into a ring of provided buffers, single reads and cancelling.
+
+If the headers we were built against are too old for any of this then every uring_init fails and the server uses epoll instead.
+*/
+
+// includes
+#include "config.h"
+#include "edsac_uring.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(HAVE_LINUX_IO_URING_H)
+#include <linux/io_uring.h>
+#endif
+
+// multishot recv is the newest thing we need (linux 6.0)
+#if defined(IORING_RECV_MULTISHOT)
+#define URING_SUPPORTED 1
+#endif
+
+#if defined(URING_SUPPORTED)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+// the provided buffer group used for receives
+#define BUFFER_GROUP 0
+
+// make sure that the kernel can do everything that we need
+static bool probe(int fd) {
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (NULL == probe) {
+        return false;
+    }
+
+    bool ok = false;
+    if (0 == syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)) {
+        // IORING_OP_SEND_ZC arrived in the same kernel release as multishot recv so it tells us that multishot recv is there too
+        ok = (probe->last_op >= IORING_OP_SEND_ZC)
+            && (probe->ops[IORING_OP_ACCEPT].flags & IO_URING_OP_SUPPORTED)
+            && (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED)
+            && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return ok;
+}
+
+// adds a provided buffer to the buffer ring. The kernel doesn't see it until publish_buffers
+static void add_buffer(Uring *ring, uint16_t buffer) {
+    struct io_uring_buf_ring *buf_ring = ring->buf_ring;
+    struct io_uring_buf *buf = &(buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)]);
+
+    buf->addr = (uint64_t) (uintptr_t) uring_buffer(ring, buffer);
+    buf->len = ring->buf_size;
+    buf->bid = buffer;
+
+    ring->buf_tail += 1;
+}
+
+// lets the kernel use every buffer which has been added
+static void publish_buffers(Uring *ring) {
+    struct io_uring_buf_ring *buf_ring = ring->buf_ring;
+    __atomic_store_n(&(buf_ring->tail), (uint16_t) ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// sets up the ring of provided buffers
+static bool init_buffers(Uring *ring, unsigned buf_count, unsigned buf_size) {
+    // the kernel needs a power of two number of buffers
+    if ((0 == buf_count) || (0 != (buf_count & (buf_count - 1))) || (buf_count > 32768)) {
+        return false;
+    }
+
+    ring->buf_count = buf_count;
+    ring->buf_size = buf_size;
+
+    // the ring must be page aligned
+    ring->buf_ring_size = buf_count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == ring->buf_ring) {
+        ring->buf_ring = NULL;
+        return false;
+    }
+
+    ring->buffers = malloc((size_t) buf_count * buf_size);
+    if (NULL == ring->buffers) {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = BUFFER_GROUP;
+    if (0 != syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < buf_count; i++) {
+        add_buffer(ring, (uint16_t) i);
+    }
+    publish_buffers(ring);
+
+    return true;
+}
+
+// sets up a ring with entries submission queue entries and buf_count provided buffers of buf_size bytes each
+bool uring_init(Uring *ring, unsigned entries, unsigned buf_count, unsigned buf_size) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    // we reap completions in batches so give the completion queue plenty of room
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    long fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (-1 == fd) {
+        return false;
+    }
+    ring->fd = (int) fd;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !probe(ring->fd)) {
+        uring_free(ring);
+        return false;
+    }
+
+    // both queues live in one mapping
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sq_ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->sq_ring) {
+        ring->sq_ring = NULL;
+        uring_free(ring);
+        return false;
+    }
+    ring->cq_ring = ring->sq_ring;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->sqes) {
+        ring->sqes = NULL;
+        uring_free(ring);
+        return false;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *(ring->sq_tail);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    if (!init_buffers(ring, buf_count, buf_size)) {
+        uring_free(ring);
+        return false;
+    }
+
+    return true;
+}
+
+// tears down a ring
+void uring_free(Uring *ring) {
+    if (-1 != ring->fd) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+
+    if (NULL != ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+
+    if (NULL != ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        ring->sq_ring = NULL;
+        ring->cq_ring = NULL;
+    }
+
+    if (NULL != ring->buf_ring) {
+        munmap(ring->buf_ring, ring->buf_ring_size);
+        ring->buf_ring = NULL;
+    }
+
+    free(ring->buffers);
+    ring->buffers = NULL;
+}
+
+// hands everything queued to the kernel and optionally waits for completions
+// returns 0 or -errno
+static int enter(Uring *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    if ((0 == to_submit) && (0 == wait_nr)) {
+        return 0;
+    }
+
+    if (-1 == syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags, NULL, 0)) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+// gets the next free submission queue entry
+// returns NULL if the submission queue is full even after submitting everything
+static struct io_uring_sqe *get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        if (0 != enter(ring, 0)) {
+            return NULL;
+        }
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &(((struct io_uring_sqe *) ring->sqes)[index]);
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail += 1;
+
+    return sqe;
+}
+
+// queue a multishot accept on fd
+bool uring_accept_multishot(Uring *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (NULL == sqe) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+// queue a multishot recv on fd which receives into the provided buffers
+bool uring_recv_multishot(Uring *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (NULL == sqe) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+// queue a single read into buf
+bool uring_read(Uring *ring, int fd, void *buf, size_t len, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (NULL == sqe) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = (uint32_t) len;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+// queues an IORING_OP_ASYNC_CANCEL for the request tagged target
+bool uring_cancel(Uring *ring, uint64_t target, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (NULL == sqe) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+
+    return true;
+}
+
+// submits everything queued and waits for at least one completion
+int uring_wait(Uring *ring) {
+    publish_buffers(ring);
+    return enter(ring, 1);
+}
+
+// takes the next completion off the completion queue
+bool uring_next_completion(Uring *ring, UringCompletion *completion) {
+    unsigned head = __atomic_load_n(ring->cq_head, __ATOMIC_RELAXED);
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return false;
+    }
+
+    struct io_uring_cqe *cqe = &(((struct io_uring_cqe *) ring->cqes)[head & ring->cq_mask]);
+    completion->user_data = cqe->user_data;
+    completion->res = cqe->res;
+    completion->more = (0 != (cqe->flags & IORING_CQE_F_MORE));
+    completion->has_buffer = (0 != (cqe->flags & IORING_CQE_F_BUFFER));
+    completion->buffer = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// the data in a provided buffer
+char *uring_buffer(Uring *ring, uint16_t buffer) {
+    return ring->buffers + (size_t) buffer * ring->buf_size;
+}
+
+// gives a provided buffer back to the kernel
+void uring_recycle_buffer(Uring *ring, uint16_t buffer) {
+    add_buffer(ring, buffer);
+}
+
+#else // URING_SUPPORTED
+
+// built without io_uring support: everything fails so the server uses epoll
+
+bool uring_init(Uring *ring, __attribute__((unused)) unsigned entries, __attribute__((unused)) unsigned buf_count, __attribute__((unused)) unsigned buf_size) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    return false;
+}
+
+void uring_free(__attribute__((unused)) Uring *ring) {
+}
+
+bool uring_accept_multishot(__attribute__((unused)) Uring *ring, __attribute__((unused)) int fd, __attribute__((unused)) uint64_t user_data) {
+    return false;
+}
+
+bool uring_recv_multishot(__attribute__((unused)) Uring *ring, __attribute__((unused)) int fd, __attribute__((unused)) uint64_t user_data) {
+    return false;
+}
+
+bool uring_read(__attribute__((unused)) Uring *ring, __attribute__((unused)) int fd, __attribute__((unused)) void *buf, __attribute__((unused)) size_t len, __attribute__((unused)) uint64_t user_data) {
+    return false;
+}
+
+bool uring_cancel(__attribute__((unused)) Uring *ring, __attribute__((unused)) uint64_t target, __attribute__((unused)) uint64_t user_data) {
+    return false;
+}
+
+int uring_wait(__attribute__((unused)) Uring *ring) {
+    return -ENOSYS;
+}
+
+bool uring_next_completion(__attribute__((unused)) Uring *ring, __attribute__((unused)) UringCompletion *completion) {
+    return false;
+}
+
+char *uring_buffer(__attribute__((unused)) Uring *ring, __attribute__((unused)) uint16_t buffer) {
+    return NULL;
+}
+
+void uring_recycle_buffer(__attribute__((unused)) Uring *ring, __attribute__((unused)) uint16_t buffer) {
+}
+
+#endif // URING_SUPPORTED
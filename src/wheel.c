@@ -0,0 +1,156 @@
+/*
+ * Copyright 2017
+ * GPL3 Licensed
+ * wheel.c
+ * A hierarchical timing wheel (see edsac_wheel.h)
+ */
+
+// includes
+#include "config.h"
+#include "edsac_wheel.h"
+#include <string.h>
+
+#define SLOT_MASK ((uint64_t) WHEEL_SLOTS - 1)
+
+// how many ticks a slot on level covers
+static inline uint64_t level_span(unsigned int level) {
+    return (uint64_t) 1 << (WHEEL_BITS * level);
+}
+
+void wheel_init(TimerWheel *wheel, uint64_t now) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+void wheel_timer_init(WheelTimer *timer) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+}
+
+static void link_timer(WheelTimer **slot, WheelTimer *timer) {
+    timer->next = *slot;
+    if (NULL != timer->next) {
+        timer->next->pprev = &(timer->next);
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void unlink_timer(WheelTimer *timer) {
+    *(timer->pprev) = timer->next;
+    if (NULL != timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->pprev = NULL;
+}
+
+// puts a timer in the slot for when it expires, on the lowest level which reaches that far from now
+static void place_timer(TimerWheel *wheel, WheelTimer *timer) {
+    uint64_t when = (timer->expires > wheel->now) ? timer->expires : wheel->now + 1;
+    uint64_t delta = when - wheel->now;
+
+    unsigned int level = 0;
+    while ((level < WHEEL_LEVELS - 1) && (delta >= level_span(level + 1))) {
+        level++;
+    }
+    // too far ahead for the top level: it goes as far ahead as there is and is moved down again from there
+    if (delta >= level_span(WHEEL_LEVELS)) {
+        when = wheel->now + level_span(WHEEL_LEVELS) - 1;
+    }
+
+    link_timer(&(wheel->slots[level][(when >> (WHEEL_BITS * level)) & SLOT_MASK]), timer);
+}
+
+void wheel_schedule(TimerWheel *wheel, WheelTimer *timer, uint64_t expires) {
+    if (NULL != timer->pprev) {
+        unlink_timer(timer);
+    } else {
+        wheel->count += 1;
+    }
+
+    timer->expires = expires;
+    place_timer(wheel, timer);
+}
+
+void wheel_cancel(TimerWheel *wheel, WheelTimer *timer) {
+    if (NULL != timer->pprev) {
+        unlink_timer(timer);
+        wheel->count -= 1;
+    }
+}
+
+bool wheel_pending(const WheelTimer *timer) {
+    return NULL != timer->pprev;
+}
+
+// adds a timer which went off to the end of a list
+static void hand_out(TimerWheel *wheel, WheelTimer *timer, WheelTimer ***tail) {
+    wheel->count -= 1;
+    timer->pprev = NULL;
+    timer->next = NULL;
+    **tail = timer;
+    *tail = &(timer->next);
+}
+
+WheelTimer *wheel_advance(TimerWheel *wheel, uint64_t now) {
+    WheelTimer *expired = NULL;
+    WheelTimer **tail = &expired;
+
+    while ((wheel->now < now) && (0 != wheel->count)) {
+        uint64_t tick = ++(wheel->now);
+
+        // higher level slots which start on this tick are moved down to where their timers now belong
+        for (unsigned int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if (0 != (tick & (level_span(level) - 1))) {
+                continue;
+            }
+
+            WheelTimer **slot = &(wheel->slots[level][(tick >> (WHEEL_BITS * level)) & SLOT_MASK]);
+            WheelTimer *timer = *slot;
+            *slot = NULL;
+            while (NULL != timer) {
+                WheelTimer *next = timer->next;
+                if (timer->expires <= tick) {
+                    hand_out(wheel, timer, &tail);
+                } else {
+                    place_timer(wheel, timer);
+                }
+                timer = next;
+            }
+        }
+
+        WheelTimer **slot = &(wheel->slots[0][tick & SLOT_MASK]);
+        while (NULL != *slot) {
+            WheelTimer *timer = *slot;
+            unlink_timer(timer);
+            hand_out(wheel, timer, &tail);
+        }
+    }
+
+    // nothing is left to go off so time can jump straight there
+    if (wheel->now < now) {
+        wheel->now = now;
+    }
+    return expired;
+}
+
+uint64_t wheel_next_expiry(const TimerWheel *wheel) {
+    if (0 == wheel->count) {
+        return 0;
+    }
+
+    // a timer goes off on its level 0 slot's tick, and nothing on a higher level can go off before its slot is moved down
+    for (uint64_t tick = wheel->now + 1; tick <= wheel->now + WHEEL_SLOTS; tick++) {
+        if (NULL != wheel->slots[0][tick & SLOT_MASK]) {
+            return tick;
+        }
+        for (unsigned int level = 1; (level < WHEEL_LEVELS) && (0 == (tick & (level_span(level) - 1))); level++) {
+            if (NULL != wheel->slots[level][(tick >> (WHEEL_BITS * level)) & SLOT_MASK]) {
+                return tick;
+            }
+        }
+    }
+    return wheel->now + WHEEL_SLOTS;
+}